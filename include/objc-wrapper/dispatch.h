@@ -29,6 +29,22 @@ extern dispatch_data_t SYSV_ABI
 dispatch_data_create(const void *buffer, size_t size, dispatch_queue_t queue,
                      nullptr_t destructor /* don't use block*/);
 
+struct __SM50CompiledBitcode;
+
+/**
+ * Wrap compiled bitcode without copying it. Ownership of `bitcode` is
+ * transferred: it's destroyed together with the returned object, so the caller
+ * must not call SM50DestroyBitcode on it.
+ */
+extern dispatch_data_t SYSV_ABI
+winemetal_create_bitcode_data(struct __SM50CompiledBitcode *bitcode);
+
+/**
+ * Wrap memory that outlives the returned object, without copying it.
+ */
+extern dispatch_data_t SYSV_ABI
+winemetal_create_unowned_data(const void *buffer, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "airconv_context.hpp"
 #include "airconv_public.h"
+#include "airconv_shader_pack.h"
 #include "metallib_writer.hpp"
 #include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
@@ -13,9 +14,18 @@
 #include "llvm/Support/Error.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/WithColor.h"
+#include <cstdio>
+#include <cstring>
+#include <map>
 #include <system_error>
+#include <vector>
+#include <version.h>
+
+#define XXH_INLINE_ALL
+#include "../util/xxhash/xxhash.h"
 
 #ifdef __WIN32
 #include "d3dcompiler.h"
@@ -46,6 +56,11 @@ static cl::opt<bool>
 static cl::opt<bool>
   EmitMetallib("A", cl::init(false), cl::desc("Write output as .metallib"));
 
+static cl::opt<bool> EmitShaderPack(
+  "pack", cl::init(false),
+  cl::desc("Build a shader pack from a shader dump directory")
+);
+
 static cl::opt<bool> DisassembleDXBC(
   "disas-dxbc", cl::init(false), cl::desc("Disassemble dxbc shader")
 );
@@ -116,6 +131,233 @@ llvm::Error convertDXBC(
 
 static ExitOnError ExitOnErr;
 
+namespace {
+
+struct PackedVariant {
+  std::vector<char> desc;
+  uint64_t metallib_offset = 0;
+  uint64_t metallib_size = 0;
+};
+
+struct PackedShader {
+  uint64_t reflection_offset = 0;
+  // keyed by (KeyHi, KeyLo)
+  std::map<std::pair<uint64_t, uint64_t>, PackedVariant> variants;
+};
+
+void AlignPayload(std::vector<char> &payload) {
+  payload.resize((payload.size() + 15) & ~size_t(15));
+}
+
+template <typename T> uint64_t AppendPayload(std::vector<char> &payload, const T *data, size_t count) {
+  uint64_t offset = payload.size();
+  payload.insert(payload.end(), (const char *)data, (const char *)(data + count));
+  return offset;
+}
+
+/* returns false if the variant is skipped */
+bool CompilePackedVariant(
+  SM50Shader *sm50, const DXMT_SHADER_PACK_VARIANT_DESC &desc, const SM50_IA_INPUT_ELEMENT *elements,
+  std::vector<char> &payload, PackedVariant &variant
+) {
+  SM50_SHADER_PSO_PIXEL_SHADER_DATA data_pixel;
+  SM50_SHADER_GS_PASS_THROUGH_DATA data_gs_passthrough;
+  SM50_SHADER_IA_INPUT_LAYOUT_DATA data_ia_layout;
+  SM50_SHADER_COMPILATION_ARGUMENT_DATA *args = nullptr;
+
+  switch (desc.Type) {
+  case DXMT_SHADER_PACK_VARIANT_DEFAULT:
+    break;
+  case DXMT_SHADER_PACK_VARIANT_PIXEL:
+    data_pixel.next = nullptr;
+    data_pixel.type = SM50_SHADER_PSO_PIXEL_SHADER;
+    data_pixel.sample_mask = desc.SampleMask;
+    data_pixel.dual_source_blending = desc.DualSourceBlending;
+    data_pixel.disable_depth_output = desc.DisableDepthOutput;
+    args = (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&data_pixel;
+    break;
+  case DXMT_SHADER_PACK_VARIANT_VERTEX:
+    data_gs_passthrough.next = nullptr;
+    data_gs_passthrough.type = SM50_SHADER_GS_PASS_THROUGH;
+    data_gs_passthrough.DataEncoded = desc.GSPassthrough;
+    data_gs_passthrough.RasterizationDisabled = desc.RasterizationDisabled;
+    if (desc.HasInputLayout) {
+      data_gs_passthrough.next = &data_ia_layout;
+      data_ia_layout.next = nullptr;
+      data_ia_layout.type = SM50_SHADER_IA_INPUT_LAYOUT;
+      data_ia_layout.index_buffer_format = SM50_INDEX_BUFFER_FORMAT_NONE;
+      data_ia_layout.slot_mask = desc.InputSlotMask;
+      data_ia_layout.num_elements = desc.NumInputElements;
+      data_ia_layout.elements = const_cast<SM50_IA_INPUT_ELEMENT *>(elements);
+    }
+    args = (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&data_gs_passthrough;
+    break;
+  default:
+    errs() << "unknown variant type " << (uint32_t)desc.Type << ", skipped\n";
+    return false;
+  }
+
+  SM50CompiledBitcode *bitcode = nullptr;
+  SM50Error *err = nullptr;
+  if (auto ret = SM50Compile(sm50, args, DXMT_SHADER_PACK_FUNCTION_NAME, &bitcode, &err)) {
+    if (ret == 42) {
+      errs() << "failed assertion, variant skipped\n";
+    } else {
+      errs() << SM50GetErrorMesssage(err) << ", variant skipped\n";
+      SM50FreeError(err);
+    }
+    return false;
+  }
+  MTL_SHADER_BITCODE data;
+  SM50GetCompiledBitcode(bitcode, &data);
+  AlignPayload(payload);
+  variant.metallib_offset = AppendPayload(payload, data.Data, data.Size);
+  variant.metallib_size = data.Size;
+  SM50DestroyBitcode(bitcode);
+  return true;
+}
+
+/**
+Build a shader pack from a dump directory. See airconv_shader_pack.h
+ */
+int WriteShaderPack(StringRef Directory, StringRef Output) {
+  SmallString<256> ListPath(Directory);
+  sys::path::append(ListPath, DXMT_SHADER_PACK_VARIANT_LIST);
+  auto ListOrErr = MemoryBuffer::getFile(ListPath, /*IsText=*/false);
+  if (std::error_code EC = ListOrErr.getError()) {
+    errs() << ListPath << ": " << EC.message() << '\n';
+    return 1;
+  }
+
+  // keyed by (HashHi, HashLo), the order of the shader table
+  std::map<std::pair<uint64_t, uint64_t>, PackedShader> shaders;
+  const char *ptr = ListOrErr->get()->getBufferStart();
+  const char *end = ListOrErr->get()->getBufferEnd();
+  while (ptr + sizeof(DXMT_SHADER_PACK_VARIANT_RECORD) <= end) {
+    DXMT_SHADER_PACK_VARIANT_RECORD record;
+    memcpy(&record, ptr, sizeof(record));
+    size_t desc_size = sizeof(DXMT_SHADER_PACK_VARIANT_DESC) +
+                       record.Desc.NumInputElements * sizeof(SM50_IA_INPUT_ELEMENT);
+    const char *desc = ptr + offsetof(DXMT_SHADER_PACK_VARIANT_RECORD, Desc);
+    if (desc + desc_size > end) {
+      errs() << ListPath << ": truncated record\n";
+      break;
+    }
+    XXH128_hash_t key = XXH3_128bits(desc, desc_size);
+    auto &variant = shaders[{record.HashHi, record.HashLo}].variants[{key.high64, key.low64}];
+    variant.desc.assign(desc, desc + desc_size);
+    ptr = desc + desc_size;
+  }
+
+  std::vector<char> payload;
+  uint32_t num_variants = 0;
+  for (auto &[hash, shader] : shaders) {
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx%016llx.dxbc", (unsigned long long)hash.first,
+             (unsigned long long)hash.second);
+    SmallString<256> ShaderPath(Directory);
+    sys::path::append(ShaderPath, name);
+    auto FileOrErr = MemoryBuffer::getFile(ShaderPath, /*IsText=*/false);
+    if (std::error_code EC = FileOrErr.getError()) {
+      errs() << ShaderPath << ": " << EC.message() << ", shader skipped\n";
+      shader.variants.clear();
+      continue;
+    }
+
+    SM50Shader *sm50;
+    SM50Error *err;
+    MTL_SHADER_REFLECTION reflection;
+    if (SM50Initialize(
+          FileOrErr->get()->getBufferStart(), FileOrErr->get()->getBufferSize(), &sm50, &reflection, &err
+        )) {
+      errs() << ShaderPath << ": " << SM50GetErrorMesssage(err) << ", shader skipped\n";
+      SM50FreeError(err);
+      shader.variants.clear();
+      continue;
+    }
+
+    MTL_SHADER_REFLECTION serialized = reflection;
+    serialized.ConstantBuffers = nullptr;
+    serialized.Arguments = nullptr;
+    AlignPayload(payload);
+    shader.reflection_offset = AppendPayload(payload, &serialized, 1);
+    AppendPayload(payload, reflection.ConstantBuffers, reflection.NumConstantBuffers);
+    AppendPayload(payload, reflection.Arguments, reflection.NumArguments);
+
+    for (auto it = shader.variants.begin(); it != shader.variants.end();) {
+      DXMT_SHADER_PACK_VARIANT_DESC desc;
+      memcpy(&desc, it->second.desc.data(), sizeof(desc));
+      auto elements = (const SM50_IA_INPUT_ELEMENT *)(it->second.desc.data() + sizeof(desc));
+      if (CompilePackedVariant(sm50, desc, elements, payload, it->second)) {
+        num_variants++;
+        it++;
+      } else {
+        it = shader.variants.erase(it);
+      }
+    }
+    SM50Destroy(sm50);
+  }
+
+  uint32_t num_shaders = 0;
+  for (auto &[hash, shader] : shaders)
+    num_shaders += !shader.variants.empty();
+
+  DXMT_SHADER_PACK_HEADER header = {};
+  header.Magic = DXMT_SHADER_PACK_MAGIC;
+  header.Version = DXMT_SHADER_PACK_VERSION;
+  header.NumShaders = num_shaders;
+  header.NumVariants = num_variants;
+  strncpy(header.ConverterVersion, DXMT_VERSION, sizeof(header.ConverterVersion) - 1);
+  header.MetallibVersionMajor = AIRCONV_METALLIB_VERSION_MAJOR;
+  header.MetallibVersionMinor = AIRCONV_METALLIB_VERSION_MINOR;
+  header.MetallibOSVersionMajor = AIRCONV_METALLIB_OS_VERSION_MAJOR;
+  header.MetallibOSVersionMinor = AIRCONV_METALLIB_OS_VERSION_MINOR;
+  header.ShaderTableOffset = (sizeof(header) + 15) & ~uint64_t(15);
+  header.VariantTableOffset =
+    (header.ShaderTableOffset + num_shaders * sizeof(DXMT_SHADER_PACK_SHADER) + 15) & ~uint64_t(15);
+  uint64_t payload_base =
+    (header.VariantTableOffset + num_variants * sizeof(DXMT_SHADER_PACK_VARIANT) + 15) & ~uint64_t(15);
+
+  std::vector<char> tables(payload_base, 0);
+  memcpy(tables.data(), &header, sizeof(header));
+  auto shader_table = (DXMT_SHADER_PACK_SHADER *)(tables.data() + header.ShaderTableOffset);
+  auto variant_table = (DXMT_SHADER_PACK_VARIANT *)(tables.data() + header.VariantTableOffset);
+  uint32_t variant_index = 0;
+  for (auto &[hash, shader] : shaders) {
+    if (shader.variants.empty())
+      continue;
+    shader_table->HashHi = hash.first;
+    shader_table->HashLo = hash.second;
+    shader_table->ReflectionOffset = payload_base + shader.reflection_offset;
+    shader_table->FirstVariant = variant_index;
+    shader_table->NumVariants = shader.variants.size();
+    shader_table++;
+    for (auto &[key, variant] : shader.variants) {
+      variant_table->KeyHi = key.first;
+      variant_table->KeyLo = key.second;
+      variant_table->MetallibOffset = payload_base + variant.metallib_offset;
+      variant_table->MetallibSize = variant.metallib_size;
+      variant_table++;
+      variant_index++;
+    }
+  }
+
+  std::error_code EC;
+  ToolOutputFile Out(Output, EC, sys::fs::OF_None);
+  if (EC) {
+    errs() << EC.message() << '\n';
+    return 1;
+  }
+  Out.os().write(tables.data(), tables.size());
+  Out.os().write(payload.data(), payload.size());
+  Out.keep();
+
+  errs() << "packed " << num_shaders << " shaders, " << num_variants << " variants\n";
+  return 0;
+}
+
+} // namespace
+
 int main(int argc, char **argv) {
   InitLLVM X(argc, argv);
 
@@ -135,6 +377,14 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (EmitShaderPack) {
+    if (OutputFilename.empty()) {
+      StringRef Dir = InputFilename;
+      OutputFilename = Dir.rtrim("/\\").str() + ".dxmtpack";
+    }
+    return WriteShaderPack(InputFilename, OutputFilename);
+  }
+
   if (OutputFilename.empty()) { // Unspecified output, infer it.
     if (InputFilename == "-") {
       OutputFilename = "-";
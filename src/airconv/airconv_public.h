@@ -3,6 +3,12 @@
 #include "stddef.h"
 #include "stdint.h"
 
+/* version and target OS of the metallibs produced by the converter */
+#define AIRCONV_METALLIB_VERSION_MAJOR 2
+#define AIRCONV_METALLIB_VERSION_MINOR 7
+#define AIRCONV_METALLIB_OS_VERSION_MAJOR 14
+#define AIRCONV_METALLIB_OS_VERSION_MINOR 4
+
 #ifdef __cplusplus
 enum class ShaderType {
   Vertex,
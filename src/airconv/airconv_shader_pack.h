@@ -0,0 +1,102 @@
+#pragma once
+
+#include "airconv_public.h"
+#include <stdint.h>
+
+/**
+Offline shader pack
+
+  DXMT_SHADER_PACK_HEADER
+  DXMT_SHADER_PACK_SHADER[NumShaders]    sorted by (HashHi, HashLo)
+  DXMT_SHADER_PACK_VARIANT[NumVariants]  grouped by shader, sorted by key
+  payload                                reflections and metallibs
+
+All offsets are relative to the start of the file and 16-byte aligned. A
+reflection record is a MTL_SHADER_REFLECTION with both pointers zeroed,
+followed by NumConstantBuffers then NumArguments MTL_SM50_SHADER_ARGUMENT.
+Every metallib exports a single function named
+DXMT_SHADER_PACK_FUNCTION_NAME.
+
+The header records the version of the converter and the metallib target, a
+pack is rejected by any other build of DXMT since its codegen may differ.
+
+The pack is produced from a shader dump directory, which contains
+`<hash>.dxbc` for every shader created by the application and a variant list
+(`variants.bin`) made of DXMT_SHADER_PACK_VARIANT_RECORD.
+*/
+
+#define DXMT_SHADER_PACK_MAGIC 0x50535844 // 'DXSP'
+#define DXMT_SHADER_PACK_VERSION 2
+#define DXMT_SHADER_PACK_FUNCTION_NAME "shader_main"
+#define DXMT_SHADER_PACK_VARIANT_LIST "variants.bin"
+
+struct DXMT_SHADER_PACK_HEADER {
+  uint32_t Magic;
+  uint32_t Version;
+  uint32_t NumShaders;
+  uint32_t NumVariants;
+  uint64_t ShaderTableOffset;
+  uint64_t VariantTableOffset;
+  /* DXMT_VERSION of the converter, zero-padded */
+  char ConverterVersion[64];
+  /* AIRCONV_METALLIB_* of the converter */
+  uint16_t MetallibVersionMajor;
+  uint16_t MetallibVersionMinor;
+  uint16_t MetallibOSVersionMajor;
+  uint16_t MetallibOSVersionMinor;
+};
+
+struct DXMT_SHADER_PACK_SHADER {
+  /* XXH3-128 of the DXBC */
+  uint64_t HashLo;
+  uint64_t HashHi;
+  uint64_t ReflectionOffset;
+  uint32_t FirstVariant;
+  uint32_t NumVariants;
+};
+
+struct DXMT_SHADER_PACK_VARIANT {
+  /* XXH3-128 of the canonical variant description */
+  uint64_t KeyLo;
+  uint64_t KeyHi;
+  uint64_t MetallibOffset;
+  uint64_t MetallibSize;
+};
+
+enum DXMT_SHADER_PACK_VARIANT_TYPE : uint32_t {
+  DXMT_SHADER_PACK_VARIANT_DEFAULT = 0,
+  DXMT_SHADER_PACK_VARIANT_VERTEX = 1,
+  DXMT_SHADER_PACK_VARIANT_PIXEL = 2,
+};
+
+/**
+Canonical description of a variant, with every unused field zeroed. It's
+followed by NumInputElements SM50_IA_INPUT_ELEMENT, and the variant key is
+the XXH3-128 of both.
+
+Variants referencing other pipeline objects (tessellation, stream output)
+can't be described independently of the process, so they are never packed.
+*/
+struct DXMT_SHADER_PACK_VARIANT_DESC {
+  enum DXMT_SHADER_PACK_VARIANT_TYPE Type;
+  uint32_t GSPassthrough;
+  uint32_t SampleMask;
+  uint32_t InputSlotMask;
+  uint32_t NumInputElements;
+  uint8_t RasterizationDisabled;
+  uint8_t DualSourceBlending;
+  uint8_t DisableDepthOutput;
+  /* vertex: whether an input layout is bound, even an empty one */
+  uint8_t HasInputLayout;
+};
+
+struct DXMT_SHADER_PACK_VARIANT_RECORD {
+  uint64_t HashLo;
+  uint64_t HashHi;
+  struct DXMT_SHADER_PACK_VARIANT_DESC Desc;
+};
+
+static_assert(sizeof(struct DXMT_SHADER_PACK_HEADER) == 104, "");
+static_assert(sizeof(struct DXMT_SHADER_PACK_VARIANT_DESC) == 24, "");
+static_assert(sizeof(struct DXMT_SHADER_PACK_VARIANT_RECORD) == 40, "");
+static_assert(sizeof(struct SM50_IA_INPUT_ELEMENT) == 20, "");
@@ -37,6 +37,14 @@ public:
 class SM50ErrorInternal {
 public:
   llvm::SmallVector<char, 0> buf;
+
+  /* only allocated on failure, a successful call never touches it */
+  static SM50Error *
+  create(llvm::StringRef msg) {
+    auto error = new SM50ErrorInternal();
+    error->buf.append(msg.begin(), msg.end());
+    return (SM50Error *)error;
+  }
 };
 
 namespace dxmt::dxbc {
@@ -1898,19 +1906,14 @@ int SM50Initialize(
   if (ppError) {
     *ppError = nullptr;
   }
-  auto errorObj = new SM50ErrorInternal();
-  llvm::raw_svector_ostream errorOut(errorObj->buf);
-
   if (ppShader == nullptr) {
-    errorOut << "ppShader can not be null\0";
-    *ppError = (SM50Error *)errorObj;
+    *ppError = SM50ErrorInternal::create("ppShader can not be null");
     return 1;
   }
 
   CDXBCParser DXBCParser;
   if (DXBCParser.ReadDXBC(pBytecode, BytecodeSize) != S_OK) {
-    errorOut << "Invalid DXBC bytecode\0";
-    *ppError = (SM50Error *)errorObj;
+    *ppError = SM50ErrorInternal::create("Invalid DXBC bytecode");
     return 1;
   }
 
@@ -1919,8 +1922,9 @@ int SM50Initialize(
     codeBlobIdx = DXBCParser.FindNextMatchingBlob(DXBC_GenericShader);
   }
   if (codeBlobIdx == DXBC_BLOB_NOT_FOUND) {
-    errorOut << "Invalid DXBC bytecode: shader blob not found\0";
-    *ppError = (SM50Error *)errorObj;
+    *ppError = SM50ErrorInternal::create(
+      "Invalid DXBC bytecode: shader blob not found"
+    );
     return 1;
   }
   const void *codeBlob = DXBCParser.GetBlob(codeBlobIdx);
@@ -1930,14 +1934,16 @@ int SM50Initialize(
   D3D10ShaderBinary::CShaderCodeParser CodeParser(ShaderCode);
   CSignatureParser inputParser;
   if (DXBCGetInputSignature(pBytecode, &inputParser) != S_OK) {
-    errorOut << "Invalid DXBC bytecode: input signature not found\0";
-    *ppError = (SM50Error *)errorObj;
+    *ppError = SM50ErrorInternal::create(
+      "Invalid DXBC bytecode: input signature not found"
+    );
     return 1;
   }
   CSignatureParser5 outputParser;
   if (DXBCGetOutputSignature(pBytecode, &outputParser) != S_OK) {
-    errorOut << "Invalid DXBC bytecode: output signature not found\0";
-    *ppError = (SM50Error *)errorObj;
+    *ppError = SM50ErrorInternal::create(
+      "Invalid DXBC bytecode: output signature not found"
+    );
     return 1;
   }
 
@@ -2849,11 +2855,8 @@ int SM50Compile(
   if (ppError) {
     *ppError = nullptr;
   }
-  auto errorObj = new SM50ErrorInternal();
-  llvm::raw_svector_ostream errorOut(errorObj->buf);
   if (ppBitcode == nullptr) {
-    errorOut << "ppBitcode can not be null\0";
-    *ppError = (SM50Error *)errorObj;
+    *ppError = SM50ErrorInternal::create("ppBitcode can not be null");
     return 1;
   }
 
@@ -2879,6 +2882,8 @@ int SM50Compile(
   if (auto err = dxmt::dxbc::convertDXBC(
         pShader, FunctionName, context, *pModule, pArgs
       )) {
+    auto errorObj = new SM50ErrorInternal();
+    llvm::raw_svector_ostream errorOut(errorObj->buf);
     llvm::handleAllErrors(std::move(err), [&](const UnsupportedFeature &u) {
       errorOut << u.msg;
     });
@@ -2895,11 +2900,9 @@ int SM50Compile(
   // Serialize AIR
   auto compiled = new SM50CompiledBitcodeInternal();
 
-  raw_svector_ostream OS(compiled->vec);
-
   metallib::MetallibWriter writer;
 
-  writer.Write(*pModule, OS);
+  writer.Write(*pModule, compiled->vec);
 
   pModule.reset();
 
@@ -2920,11 +2923,8 @@ int SM50CompileTessellationPipelineVertex(
   if (ppError) {
     *ppError = nullptr;
   }
-  auto errorObj = new SM50ErrorInternal();
-  llvm::raw_svector_ostream errorOut(errorObj->buf);
   if (ppBitcode == nullptr) {
-    errorOut << "ppBitcode can not be null\0";
-    *ppError = (SM50Error *)errorObj;
+    *ppError = SM50ErrorInternal::create("ppBitcode can not be null");
     return 1;
   }
 
@@ -2944,6 +2944,8 @@ int SM50CompileTessellationPipelineVertex(
         (dxbc::SM50ShaderInternal *)pHullShader, context, *pModule,
         pVertexShaderArgs
       )) {
+    auto errorObj = new SM50ErrorInternal();
+    llvm::raw_svector_ostream errorOut(errorObj->buf);
     llvm::handleAllErrors(std::move(err), [&](const UnsupportedFeature &u) {
       errorOut << u.msg;
     });
@@ -2960,11 +2962,9 @@ int SM50CompileTessellationPipelineVertex(
   // Serialize AIR
   auto compiled = new SM50CompiledBitcodeInternal();
 
-  raw_svector_ostream OS(compiled->vec);
-
   metallib::MetallibWriter writer;
 
-  writer.Write(*pModule, OS);
+  writer.Write(*pModule, compiled->vec);
 
   pModule.reset();
 
@@ -2985,11 +2985,8 @@ int SM50CompileTessellationPipelineHull(
   if (ppError) {
     *ppError = nullptr;
   }
-  auto errorObj = new SM50ErrorInternal();
-  llvm::raw_svector_ostream errorOut(errorObj->buf);
   if (ppBitcode == nullptr) {
-    errorOut << "ppBitcode can not be null\0";
-    *ppError = (SM50Error *)errorObj;
+    *ppError = SM50ErrorInternal::create("ppBitcode can not be null");
     return 1;
   }
 
@@ -3013,6 +3010,8 @@ int SM50CompileTessellationPipelineHull(
         (dxbc::SM50ShaderInternal *)pVertexShader, context, *pModule,
         pHullShaderArgs
       )) {
+    auto errorObj = new SM50ErrorInternal();
+    llvm::raw_svector_ostream errorOut(errorObj->buf);
     llvm::handleAllErrors(std::move(err), [&](const UnsupportedFeature &u) {
       errorOut << u.msg;
     });
@@ -3027,11 +3026,9 @@ int SM50CompileTessellationPipelineHull(
   // Serialize AIR
   auto compiled = new SM50CompiledBitcodeInternal();
 
-  raw_svector_ostream OS(compiled->vec);
-
   metallib::MetallibWriter writer;
 
-  writer.Write(*pModule, OS);
+  writer.Write(*pModule, compiled->vec);
 
   pModule.reset();
 
@@ -3052,11 +3049,8 @@ int SM50CompileTessellationPipelineDomain(
   if (ppError) {
     *ppError = nullptr;
   }
-  auto errorObj = new SM50ErrorInternal();
-  llvm::raw_svector_ostream errorOut(errorObj->buf);
   if (ppBitcode == nullptr) {
-    errorOut << "ppBitcode can not be null\0";
-    *ppError = (SM50Error *)errorObj;
+    *ppError = SM50ErrorInternal::create("ppBitcode can not be null");
     return 1;
   }
 
@@ -3086,6 +3080,8 @@ int SM50CompileTessellationPipelineDomain(
         (dxbc::SM50ShaderInternal *)pHullShader, context, *pModule,
         pDomainShaderArgs
       )) {
+    auto errorObj = new SM50ErrorInternal();
+    llvm::raw_svector_ostream errorOut(errorObj->buf);
     llvm::handleAllErrors(std::move(err), [&](const UnsupportedFeature &u) {
       errorOut << u.msg;
     });
@@ -3100,11 +3096,9 @@ int SM50CompileTessellationPipelineDomain(
   // Serialize AIR
   auto compiled = new SM50CompiledBitcodeInternal();
 
-  raw_svector_ostream OS(compiled->vec);
-
   metallib::MetallibWriter writer;
 
-  writer.Write(*pModule, OS);
+  writer.Write(*pModule, compiled->vec);
 
   pModule.reset();
 
@@ -3127,7 +3121,7 @@ void SM50DestroyBitcode(SM50CompiledBitcode *pBitcode) {
 
 const char *SM50GetErrorMesssage(SM50Error *pError) {
   auto pInternal = (SM50ErrorInternal *)pError;
-  if (*pInternal->buf.end() != '\0') {
+  if (pInternal->buf.empty() || pInternal->buf.back() != '\0') {
     // ensure it returns a null terminated str
     pInternal->buf.push_back('\0');
   }
@@ -1,4 +1,5 @@
 #include "metallib_writer.hpp"
+#include "airconv_public.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/Constants.h"
 
@@ -10,6 +11,34 @@ template <typename T> std::string_view value(const T &value) {
   return std::string_view((const char *)(&value), sizeof(T));
 };
 
+/**
+Appends to `out` what is written, preceded by `prefix`. WriteBitcodeToFile
+serializes the module into a buffer of its own and writes it at once, so the
+output is reserved for the prefix and the whole bitcode by the first write.
+ */
+class MetallibOutputStream : public raw_ostream {
+  SmallVectorImpl<char> &out_;
+  StringRef prefix_;
+
+  void write_impl(const char *ptr, size_t size) override {
+    if (out_.empty()) {
+      out_.reserve(prefix_.size() + size);
+      out_.append(prefix_.begin(), prefix_.end());
+    }
+    out_.append(ptr, ptr + size);
+  }
+
+  uint64_t current_pos() const override {
+    return out_.empty() ? prefix_.size() : out_.size();
+  }
+
+public:
+  MetallibOutputStream(SmallVectorImpl<char> &out, StringRef prefix)
+      : out_(out), prefix_(prefix) {
+    SetUnbuffered();
+  }
+};
+
 struct InputAttribute {
   uint8_t attribute;
   std::string name;
@@ -18,20 +47,24 @@ struct InputAttribute {
 };
 
 void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
+  SmallVector<char, 0> metallib;
+  Write(module, metallib);
+  OS << StringRef(metallib.data(), metallib.size());
+}
+
+void MetallibWriter::Write(
+  const llvm::Module &module, SmallVectorImpl<char> &out
+) {
 
-  SmallVector<char, 0> bitcode;
   SmallVector<char, 0> public_metadata;
   SmallVector<char, 0> private_metadata;
   SmallVector<char, 0> function_def;
+  // HASH and MDSZ tags depend on the bitcode, which is emitted last directly
+  // into the output buffer. Record where they are and patch them afterwards.
+  SmallVector<uint64_t, 4> bitcode_tag_offsets;
 
   uint32_t fn_count = 0;
 
-  raw_svector_ostream bitcode_stream(bitcode);
-  WriteBitcodeToFile(module, bitcode_stream, false, nullptr, true);
-
-  auto hash =
-    compute_sha256_hash((const uint8_t *)bitcode.data(), bitcode.size());
-
   raw_svector_ostream public_metadata_stream(public_metadata);
   raw_svector_ostream private_metadata_stream(private_metadata);
 
@@ -52,9 +85,9 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
         function_def_stream << name << '\0';
         function_def_stream
           << value(MTLB_TYPE_TAG{.type = FunctionType::Vertex});
-        function_def_stream << value(MTLB_HASH_TAG{.hash = hash});
-        function_def_stream
-          << value(MTLB_MDSZ_TAG{.bitcodeSize = bitcode.size()});
+        bitcode_tag_offsets.push_back(function_def_stream.tell());
+        function_def_stream << value(MTLB_HASH_TAG{});
+        function_def_stream << value(MTLB_MDSZ_TAG{});
         function_def_stream << value(MTLB_OFFT_TAG{
           .PublicMetadataOffset = public_metadata_stream.tell(),
           .PrivateMetadataOffset = private_metadata_stream.tell(),
@@ -171,9 +204,9 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
         function_def_stream << name << '\0';
         function_def_stream
           << value(MTLB_TYPE_TAG{.type = FunctionType::Fragment});
-        function_def_stream << value(MTLB_HASH_TAG{.hash = hash});
-        function_def_stream
-          << value(MTLB_MDSZ_TAG{.bitcodeSize = bitcode.size()});
+        bitcode_tag_offsets.push_back(function_def_stream.tell());
+        function_def_stream << value(MTLB_HASH_TAG{});
+        function_def_stream << value(MTLB_MDSZ_TAG{});
         function_def_stream << value(MTLB_OFFT_TAG{
           .PublicMetadataOffset = public_metadata_stream.tell(),
           .PrivateMetadataOffset = private_metadata_stream.tell(),
@@ -205,9 +238,9 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
         function_def_stream << name << '\0';
         function_def_stream
           << value(MTLB_TYPE_TAG{.type = FunctionType::Kernel});
-        function_def_stream << value(MTLB_HASH_TAG{.hash = hash});
-        function_def_stream
-          << value(MTLB_MDSZ_TAG{.bitcodeSize = bitcode.size()});
+        bitcode_tag_offsets.push_back(function_def_stream.tell());
+        function_def_stream << value(MTLB_HASH_TAG{});
+        function_def_stream << value(MTLB_MDSZ_TAG{});
         function_def_stream << value(MTLB_OFFT_TAG{
           .PublicMetadataOffset = public_metadata_stream.tell(),
           .PrivateMetadataOffset = private_metadata_stream.tell(),
@@ -299,9 +332,9 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
         function_def_stream << name << '\0';
         function_def_stream
           << value(MTLB_TYPE_TAG{.type = FunctionType::Object});
-        function_def_stream << value(MTLB_HASH_TAG{.hash = hash});
-        function_def_stream
-          << value(MTLB_MDSZ_TAG{.bitcodeSize = bitcode.size()});
+        bitcode_tag_offsets.push_back(function_def_stream.tell());
+        function_def_stream << value(MTLB_HASH_TAG{});
+        function_def_stream << value(MTLB_MDSZ_TAG{});
         function_def_stream << value(MTLB_OFFT_TAG{
           .PublicMetadataOffset = public_metadata_stream.tell(),
           .PrivateMetadataOffset = private_metadata_stream.tell(),
@@ -340,9 +373,9 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
         function_def_stream << name << '\0';
         function_def_stream
           << value(MTLB_TYPE_TAG{.type = FunctionType::Mesh});
-        function_def_stream << value(MTLB_HASH_TAG{.hash = hash});
-        function_def_stream
-          << value(MTLB_MDSZ_TAG{.bitcodeSize = bitcode.size()});
+        bitcode_tag_offsets.push_back(function_def_stream.tell());
+        function_def_stream << value(MTLB_HASH_TAG{});
+        function_def_stream << value(MTLB_MDSZ_TAG{});
         function_def_stream << value(MTLB_OFFT_TAG{
           .PublicMetadataOffset = public_metadata_stream.tell(),
           .PrivateMetadataOffset = private_metadata_stream.tell(),
@@ -369,13 +402,45 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
     }
   }
 
-  MTLBHeader header;
-  header.Magic = MTLB_Magic;
-  header.FileSize =
+  // lay out everything before the bitcode, which is written with it once its
+  // size is known
+  SmallVector<char, 0> prefix;
+  prefix.reserve(
     sizeof(MTLBHeader) + sizeof(uint32_t) /* fn count */ +
     sizeof(uint32_t) /* constant: function list size */ + function_def.size() +
     sizeof(MTLBFourCC::EndTag) /* extended header*/
-    + public_metadata.size() + private_metadata.size() + bitcode.size();
+    + public_metadata.size() + private_metadata.size()
+  );
+  raw_svector_ostream prefix_stream(prefix);
+  prefix_stream << value(MTLBHeader{}); // patched below
+  prefix_stream << value(fn_count);
+  prefix_stream << value((uint32_t)(function_def.size() + 4));
+  uint64_t function_def_offset = prefix_stream.tell();
+  prefix_stream << function_def;
+  prefix_stream.write("ENDT", 4); // extend header
+  prefix_stream << public_metadata;
+  prefix_stream << private_metadata;
+  uint64_t bitcode_offset = prefix.size();
+
+  out.clear();
+  MetallibOutputStream OS(out, StringRef(prefix.data(), prefix.size()));
+  WriteBitcodeToFile(module, OS, false, nullptr, true);
+  uint64_t bitcode_size = OS.tell() - bitcode_offset;
+
+  auto hash = compute_sha256_hash(
+    (const uint8_t *)out.data() + bitcode_offset, bitcode_size
+  );
+  for (auto offset : bitcode_tag_offsets) {
+    auto hash_tag = MTLB_HASH_TAG{.hash = hash};
+    auto size_tag = MTLB_MDSZ_TAG{.bitcodeSize = bitcode_size};
+    char *dst = out.data() + function_def_offset + offset;
+    memcpy(dst, &hash_tag, sizeof(hash_tag));
+    memcpy(dst + sizeof(hash_tag), &size_tag, sizeof(size_tag));
+  }
+
+  MTLBHeader header;
+  header.Magic = MTLB_Magic;
+  header.FileSize = out.size();
   header.FunctionListOffset = sizeof(MTLBHeader);
   header.FunctionListSize = function_def.size() + 4;
   header.PublicMetadataOffset =
@@ -388,25 +453,18 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
   header.PrivateMetadataSize = private_metadata.size();
   header.BitcodeOffset =
     header.PrivateMetadataOffset + header.PrivateMetadataSize;
-  header.BitcodeSize = bitcode.size();
+  header.BitcodeSize = bitcode_size;
 
   header.Type = FileType::MTLBType_Executable; // executable
   header.Platform = Platform::MTLBPlatform_macOS;
-  header.VersionMajor = 2;
-  header.VersionMinor = 7;
+  header.VersionMajor = AIRCONV_METALLIB_VERSION_MAJOR;
+  header.VersionMinor = AIRCONV_METALLIB_VERSION_MINOR;
   header.OS = OS::MTLBOS_macOS;
-  header.OSVersionMajor = 14;
-  header.OSVersionMinor = 4;
-
-  // write to stream
-  OS << value(header);
-  OS << value(fn_count);
-  OS << value((uint32_t)header.FunctionListSize);
-  OS << function_def;
-  OS.write("ENDT", 4); // extend header
-  OS << public_metadata;
-  OS << private_metadata;
-  OS << bitcode;
+  header.OSVersionMajor = AIRCONV_METALLIB_OS_VERSION_MAJOR;
+  header.OSVersionMinor = AIRCONV_METALLIB_OS_VERSION_MINOR;
+
+  assert(header.BitcodeOffset == bitcode_offset);
+  memcpy(out.data(), &header, sizeof(header));
 }
 
 } // namespace dxmt::metallib
\ No newline at end of file
@@ -118,6 +118,10 @@ class MetallibWriter {
 
 public:
   void Write(const llvm::Module &module, llvm::raw_ostream &OS);
+  /**
+  lay out the whole metallib in `out`, bitcode is emitted in place
+   */
+  void Write(const llvm::Module &module, llvm::SmallVectorImpl<char> &out);
 };
 
 } // namespace dxmt::metallib
\ No newline at end of file
@@ -17,6 +17,8 @@ template <>
 template <typename Fn>
 void
 DeferredContextBase::EmitCommand(Fn &&fn) {
+  ended_pass = nullptr;
+  upload_batch = nullptr;
   ctx_state.current_cmdlist->EmitCommand(std::forward<Fn>(fn));
 }
 
@@ -72,6 +74,30 @@ DeferredContextBase::AllocateCommandData(size_t n) {
   return ctx_state.current_cmdlist->AllocateCommandData<T>(n);
 }
 
+template <>
+bool
+DeferredContextBase::IsUploadHoisted(IMTLBindable *pDst) {
+  return false;
+}
+
+template <>
+UploadStatistics *
+DeferredContextBase::GetUploadStatistics() {
+  return nullptr;
+}
+
+template <>
+template <typename Fn>
+void
+DeferredContextBase::EmitUploadCommand(IMTLBindable *pDst, Fn &&fn) {
+  EmitBlitCommand<true>(
+      [dst = Use(pDst), fn = std::forward<Fn>(fn)](MTL::BlitCommandEncoder *enc, CommandChunk::context &ctx) {
+        fn(enc, dst, ctx);
+      },
+      CommandBufferState::UpdateBlitEncoderActive
+  );
+}
+
 template <>
 void
 DeferredContextBase::UpdateUAVCounter(IMTLD3D11UnorderedAccessView *uav, uint32_t value) {
@@ -150,26 +176,31 @@ DeferredContextBase::UploadShaderStageResourceBinding() {
   auto ArgumentTableQwords = reflection->ArgumentTableQwords;
   auto encoderId = cmd_list->GetLastEncoder()->encoder_id;
 
-  auto useResource = [&](IMTLBindable *bindable, MTL_BINDABLE_RESIDENCY_MASK residencyMask) {
+  auto useResource = [&](IMTLBindable *bindable, MTL_BINDABLE_RESIDENCY_MASK residencyMask, bool heapResident) {
+    if (heapResident) {
+      // the chunk holds the resource until it completes, the heap is resident already
+      cmd_list->EmitCommand([res = Use(bindable)](CommandChunk::context &) {});
+      return;
+    }
     cmd_list->EmitCommand([res = Use(bindable), residencyMask](CommandChunk::context &ctx) {
       switch (stage) {
       case ShaderType::Vertex:
       case ShaderType::Pixel:
       case ShaderType::Hull:
       case ShaderType::Domain:
-        ctx.render_encoder->useResource(
+        ctx.resource_usage.add(
             res.resource(&ctx), GetUsageFromResidencyMask(residencyMask), GetStagesFromResidencyMask(residencyMask)
         );
         if (res.withBackedBuffer()) {
-          ctx.render_encoder->useResource(
+          ctx.resource_usage.add(
               res.buffer(), GetUsageFromResidencyMask(residencyMask), GetStagesFromResidencyMask(residencyMask)
           );
         }
         break;
       case ShaderType::Compute:
-        ctx.compute_encoder->useResource(res.resource(&ctx), GetUsageFromResidencyMask(residencyMask));
+        ctx.resource_usage.add(res.resource(&ctx), GetUsageFromResidencyMask(residencyMask));
         if (res.withBackedBuffer()) {
-          ctx.compute_encoder->useResource(res.buffer(), GetUsageFromResidencyMask(residencyMask));
+          ctx.resource_usage.add(res.buffer(), GetUsageFromResidencyMask(residencyMask));
         }
         break;
       case ShaderType::Geometry:
@@ -177,6 +208,7 @@ DeferredContextBase::UploadShaderStageResourceBinding() {
         break;
       }
     });
+    pending_resource_usage = true;
   };
   if (ConstantBufferCount && dirty_cbuffer) {
     auto offset = cmd_list->ReserveGpuHeap(ConstantBufferCount << 3, 16);
@@ -201,9 +233,11 @@ DeferredContextBase::UploadShaderStageResourceBinding() {
           write_to_it[arg_offset] = argbuf.buffer() + (first_constant << 4);
         });
         ShaderStage.ConstantBuffers.clear_dirty(slot);
-        pTracker->CheckResidency(encoderId, GetResidencyMask<Tessellation>(stage, true, false), &newResidencyMask);
+        bool heapResident = CheckBindingResidency(
+            pTracker, encoderId, GetResidencyMask<Tessellation>(stage, true, false), &newResidencyMask
+        );
         if (newResidencyMask) {
-          useResource(cbuf.Buffer.ptr(), newResidencyMask);
+          useResource(cbuf.Buffer.ptr(), newResidencyMask, heapResident);
         }
         break;
       }
@@ -305,9 +339,11 @@ DeferredContextBase::UploadShaderStageResourceBinding() {
           D3D11_ASSERT(0 && "srv can not have counter associated");
         }
         ShaderStage.SRVs.clear_dirty(slot);
-        pTracker->CheckResidency(encoderId, GetResidencyMask<Tessellation>(stage, true, false), &newResidencyMask);
+        bool heapResident = CheckBindingResidency(
+            pTracker, encoderId, GetResidencyMask<Tessellation>(stage, true, false), &newResidencyMask
+        );
         if (newResidencyMask) {
-          useResource(srv.SRV.ptr(), newResidencyMask);
+          useResource(srv.SRV.ptr(), newResidencyMask, heapResident);
         }
         break;
       }
@@ -390,8 +426,8 @@ DeferredContextBase::UploadShaderStageResourceBinding() {
           // };
         }
         UAVBindingSet.clear_dirty(slot);
-        pTracker->CheckResidency(
-            encoderId,
+        bool heapResident = CheckBindingResidency(
+            pTracker, encoderId,
             GetResidencyMask<Tessellation>(
                 stage,
                 // FIXME: don't use literal constant...
@@ -400,7 +436,7 @@ DeferredContextBase::UploadShaderStageResourceBinding() {
             &newResidencyMask
         );
         if (newResidencyMask) {
-          useResource(uav.View.ptr(), newResidencyMask);
+          useResource(uav.View.ptr(), newResidencyMask, heapResident);
         }
         break;
       }
@@ -431,6 +467,20 @@ DeferredContextBase::UploadShaderStageResourceBinding() {
   return true;
 }
 
+/**
+Offsets are relative to the region allocated on execution, which is always
+contiguous
+*/
+template <>
+void
+DeferredContextBase::ReserveArgumentHeap(size_t size) {}
+
+template <>
+bool
+DeferredContextBase::ShouldCommitEarly() {
+  return false;
+}
+
 /**
 it's just about vertex buffer
 - index buffer and input topology are provided in draw commands
@@ -479,19 +529,23 @@ DeferredContextBase::UpdateVertexBuffer() {
     MTL_BINDABLE_RESIDENCY_MASK newResidencyMask = MTL_RESIDENCY_NULL;
     SIMPLE_RESIDENCY_TRACKER *pTracker;
     vertex_resource[index++] = {cmd_list->GetArgumentDataId(state.Buffer.ptr(), &pTracker), state.Stride, state.Offset};
-    pTracker->CheckResidency(
-        cmd_list->GetLastEncoder()->encoder_id,
+    bool heapResident = CheckBindingResidency(
+        pTracker, cmd_list->GetLastEncoder()->encoder_id,
         cmdbuf_state == CommandBufferState::TessellationRenderPipelineReady
             ? GetResidencyMask<true>(ShaderType::Vertex, true, false)
             : GetResidencyMask<false>(ShaderType::Vertex, true, false),
         &newResidencyMask
     );
-    if (newResidencyMask) {
+    if (newResidencyMask && heapResident) {
+      // the chunk holds the resource until it completes, the heap is resident already
+      cmd_list->EmitCommand([res = Use(state.Buffer)](CommandChunk::context &) {});
+    } else if (newResidencyMask) {
       cmd_list->EmitCommand([res = Use(state.Buffer), newResidencyMask](CommandChunk::context &ctx) {
-        ctx.render_encoder->useResource(
+        ctx.resource_usage.add(
             res.buffer(), GetUsageFromResidencyMask(newResidencyMask), GetStagesFromResidencyMask(newResidencyMask)
         );
       });
+      pending_resource_usage = true;
     }
   };
 
@@ -569,19 +623,19 @@ public:
       case D3D11_MAP_WRITE_DISCARD: {
         auto bind_flag = dynamic->GetBindFlag();
         if (bind_flag & D3D11_BIND_VERTEX_BUFFER) {
-          state_.InputAssembler.VertexBuffers.set_dirty();
+          state_.InputAssembler.VertexBuffers.set_dirty_keyed(dynamic.ptr());
         }
         if (bind_flag & D3D11_BIND_INDEX_BUFFER) {
           dirty_state.set(DirtyState::IndexBuffer);
         }
         if (bind_flag & D3D11_BIND_CONSTANT_BUFFER) {
           for (auto &stage : state_.ShaderStages) {
-            stage.ConstantBuffers.set_dirty();
+            stage.ConstantBuffers.set_dirty_keyed(dynamic.ptr());
           }
         }
         if (bind_flag & D3D11_BIND_SHADER_RESOURCE) {
           for (auto &stage : state_.ShaderStages) {
-            stage.SRVs.set_dirty();
+            stage.SRVs.set_dirty_keyed(dynamic.ptr());
           }
         }
         auto size = dynamic->GetSize(&Out.RowPitch, &Out.DepthPitch);
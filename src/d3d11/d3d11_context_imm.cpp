@@ -14,6 +14,8 @@ template <typename Fn>
 void
 ImmediateContextBase::EmitCommand(Fn &&fn) {
   CommandChunk *chk = ctx_state.cmd_queue.CurrentChunk();
+  ended_pass = nullptr;
+  upload_batch = nullptr;
   chk->emit([fn = std::forward<Fn>(fn)](CommandChunk::context &ctx) { std::invoke(fn, ctx); });
 }
 
@@ -74,6 +76,39 @@ ImmediateContextBase::AllocateCommandData(size_t n) {
   return moveonly_list<T>((T *)chk->allocate_cpu_heap(sizeof(T) * n, alignof(T)), n);
 }
 
+template <>
+bool
+ImmediateContextBase::IsUploadHoisted(IMTLBindable *pDst) {
+  auto &cmd_queue = ctx_state.cmd_queue;
+  // no false negative: it's not used by any command emitted to the current chunk
+  return cmd_queue.hoist_uploads && !pDst->GetContentionState(cmd_queue.CurrentSeqId() - 1);
+}
+
+template <>
+UploadStatistics *
+ImmediateContextBase::GetUploadStatistics() {
+  return &ctx_state.cmd_queue.upload_statistics;
+}
+
+template <>
+template <typename Fn>
+void
+ImmediateContextBase::EmitUploadCommand(IMTLBindable *pDst, Fn &&fn) {
+  if (IsUploadHoisted(pDst)) {
+    CommandChunk *chk = ctx_state.cmd_queue.CurrentChunk();
+    chk->emit_prologue([dst = Use(pDst), fn = std::forward<Fn>(fn)](CommandChunk::context &ctx) {
+      fn(ctx.blit_encoder.ptr(), dst, ctx);
+    });
+    return;
+  }
+  EmitBlitCommand<true>(
+      [dst = Use(pDst), fn = std::forward<Fn>(fn)](MTL::BlitCommandEncoder *enc, CommandChunk::context &ctx) {
+        fn(enc, dst, ctx);
+      },
+      CommandBufferState::UpdateBlitEncoderActive
+  );
+}
+
 template <>
 void
 ImmediateContextBase::UpdateUAVCounter(IMTLD3D11UnorderedAccessView *uav, uint32_t value) {
@@ -150,26 +185,31 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
   CommandChunk *chk = ctx_state.cmd_queue.CurrentChunk();
   auto encoderId = chk->current_encoder_id();
 
-  auto useResource = [&](BindingRef &&res, MTL_BINDABLE_RESIDENCY_MASK residencyMask) {
+  auto useResource = [&](BindingRef &&res, MTL_BINDABLE_RESIDENCY_MASK residencyMask, bool heapResident) {
+    if (heapResident) {
+      // the chunk holds the resource until it completes, the heap is resident already
+      chk->emit([res = std::move(res)](CommandChunk::context &) {});
+      return;
+    }
     chk->emit([res = std::move(res), residencyMask](CommandChunk::context &ctx) {
       switch (stage) {
       case ShaderType::Vertex:
       case ShaderType::Pixel:
       case ShaderType::Hull:
       case ShaderType::Domain:
-        ctx.render_encoder->useResource(
+        ctx.resource_usage.add(
             res.resource(&ctx), GetUsageFromResidencyMask(residencyMask), GetStagesFromResidencyMask(residencyMask)
         );
         if (res.withBackedBuffer()) {
-          ctx.render_encoder->useResource(
+          ctx.resource_usage.add(
               res.buffer(), GetUsageFromResidencyMask(residencyMask), GetStagesFromResidencyMask(residencyMask)
           );
         }
         break;
       case ShaderType::Compute:
-        ctx.compute_encoder->useResource(res.resource(&ctx), GetUsageFromResidencyMask(residencyMask));
+        ctx.resource_usage.add(res.resource(&ctx), GetUsageFromResidencyMask(residencyMask));
         if (res.withBackedBuffer()) {
-          ctx.compute_encoder->useResource(res.buffer(), GetUsageFromResidencyMask(residencyMask));
+          ctx.resource_usage.add(res.buffer(), GetUsageFromResidencyMask(residencyMask));
         }
         break;
       case ShaderType::Geometry:
@@ -177,11 +217,13 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
         break;
       }
     });
+    pending_resource_usage = true;
   };
   if (ConstantBufferCount && dirty_cbuffer) {
 
-    auto [heap, offset] = chk->allocate_gpu_heap(ConstantBufferCount << 3, 16);
-    uint64_t *write_to_it = chk->gpu_argument_heap_contents + (offset >> 3);
+    auto [ptr, heap, offset] = chk->allocate_gpu_heap(ConstantBufferCount << 3, 16);
+    uint64_t *write_to_it = (uint64_t *)ptr;
+    uint64_t heap_address = 0;
 
     for (unsigned i = 0; i < ConstantBufferCount; i++) {
       auto &arg = reflection->ConstantBuffers[i];
@@ -195,12 +237,32 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
           return false;
         }
         auto &cbuf = ShaderStage.ConstantBuffers[slot];
+        ShaderStage.ConstantBuffers.clear_dirty(slot);
+        if (cbuf.InlineSource) {
+          UINT byte_width;
+          auto contents = (const char *)cbuf.InlineSource->GetInlineContents(&byte_width);
+          auto first = std::min(cbuf.FirstConstant << 4, byte_width);
+          // as if bound by address: the shader may read past NumConstants
+          size_t size = byte_width - first;
+          if (size && size + kInlineConstantBufferAlignment <= inline_cbuffer_budget) {
+            auto [copy, copy_heap, copy_offset] = chk->allocate_gpu_heap(size, kInlineConstantBufferAlignment);
+            // covered by the reservation of the draw
+            D3D11_ASSERT(copy_heap == heap);
+            memcpy(copy, contents + first, size);
+            if (!heap_address)
+              heap_address = heap->gpuAddress();
+            write_to_it[arg.StructurePtrOffset] = heap_address + copy_offset;
+            inline_cbuffer_budget -= size + kInlineConstantBufferAlignment;
+            break;
+          }
+        }
         auto argbuf = cbuf.Buffer->GetArgumentData(&pTracker);
         write_to_it[arg.StructurePtrOffset] = argbuf.buffer() + (cbuf.FirstConstant << 4);
-        ShaderStage.ConstantBuffers.clear_dirty(slot);
-        pTracker->CheckResidency(encoderId, GetResidencyMask<Tessellation>(stage, true, false), &newResidencyMask);
+        bool heapResident = CheckBindingResidency(
+            pTracker, encoderId, GetResidencyMask<Tessellation>(stage, true, false), &newResidencyMask
+        );
         if (newResidencyMask) {
-          useResource(Use(cbuf.Buffer), newResidencyMask);
+          useResource(Use(cbuf.Buffer), newResidencyMask, heapResident);
         }
         break;
       }
@@ -232,8 +294,11 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
   }
 
   if (BindingCount && (dirty_sampler || dirty_srv || dirty_uav)) {
-    auto [heap, offset] = chk->allocate_gpu_heap(ArgumentTableQwords * 8, 16);
-    uint64_t *write_to_it = chk->gpu_argument_heap_contents + (offset >> 3);
+    auto &table_cache = argument_table_cache[(UINT)stage];
+    bool patch;
+    uint64_t *write_to_it =
+        table_cache.begin(currentChunkId, encoderId, reflection, ArgumentTableQwords, patch);
+    pending_table_entries.clear();
 
     for (unsigned i = 0; i < BindingCount; i++) {
       auto &arg = reflection->Arguments[i];
@@ -245,6 +310,8 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
         D3D11_ASSERT(0 && "unreachable");
       }
       case SM50BindingType::Sampler: {
+        if (patch && !ShaderStage.Samplers.test_dirty(slot))
+          break;
         if (!ShaderStage.Samplers.test_bound(slot)) {
           ERR("expect sample at slot ", slot, " but none is bound.");
           return false;
@@ -256,6 +323,8 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
         break;
       }
       case SM50BindingType::SRV: {
+        if (patch && !ShaderStage.SRVs.test_dirty(slot))
+          break;
         if (!ShaderStage.SRVs.test_bound(slot)) {
           // TODO: debug only
           // ERR("expect shader resource at slot ", slot, " but none is bound.");
@@ -270,9 +339,8 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
         }
         if (arg.Flags & MTL_SM50_SHADER_ARGUMENT_TEXTURE) {
           if (arg_data.requiresContext()) {
-            chk->emit([=, ref = srv.SRV](CommandChunk::context &ctx) {
-              write_to_it[arg.StructurePtrOffset] = arg_data.texture(&ctx);
-            });
+            write_to_it[arg.StructurePtrOffset] = 0;
+            pending_table_entries.push_back({arg.StructurePtrOffset, arg_data, srv.SRV});
           } else {
             write_to_it[arg.StructurePtrOffset] = arg_data.texture();
           }
@@ -290,9 +358,11 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
           D3D11_ASSERT(0 && "srv can not have counter associated");
         }
         ShaderStage.SRVs.clear_dirty(slot);
-        pTracker->CheckResidency(encoderId, GetResidencyMask<Tessellation>(stage, true, false), &newResidencyMask);
+        bool heapResident = CheckBindingResidency(
+            pTracker, encoderId, GetResidencyMask<Tessellation>(stage, true, false), &newResidencyMask
+        );
         if (newResidencyMask) {
-          useResource(srv.SRV->UseBindable(currentChunkId), newResidencyMask);
+          useResource(srv.SRV->UseBindable(currentChunkId), newResidencyMask, heapResident);
         }
         break;
       }
@@ -304,6 +374,8 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
         // FIXME: currently only pixel shader use uav from OM
         // REFACTOR NEEDED
         // TODO: consider separately handle uav
+        if (patch && !UAVBindingSet.test_dirty(slot))
+          break;
         if (!UAVBindingSet.test_bound(arg.SM50BindingSlot)) {
           // ERR("expect uav at slot ", arg.SM50BindingSlot,
           //     " but none is bound.");
@@ -323,9 +395,8 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
         }
         if (arg.Flags & MTL_SM50_SHADER_ARGUMENT_TEXTURE) {
           if (arg_data.requiresContext()) {
-            chk->emit([=, ref = uav.View](CommandChunk::context &ctx) {
-              write_to_it[arg.StructurePtrOffset] = arg_data.texture(&ctx);
-            });
+            write_to_it[arg.StructurePtrOffset] = 0;
+            pending_table_entries.push_back({arg.StructurePtrOffset, arg_data, uav.View});
           } else {
             write_to_it[arg.StructurePtrOffset] = arg_data.texture();
           }
@@ -349,16 +420,20 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
               case ShaderType::Pixel:
               case ShaderType::Hull:
               case ShaderType::Domain:
-                ctx.render_encoder->useResource(counter.Buffer, MTL::ResourceUsageRead | MTL::ResourceUsageWrite);
+                ctx.resource_usage.add(
+                    counter.Buffer, MTL::ResourceUsageRead | MTL::ResourceUsageWrite,
+                    MTL::RenderStageVertex | MTL::RenderStageFragment | MTL::RenderStageObject | MTL::RenderStageMesh
+                );
                 break;
               case ShaderType::Compute:
-                ctx.compute_encoder->useResource(counter.Buffer, MTL::ResourceUsageRead | MTL::ResourceUsageWrite);
+                ctx.resource_usage.add(counter.Buffer, MTL::ResourceUsageRead | MTL::ResourceUsageWrite);
                 break;
               case ShaderType::Geometry:
                 D3D11_ASSERT(0 && "Not implemented");
                 break;
               }
             });
+            pending_resource_usage = true;
             write_to_it[arg.StructurePtrOffset + 2] = counter.Buffer->gpuAddress() + counter.Offset;
           } else {
             ERR("use uninitialized counter!");
@@ -366,8 +441,8 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
           };
         }
         UAVBindingSet.clear_dirty(slot);
-        pTracker->CheckResidency(
-            encoderId,
+        bool heapResident = CheckBindingResidency(
+            pTracker, encoderId,
             GetResidencyMask<Tessellation>(
                 stage,
                 // FIXME: don't use literal constant...
@@ -376,13 +451,40 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
             &newResidencyMask
         );
         if (newResidencyMask) {
-          useResource(uav.View->UseBindable(currentChunkId), newResidencyMask);
+          useResource(uav.View->UseBindable(currentChunkId), newResidencyMask, heapResident);
         }
         break;
       }
       }
     }
 
+    // entries resolved at encode time are written to the heap directly
+    bool reusable = pending_table_entries.empty();
+    uint64_t offset;
+    MTL::Buffer *heap = chk->current_gpu_heap();
+    if (!table_cache.end(heap, reusable, offset)) {
+      auto [ptr, new_heap, new_offset] = chk->allocate_gpu_heap(ArgumentTableQwords * 8, 16);
+      memcpy(ptr, write_to_it, ArgumentTableQwords * 8);
+      for (auto &entry : pending_table_entries) {
+        chk->emit([table = (uint64_t *)ptr, index = entry.index, arg_data = entry.arg_data,
+                   ref = std::move(entry.ref)](CommandChunk::context &ctx) {
+          table[index] = arg_data.texture(&ctx);
+        });
+      }
+      if (reusable)
+        table_cache.insert(new_heap, new_offset);
+      heap = new_heap;
+      offset = new_offset;
+    }
+
+    if constexpr (stage == ShaderType::Domain) {
+      argument_table_cache[(UINT)ShaderType::Vertex].unbind();
+    } else if constexpr (stage == ShaderType::Vertex && !Tessellation) {
+      argument_table_cache[(UINT)ShaderType::Domain].unbind();
+    }
+    if (!table_cache.bind(heap, offset, encoderId, Tessellation))
+      return true;
+
     /* kArgumentBufferBinding = 30 */
     chk->emit([offset](CommandChunk::context &ctx) {
       if constexpr (stage == ShaderType::Vertex) {
@@ -407,6 +509,35 @@ ImmediateContextBase::UploadShaderStageResourceBinding() {
   return true;
 }
 
+template <>
+void
+ImmediateContextBase::ReserveArgumentHeap(size_t size) {
+  CommandChunk *chk = ctx_state.cmd_queue.CurrentChunk();
+  auto heap = chk->reserve_gpu_heap(size);
+  if (!heap)
+    return;
+  chk->emit([heap](CommandChunk::context &ctx) {
+    ctx.argument_heap = heap;
+    BindArgumentHeap(ctx);
+  });
+  // offsets into the previous block are no longer valid
+  for (auto &stage : state_.ShaderStages) {
+    stage.ConstantBuffers.set_dirty();
+    stage.SRVs.set_dirty();
+    stage.Samplers.set_dirty();
+  }
+  state_.OutputMerger.UAVs.set_dirty();
+  state_.ComputeStageUAV.UAVs.set_dirty();
+  state_.InputAssembler.VertexBuffers.set_dirty();
+}
+
+template <>
+bool
+ImmediateContextBase::ShouldCommitEarly() {
+  // a chunk must not be committed while a query is still writing visibility results
+  return active_occlusion_queries.empty() && ctx_state.cmd_queue.ShouldCommitCurrentChunk();
+}
+
 /**
 it's just about vertex buffer
 - index buffer and input topology are provided in draw commands
@@ -436,8 +567,8 @@ ImmediateContextBase::UpdateVertexBuffer() {
 
   CommandChunk *chk = ctx_state.cmd_queue.CurrentChunk();
   auto encoderId = chk->current_encoder_id();
-  auto [heap, offset] = chk->allocate_gpu_heap(16 * num_slots, 16);
-  VERTEX_BUFFER_ENTRY *entries = (VERTEX_BUFFER_ENTRY *)(((char *)heap->contents()) + offset);
+  auto [ptr, heap, offset] = chk->allocate_gpu_heap(16 * num_slots, 16);
+  VERTEX_BUFFER_ENTRY *entries = (VERTEX_BUFFER_ENTRY *)ptr;
   for (unsigned slot = 0, index = 0; slot < max_slot; slot++) {
     if (!(slot_mask & (1 << slot)))
       continue;
@@ -454,19 +585,23 @@ ImmediateContextBase::UpdateVertexBuffer() {
     entries[index].buffer_handle = handle.buffer() + state.Offset;
     entries[index].stride = state.Stride;
     entries[index++].length = handle.width() > state.Offset ? handle.width() - state.Offset : 0;
-    pTracker->CheckResidency(
-        encoderId,
+    bool heapResident = CheckBindingResidency(
+        pTracker, encoderId,
         cmdbuf_state == CommandBufferState::TessellationRenderPipelineReady
             ? GetResidencyMask<true>(ShaderType::Vertex, true, false)
             : GetResidencyMask<false>(ShaderType::Vertex, true, false),
         &newResidencyMask
     );
-    if (newResidencyMask) {
+    if (newResidencyMask && heapResident) {
+      // the chunk holds the resource until it completes, the heap is resident already
+      chk->emit([res = Use(state.Buffer)](CommandChunk::context &) {});
+    } else if (newResidencyMask) {
       chk->emit([res = Use(state.Buffer), newResidencyMask](CommandChunk::context &ctx) {
-        ctx.render_encoder->useResource(
+        ctx.resource_usage.add(
             res.buffer(), GetUsageFromResidencyMask(newResidencyMask), GetStagesFromResidencyMask(newResidencyMask)
         );
       });
+      pending_resource_usage = true;
     }
   };
   if (cmdbuf_state == CommandBufferState::TessellationRenderPipelineReady) {
@@ -517,25 +652,31 @@ public:
         dynamic->RotateBuffer(device);
         auto bind_flag = dynamic->GetBindFlag();
         if (bind_flag & D3D11_BIND_VERTEX_BUFFER) {
-          state_.InputAssembler.VertexBuffers.set_dirty();
+          state_.InputAssembler.VertexBuffers.set_dirty_keyed(dynamic.ptr());
         }
         if (bind_flag & D3D11_BIND_INDEX_BUFFER) {
           dirty_state.set(DirtyState::IndexBuffer);
         }
         if (bind_flag & D3D11_BIND_CONSTANT_BUFFER) {
           for (auto &stage : state_.ShaderStages) {
-            stage.ConstantBuffers.set_dirty();
+            stage.ConstantBuffers.set_dirty_keyed(dynamic.ptr());
           }
         }
         if (bind_flag & D3D11_BIND_SHADER_RESOURCE) {
           for (auto &stage : state_.ShaderStages) {
-            stage.SRVs.set_dirty();
+            stage.SRVs.set_dirty_keyed(dynamic.ptr());
           }
         }
         Out.pData = dynamic->GetMappedMemory(&Out.RowPitch, &Out.DepthPitch);
         break;
       }
       case D3D11_MAP_WRITE_NO_OVERWRITE: {
+        if (dynamic->GetBindFlag() & D3D11_BIND_CONSTANT_BUFFER) {
+          // inlined contents are copied again
+          for (auto &stage : state_.ShaderStages) {
+            stage.ConstantBuffers.set_dirty_keyed(dynamic.ptr());
+          }
+        }
         Out.pData = dynamic->GetMappedMemory(&Out.RowPitch, &Out.DepthPitch);
         break;
       }
@@ -730,7 +871,8 @@ public:
     std::vector<ArgumentData> argument_table(cmd_list->num_argument_data);
     std::vector<BindingRef> bindingref_table(cmd_list->num_bindingref);
 
-    auto [heap, offset] = chk->allocate_gpu_heap(cmd_list->gpu_arugment_heap_offset, 16);
+    ReserveArgumentHeap(cmd_list->gpu_arugment_heap_offset + 16);
+    auto [ptr, heap, offset] = chk->allocate_gpu_heap(cmd_list->gpu_arugment_heap_offset, 16);
 
     uint64_t visibility_offset = vro_state.preserveCount(cmd_list->num_visibility_result);
 
@@ -739,7 +881,7 @@ public:
     MTLD3D11CommandList::EventContext ctx{
         cmd_queue,
         device,
-        (uint64_t *)((char *)heap->contents() + offset),
+        (uint64_t *)ptr,
         argument_table,
         bindingref_table,
         visibility_offset,
@@ -784,7 +926,7 @@ public:
         auto counter = cmd_queue.counter_pool.GetCounter(counter_handle);
         EmitBlitCommand<true>([counter, DstAlignedByteOffset,
                                dst = Use(dst_bind)](MTL::BlitCommandEncoder *enc, auto &ctx) {
-          enc->copyFromBuffer(counter.Buffer, counter.Offset, dst.buffer(), DstAlignedByteOffset, 4);
+          enc->copyFromBuffer(counter.Buffer, counter.Offset, dst.buffer(), dst.offset() + DstAlignedByteOffset, 4);
         });
       }
     }
@@ -20,6 +20,7 @@ since it is for internal use only
 #include "mtld11_resource.hpp"
 #include "util_flags.hpp"
 #include "util_math.hpp"
+#include "util_memcpy.hpp"
 #include <unordered_set>
 
 namespace dxmt {
@@ -186,6 +187,33 @@ GetStagesFromResidencyMask(MTL_BINDABLE_RESIDENCY_MASK mask) {
          ((mask & (MTL_RESIDENCY_MESH_READ | MTL_RESIDENCY_MESH_WRITE)) ? MTL::RenderStageMesh : 0);
 }
 
+/**
+Bind the argument heap to the slots referenced by buffer offset: vertex
+buffer table (16), constant buffer table (29) and argument table (30)
+ */
+inline void
+BindArgumentHeap(CommandChunk::context &ctx) {
+  auto heap = ctx.argument_heap;
+  if (ctx.render_encoder) {
+    ctx.render_encoder->setVertexBuffer(heap, 0, 16);
+    ctx.render_encoder->setVertexBuffer(heap, 0, 29);
+    ctx.render_encoder->setVertexBuffer(heap, 0, 30);
+    ctx.render_encoder->setFragmentBuffer(heap, 0, 29);
+    ctx.render_encoder->setFragmentBuffer(heap, 0, 30);
+    if (ctx.tessellation_pass) {
+      ctx.render_encoder->setMeshBuffer(heap, 0, 29);
+      ctx.render_encoder->setMeshBuffer(heap, 0, 30);
+      ctx.render_encoder->setObjectBuffer(heap, 0, 16);
+      ctx.render_encoder->setObjectBuffer(heap, 0, 29);
+      ctx.render_encoder->setObjectBuffer(heap, 0, 30);
+    }
+  }
+  if (ctx.compute_encoder) {
+    ctx.compute_encoder->setBuffer(heap, 0, 29);
+    ctx.compute_encoder->setBuffer(heap, 0, 30);
+  }
+}
+
 struct Subresource {
   DXGI_FORMAT Format;
   uint32_t MipLevel;
@@ -504,6 +532,30 @@ public:
   }
 };
 
+/**
+Upper bound of constant buffer contents copied to the argument heap by a draw,
+see IMTLDynamicBuffer::GetInlineContents()
+ */
+constexpr size_t kInlineConstantBufferBytesPerDraw = 0x8000;
+constexpr size_t kInlineConstantBufferAlignment = 256;
+
+/**
+Buffer updates up to this size are copied from staging memory by a blit
+command shared with the following ones, as long as nothing else is emitted in
+between
+ */
+constexpr size_t kBufferUploadBatchMaxSize = 0x1000;
+constexpr size_t kBufferUploadBatchCapacity = 32;
+
+struct BUFFER_UPLOAD {
+  BindingRef dst;
+  MTL::Buffer *staging_buffer;
+  uint64_t staging_offset;
+  uint32_t dst_offset;
+  // zero for unused entries of a batch
+  uint32_t length = 0;
+};
+
 struct DXMT_DRAW_ARGUMENTS {
   uint32_t IndexCount;
   uint32_t StartIndex;
@@ -730,6 +782,9 @@ public:
       return;
     }
     if (auto dst = com_cast<IMTLBindable>(pDstResource)) {
+      if (desc.Format == Format &&
+          ResolveAtEndOfRenderPass((uint64_t)pSrcResource, SrcSubresource, dst.ptr(), dst_level, dst_slice, Format))
+        return;
       if (auto src = com_cast<IMTLBindable>(pSrcResource)) {
         ResolveSubresource(src.ptr(), SrcSubresource, dst.ptr(), dst_level, dst_slice);
       }
@@ -847,31 +902,42 @@ public:
         copy_len = pDstBox->right - copy_offset;
       }
 
+      auto statistics = GetUploadStatistics();
       if (auto dynamic = com_cast<IMTLDynamicBuffer>(pDstResource)) {
         if (copy_len == desc.ByteWidth) {
           D3D11_MAPPED_SUBRESOURCE mapped;
           Map(pDstResource, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped);
           memcpy(mapped.pData, pSrcData, copy_len);
           Unmap(pDstResource, 0);
+          if (statistics)
+            statistics->renamed++;
           return;
         }
       }
       if (auto bindable = com_cast<IMTLBindable>(pDstResource)) {
-        if (auto _ = UseImmediate(bindable.ptr())) {
+        if (auto _ = IsPrivateBuffer(desc) ? BindingRef() : UseImmediate(bindable.ptr())) {
           auto buffer = _.buffer();
-          memcpy(((char *)buffer->contents()) + copy_offset, pSrcData, copy_len);
-          buffer->didModifyRange(NS::Range::Make(copy_offset, copy_len));
+          memcpy(((char *)buffer->contents()) + _.offset() + copy_offset, pSrcData, copy_len);
+          buffer->didModifyRange(NS::Range::Make(_.offset() + copy_offset, copy_len));
+          if (statistics)
+            statistics->direct++;
           return;
         }
         auto [ptr, staging_buffer, offset] = AllocateStagingBuffer(copy_len, 16);
         memcpy(ptr, pSrcData, copy_len);
-        EmitBlitCommand<true>(
-            [staging_buffer, offset, dst = Use(bindable), copy_offset,
-             copy_len](MTL::BlitCommandEncoder *enc, auto &ctx) {
-              enc->copyFromBuffer(staging_buffer, offset, dst.buffer(), copy_offset, copy_len);
-            },
-            CommandBufferState::UpdateBlitEncoderActive
+        if (copy_len <= kBufferUploadBatchMaxSize && !IsUploadHoisted(bindable.ptr())) {
+          EmitBatchedBufferUpload({Use(bindable.ptr()), staging_buffer, offset, copy_offset, copy_len});
+          return;
+        }
+        EmitUploadCommand(
+            bindable.ptr(),
+            [staging_buffer, offset, copy_offset,
+             copy_len](MTL::BlitCommandEncoder *enc, const BindingRef &dst, auto &ctx) {
+              enc->copyFromBuffer(staging_buffer, offset, dst.buffer(), dst.offset() + copy_offset, copy_len);
+            }
         );
+        if (statistics)
+          statistics->staged++;
       } else {
         D3D11_ASSERT(0 && "UpdateSubresource1: TODO: staging?");
       }
@@ -884,12 +950,12 @@ public:
   void
   DiscardResource(ID3D11Resource *pResource) override {
     /*
-    All the Discard* API is not implemented and that's probably fine (as it's
-    more like a hint of optimization, and Metal manages resources on its own)
-    FIXME: for render targets we can use this information: LoadActionDontCare
+    Only render targets and depth stencil make use of it (see DiscardAttachment)
     FIXME: A Map with D3D11_MAP_WRITE type could become D3D11_MAP_WRITE_DISCARD?
     */
-    ERR_ONCE("Not implemented");
+    if (!pResource)
+      return;
+    DiscardAttachment((uint64_t)pResource, 0);
   }
 
   void
@@ -899,7 +965,14 @@ public:
 
   void
   DiscardView1(ID3D11View *pResourceView, const D3D11_RECT *pRects, UINT NumRects) override {
-    ERR_ONCE("Not implemented");
+    // partial discard is ignored
+    if (!pResourceView || NumRects)
+      return;
+    if (auto rtv = com_cast<IMTLD3D11RenderTargetView>(pResourceView)) {
+      DiscardAttachment(rtv->GetUnderlyingResourceId(), (uint64_t)rtv.ptr());
+    } else if (auto dsv = com_cast<IMTLD3D11DepthStencilView>(pResourceView)) {
+      DiscardAttachment(dsv->GetUnderlyingResourceId(), (uint64_t)dsv.ptr());
+    }
   }
 #pragma endregion
 
@@ -1010,9 +1083,9 @@ public:
 
     EmitCommand([=](CommandChunk::context &ctx) {
       // allocate draw arguments
-      auto [heap, offset] = ctx.chk->allocate_gpu_heap(4 * 5, 4);
+      auto [ptr, heap, offset] = ctx.chk->allocate_gpu_heap(4 * 5, 4);
       auto PatchCountPerInstance = VertexCountPerInstance / NumControlPoint;
-      DXMT_DRAW_ARGUMENTS *draw_arugment = (DXMT_DRAW_ARGUMENTS *)(((char *)heap->contents()) + offset);
+      DXMT_DRAW_ARGUMENTS *draw_arugment = (DXMT_DRAW_ARGUMENTS *)ptr;
       draw_arugment->BaseVertex = StartVertexLocation;
       draw_arugment->IndexCount = VertexCountPerInstance;
       draw_arugment->StartIndex = 0;
@@ -1069,9 +1142,9 @@ public:
 
     EmitCommand([=](CommandChunk::context &ctx) {
       // allocate draw arguments
-      auto [heap, offset] = ctx.chk->allocate_gpu_heap(4 * 5, 4);
+      auto [ptr, heap, offset] = ctx.chk->allocate_gpu_heap(4 * 5, 4);
       auto PatchCountPerInstance = IndexCountPerInstance / NumControlPoint;
-      DXMT_DRAW_ARGUMENTS *draw_arugment = (DXMT_DRAW_ARGUMENTS *)(((char *)heap->contents()) + offset);
+      DXMT_DRAW_ARGUMENTS *draw_arugment = (DXMT_DRAW_ARGUMENTS *)ptr;
       draw_arugment->BaseVertex = BaseVertexLocation;
       draw_arugment->IndexCount = IndexCountPerInstance;
       draw_arugment->StartIndex = 0; // already provided offset
@@ -1843,7 +1916,8 @@ public:
     }
 
     if (should_invalidate_pass) {
-      InvalidateCurrentPass();
+      // the render pass is ended by the next draw, if it needs other attachments
+      pending_render_target_change = true;
     }
   }
 
@@ -2169,6 +2243,22 @@ public:
 
   template <typename T> moveonly_list<T> AllocateCommandData(size_t n = 1);
 
+  /**
+  Emit a copy from staging memory to `pDst`: `fn` is called with the blit
+  encoder and a reference to `pDst`. On immediate context, it goes to the
+  prologue of the current chunk if `pDst` hasn't been used by the chunk yet,
+  so that the active encoder doesn't have to be ended for it.
+   */
+  template <typename Fn> void EmitUploadCommand(IMTLBindable *pDst, Fn &&fn);
+
+  /**
+  Whether `EmitUploadCommand` puts an upload to `pDst` in the prologue
+   */
+  bool IsUploadHoisted(IMTLBindable *pDst);
+
+  // on deferred context, it always returns null
+  UploadStatistics *GetUploadStatistics();
+
   void UpdateUAVCounter(IMTLD3D11UnorderedAccessView *uav, uint32_t value);
 
   std::tuple<void *, MTL::Buffer *, uint64_t> AllocateStagingBuffer(size_t size, size_t alignment);
@@ -2189,6 +2279,83 @@ public:
 
   void UpdateVertexBuffer();
 
+  /**
+  Same as SIMPLE_RESIDENCY_TRACKER::CheckResidency(), except that read-only
+  access to a resource placed in a heap is covered by making all placement
+  heaps resident, once per encoder and stage. Return true in that case: the
+  resource must still be used by the chunk (to keep it alive and occupied),
+  but its residency doesn't have to be requested.
+   */
+  bool
+  CheckBindingResidency(
+      SIMPLE_RESIDENCY_TRACKER *pTracker, uint64_t encoderId, MTL_BINDABLE_RESIDENCY_MASK residencyMask,
+      MTL_BINDABLE_RESIDENCY_MASK *newResidencyMask
+  ) {
+    pTracker->CheckResidency(encoderId, residencyMask, newResidencyMask);
+    if (!pTracker->heap_resident || (*newResidencyMask & MTL_RESIDENCY_WRITE))
+      return false;
+    MTL_BINDABLE_RESIDENCY_MASK newHeapResidencyMask = MTL_RESIDENCY_NULL;
+    heap_residency.CheckResidency(encoderId, residencyMask, &newHeapResidencyMask);
+    if (newHeapResidencyMask) {
+      EmitCommand([pool = &device->GetDXMTDevice().queue().placement_heaps,
+                   stages = GetStagesFromResidencyMask(newHeapResidencyMask)](CommandChunk::context &ctx) {
+        ctx.resource_usage.add_heaps(pool, stages);
+      });
+      pending_resource_usage = true;
+    }
+    return true;
+  }
+
+  /**
+  Make sure the argument tables of the next draw or dispatch (or a whole
+  command list) are allocated from the bound argument heap
+   */
+  void ReserveArgumentHeap(size_t size);
+
+  /**
+  Upper bound of argument heap usage of a stage by the next draw or dispatch:
+  its constant buffer table and argument table (each 16-byte aligned), as if
+  all of them were dirty. Contents of its inlinable constant buffers are
+  counted separately in `inline_bytes`.
+   */
+  size_t
+  ArgumentHeapUsage(ShaderType stage, size_t &inline_bytes) {
+    auto &ShaderStage = state_.ShaderStages[(UINT)stage];
+    if (!ShaderStage.Shader)
+      return 0;
+    auto reflection = &ShaderStage.Shader->GetManagedShader()->reflection();
+    for (unsigned i = 0; i < reflection->NumConstantBuffers; i++) {
+      auto slot = reflection->ConstantBuffers[i].SM50BindingSlot;
+      if (!ShaderStage.ConstantBuffers.test_bound(slot))
+        continue;
+      auto &cbuf = ShaderStage.ConstantBuffers[slot];
+      UINT byte_width;
+      if (cbuf.InlineSource && cbuf.InlineSource->GetInlineContents(&byte_width))
+        inline_bytes += byte_width - std::min(cbuf.FirstConstant << 4, byte_width) + kInlineConstantBufferAlignment;
+    }
+    return ((reflection->NumConstantBuffers + reflection->ArgumentTableQwords) << 3) + 32;
+  }
+
+  /**
+  Reserve what the next draw or dispatch may allocate from the argument heap,
+  instead of a worst case, so that many draws share a block of the heap. The
+  inline constant buffer budget covers exactly the inlinable constant buffers
+  bound, up to kInlineConstantBufferBytesPerDraw.
+   */
+  template <ShaderType... stages>
+  void
+  ReserveArgumentHeapForStages(size_t size) {
+    size_t inline_bytes = 0;
+    size += (ArgumentHeapUsage(stages, inline_bytes) + ...);
+    inline_cbuffer_budget = std::min(inline_bytes, kInlineConstantBufferBytesPerDraw);
+    ReserveArgumentHeap(size + inline_cbuffer_budget);
+  }
+
+  /**
+  Whether to commit at an encoder boundary even if no flush is requested
+   */
+  bool ShouldCommitEarly();
+
   virtual void Commit() = 0;
 
   /**
@@ -2307,6 +2474,13 @@ public:
         } else {
           D3D11_ASSERT(0 && "unexpected constant buffer object");
         }
+        entry.InlineSource = nullptr;
+        if (auto dynamic = com_cast<IMTLDynamicBuffer>(pConstantBuffer)) {
+          UINT byte_width;
+          if (dynamic->GetInlineContents(&byte_width))
+            entry.InlineSource = dynamic.ptr();
+          ShaderStage.ConstantBuffers.set_key(slot, dynamic.ptr());
+        }
       } else {
         // BIND NULL
         ShaderStage.ConstantBuffers.unbind(slot);
@@ -2357,7 +2531,12 @@ public:
           entry.SRV = std::move(expected);
         } else {
           D3D11_ASSERT(0 && "unexpected shader resource object");
+          continue;
         }
+        Com<IMTLDynamicBuffer> dynamic;
+        entry.SRV->GetLogicalResourceOrView(IID_PPV_ARGS(&dynamic));
+        if (dynamic)
+          ShaderStage.SRVs.set_key(slot, dynamic.ptr());
       } else {
         // BIND NULL
         ShaderStage.SRVs.unbind(slot);
@@ -2505,6 +2684,9 @@ public:
         } else {
           D3D11_ASSERT(0 && "unexpected vertex buffer object");
         }
+        if (auto dynamic = com_cast<IMTLDynamicBuffer>(pVertexBuffer)) {
+          VertexBuffers.set_key(slot, dynamic.ptr());
+        }
         if (pStrides) {
           entry.Stride = pStrides[slot - StartSlot];
         } else {
@@ -2582,7 +2764,7 @@ public:
         EmitBlitCommand<true>(
             [src_ = Use(src), dst = Obj(dst_bind.Buffer), DstX, SrcBox](MTL::BlitCommandEncoder *encoder, auto &ctx) {
               auto src = src_.buffer();
-              encoder->copyFromBuffer(src, SrcBox.left, dst, DstX, SrcBox.right - SrcBox.left);
+              encoder->copyFromBuffer(src, src_.offset() + SrcBox.left, dst, DstX, SrcBox.right - SrcBox.left);
             },
             CommandBufferState::ReadbackBlitEncoderActive
         );
@@ -2601,7 +2783,7 @@ public:
                                SrcBox](MTL::BlitCommandEncoder *encoder, auto &ctx) {
           auto dst = dst_.buffer();
           // FIXME: offste should be calculated from SrcBox
-          encoder->copyFromBuffer(src, SrcBox.left, dst, DstX, SrcBox.right - SrcBox.left);
+          encoder->copyFromBuffer(src, SrcBox.left, dst, dst_.offset() + DstX, SrcBox.right - SrcBox.left);
         });
       } else if (auto src = com_cast<IMTLBindable>(pSrcResource)) {
         // on-device copy
@@ -2609,7 +2791,9 @@ public:
                                SrcBox](MTL::BlitCommandEncoder *encoder, auto &ctx) {
           auto src = src_.buffer();
           auto dst = dst_.buffer();
-          encoder->copyFromBuffer(src, SrcBox.left, dst, DstX, SrcBox.right - SrcBox.left);
+          encoder->copyFromBuffer(
+              src, src_.offset() + SrcBox.left, dst, dst_.offset() + DstX, SrcBox.right - SrcBox.left
+          );
         });
       } else {
         D3D11_ASSERT(0 && "todo");
@@ -2842,6 +3026,45 @@ public:
     }
   }
 
+  /**
+  Append a small buffer update to the batch emitted last, or start a new one
+   */
+  void
+  EmitBatchedBufferUpload(BUFFER_UPLOAD &&upload) {
+    if (auto statistics = GetUploadStatistics())
+      statistics->batched++;
+    // commands emitted directly to the chunk don't clear the batch, but they belong to another pass
+    auto pass = GetLastEncoder();
+    if (upload_batch && upload_batch_size < kBufferUploadBatchCapacity && upload_batch_pass == pass &&
+        upload_batch_pass_id == pass->encoder_id) {
+      upload_batch[upload_batch_size++] = std::move(upload);
+      return;
+    }
+    if (auto statistics = GetUploadStatistics())
+      statistics->batches++;
+    auto batch = AllocateCommandData<BUFFER_UPLOAD>(kBufferUploadBatchCapacity);
+    batch[0] = std::move(upload);
+    auto batch_data = batch.data();
+    EmitBlitCommand<true>(
+        [batch = std::move(batch)](MTL::BlitCommandEncoder *enc, CommandChunk::context &ctx) {
+          // entries are appended until anything else is emitted
+          for (auto &upload : batch.span()) {
+            if (!upload.length)
+              break;
+            enc->copyFromBuffer(
+                upload.staging_buffer, upload.staging_offset, upload.dst.buffer(),
+                upload.dst.offset() + upload.dst_offset, upload.length
+            );
+          }
+        },
+        CommandBufferState::UpdateBlitEncoderActive
+    );
+    upload_batch = batch_data;
+    upload_batch_size = 1;
+    upload_batch_pass = GetLastEncoder();
+    upload_batch_pass_id = upload_batch_pass->encoder_id;
+  }
+
   void
   UpdateTexture(
       TextureUpdateCommand &&cmd, const void *pSrcData, UINT SrcRowPitch, UINT SrcDepthPitch, UINT CopyFlags
@@ -2849,43 +3072,39 @@ public:
     if (cmd.Invalid)
       return;
 
+    auto statistics = GetUploadStatistics();
     if (auto bindable = com_cast<IMTLBindable>(cmd.pDst)) {
       if (auto dst = UseImmediate(bindable.ptr())) {
         auto texture = dst.texture();
-        if (texture) {
+        // GPU-only textures have no CPU storage to replace
+        if (texture && texture->storageMode() != MTL::StorageModePrivate) {
           texture->replaceRegion(
               cmd.DstRegion, cmd.Dst.MipLevel, cmd.Dst.ArraySlice, pSrcData, SrcRowPitch, SrcDepthPitch
           );
+          if (statistics)
+            statistics->direct++;
           return;
         }
       }
       auto bytes_per_depth_slice = cmd.EffectiveRows * cmd.EffectiveBytesPerRow;
       auto [ptr, staging_buffer, offset] = AllocateStagingBuffer(bytes_per_depth_slice * cmd.DstRegion.size.depth, 16);
-      if (cmd.EffectiveBytesPerRow == SrcRowPitch) {
-        for (unsigned depthSlice = 0; depthSlice < cmd.DstRegion.size.depth; depthSlice++) {
-          char *dst = ((char *)ptr) + depthSlice * bytes_per_depth_slice;
-          const char *src = ((const char *)pSrcData) + depthSlice * SrcDepthPitch;
-          memcpy(dst, src, bytes_per_depth_slice);
-        }
-      } else {
-        for (unsigned depthSlice = 0; depthSlice < cmd.DstRegion.size.depth; depthSlice++) {
-          for (unsigned row = 0; row < cmd.EffectiveRows; row++) {
-            char *dst = ((char *)ptr) + row * cmd.EffectiveBytesPerRow + depthSlice * bytes_per_depth_slice;
-            const char *src = ((const char *)pSrcData) + row * SrcRowPitch + depthSlice * SrcDepthPitch;
-            memcpy(dst, src, cmd.EffectiveBytesPerRow);
-          }
-        }
-      }
-      EmitBlitCommand<true>(
-          [staging_buffer, offset, dst = Use(bindable), cmd = std::move(cmd),
-           bytes_per_depth_slice](MTL::BlitCommandEncoder *enc, auto &ctx) {
+      // staging memory is write-combined
+      copy_rows(
+          {ptr, cmd.EffectiveBytesPerRow, bytes_per_depth_slice}, {pSrcData, SrcRowPitch, SrcDepthPitch},
+          cmd.EffectiveBytesPerRow, cmd.EffectiveRows, cmd.DstRegion.size.depth, true
+      );
+      EmitUploadCommand(
+          bindable.ptr(),
+          [staging_buffer, offset, cmd = std::move(cmd),
+           bytes_per_depth_slice](MTL::BlitCommandEncoder *enc, const BindingRef &dst, auto &ctx) {
             enc->copyFromBuffer(
                 staging_buffer, offset, cmd.EffectiveBytesPerRow, bytes_per_depth_slice, cmd.DstRegion.size,
                 dst.texture(&ctx), cmd.Dst.ArraySlice, cmd.Dst.MipLevel, cmd.DstRegion.origin
             );
-          },
-          CommandBufferState::UpdateBlitEncoderActive
+          }
       );
+      if (statistics)
+        statistics->staged++;
     } else if (auto staging_dst = com_cast<IMTLD3D11Staging>(cmd.pDst)) {
       // staging: ...
       D3D11_ASSERT(0 && "TODO: UpdateSubresource1: update staging texture");
@@ -2899,6 +3118,47 @@ public:
 #pragma region CommandEncoder Maintain State
 
   bool promote_flush = false;
+  // residency requests have been emitted since the last draw or dispatch
+  bool pending_resource_usage = false;
+  // residency of placement heaps requested for the current encoder
+  SIMPLE_RESIDENCY_TRACKER heap_residency{};
+  // bytes of constant buffers that can still be inlined by the current draw
+  size_t inline_cbuffer_budget = 0;
+  // render targets have been set since the render pass began
+  bool pending_render_target_change = false;
+  // the compute or blit pass ended last, cleared once anything is emitted
+  ENCODER_INFO *ended_pass = nullptr;
+  uint64_t ended_pass_id = 0;
+  // the batch of buffer uploads emitted last, cleared once anything else is emitted
+  BUFFER_UPLOAD *upload_batch = nullptr;
+  size_t upload_batch_size = 0;
+  ENCODER_INFO *upload_batch_pass = nullptr;
+  uint64_t upload_batch_pass_id = 0;
+
+  struct DISCARDED_ATTACHMENT {
+    uint64_t resource_id;
+    uint64_t view_id; // 0 if the whole resource is discarded
+
+    bool
+    matches(const ENCODER_RENDER_ATTACHMENT &attachment) const {
+      if (!attachment.resource_id)
+        return false;
+      return view_id ? attachment.view_id == view_id : attachment.resource_id == resource_id;
+    }
+  };
+  // discarded since `discarded_after` is the last encoder
+  std::vector<DISCARDED_ATTACHMENT> discarded_attachments;
+  ENCODER_INFO *discarded_after = nullptr;
+  uint64_t discarded_after_id = 0;
+
+  // per shader stage, see UploadShaderStageResourceBinding()
+  ArgumentTableCache argument_table_cache[6];
+  struct PendingTableEntry {
+    uint32_t index;
+    ArgumentData arg_data;
+    Com<IMTLBindable> ref;
+  };
+  std::vector<PendingTableEntry> pending_table_entries;
 
   /**
   Render pass can be invalidated by reasons:
@@ -2925,24 +3185,38 @@ public:
       break;
     }
     case CommandBufferState::ComputeEncoderActive:
-    case CommandBufferState::ComputePipelineReady:
-      EmitCommand([](CommandChunk::context &ctx) {
+    case CommandBufferState::ComputePipelineReady: {
+      auto pass = GetLastEncoder();
+      D3D11_ASSERT(pass->kind == EncoderKind::Compute);
+      EmitCommand([pass, ordinal = pass->num_continuations + 1](CommandChunk::context &ctx) {
+        if (ordinal <= pass->num_continuations)
+          return;
         ctx.compute_encoder->endEncoding();
         ctx.compute_encoder = nullptr;
       });
+      ended_pass = pass;
+      ended_pass_id = pass->encoder_id;
       break;
+    }
     case CommandBufferState::UpdateBlitEncoderActive:
     case CommandBufferState::ReadbackBlitEncoderActive:
-    case CommandBufferState::BlitEncoderActive:
-      EmitCommand([](CommandChunk::context &ctx) {
+    case CommandBufferState::BlitEncoderActive: {
+      auto pass = GetLastEncoder();
+      D3D11_ASSERT(pass->kind == EncoderKind::Blit);
+      EmitCommand([pass, ordinal = pass->num_continuations + 1](CommandChunk::context &ctx) {
+        if (ordinal <= pass->num_continuations)
+          return;
         ctx.blit_encoder->endEncoding();
         ctx.blit_encoder = nullptr;
       });
+      ended_pass = pass;
+      ended_pass_id = pass->encoder_id;
       break;
     }
+    }
 
     cmdbuf_state = CommandBufferState::Idle;
-    if (promote_flush && !defer_commit) {
+    if (!defer_commit && (promote_flush || ShouldCommitEarly())) {
       Commit();
       return true;
     }
@@ -3081,6 +3355,68 @@ public:
     EncodeClearPass(clear_pass);
   }
 
+  /**
+  Resolve a multisampled color attachment of the last render pass with the
+  store action of the pass, if nothing has been encoded since. Return false if
+  a separate resolve pass is needed.
+  */
+  bool
+  ResolveAtEndOfRenderPass(
+      uint64_t SrcResourceId, UINT SrcSlice, IMTLBindable *pDst, UINT DstLevel, UINT DstSlice, DXGI_FORMAT Format
+  ) {
+    auto previous_encoder = GetLastEncoder();
+    if (previous_encoder->kind != EncoderKind::Render)
+      return false;
+    auto pass_info = (ENCODER_RENDER_INFO *)previous_encoder;
+    // the last one is depth stencil
+    for (unsigned i = 0; i + 1 < pass_info->num_attachments; i++) {
+      auto &attachment = pass_info->attachments[i];
+      if (attachment.resource_id != SrcResourceId || !attachment.resolvable || attachment.resolve)
+        continue;
+      if (attachment.slice != SrcSlice || attachment.format != (uint32_t)Format)
+        continue;
+      InvalidateCurrentPass(true);
+      auto resolve = AllocateCommandData<ENCODER_RENDER_RESOLVE>(1);
+      resolve[0].texture = Use(pDst);
+      resolve[0].level = DstLevel;
+      resolve[0].slice = DstSlice;
+      attachment.resolve = resolve.data();
+      // keeps the resolve target until the chunk is done
+      EmitCommand([_ = std::move(resolve)](CommandChunk::context &ctx) {});
+      return true;
+    }
+    return false;
+  }
+
+  /**
+  Contents of an attachment are no longer needed: the last render pass doesn't
+  have to store it if nothing has been encoded since, and the next render pass
+  doesn't have to load it if it immediately follows.
+  */
+  void
+  DiscardAttachment(uint64_t ResourceId, uint64_t ViewId) {
+    DISCARDED_ATTACHMENT discarded{ResourceId, ViewId};
+    auto previous_encoder = GetLastEncoder();
+    if (previous_encoder->kind == EncoderKind::Render) {
+      auto pass_info = (ENCODER_RENDER_INFO *)previous_encoder;
+      for (unsigned i = 0; i < pass_info->num_attachments; i++) {
+        auto &attachment = pass_info->attachments[i];
+        if (!discarded.matches(attachment))
+          continue;
+        // anything drawn after the discard must not be lost
+        InvalidateCurrentPass(true);
+        attachment.dont_store = 1;
+      }
+    }
+    previous_encoder = GetLastEncoder();
+    if (previous_encoder != discarded_after || previous_encoder->encoder_id != discarded_after_id) {
+      discarded_attachments.clear();
+      discarded_after = previous_encoder;
+      discarded_after_id = previous_encoder->encoder_id;
+    }
+    discarded_attachments.push_back(discarded);
+  }
+
   void
   ResolveSubresource(IMTLBindable *pSrc, UINT SrcSlice, IMTLBindable *pDst, UINT DstLevel, UINT DstSlice) {
     InvalidateCurrentPass();
@@ -3106,11 +3442,50 @@ public:
     });
   }
 
+  /**
+  Whether the active render pass has exactly the bound render targets and
+  depth stencil as its attachments, so that drawing can continue in it after
+  render targets have been set again
+  */
+  bool
+  CanContinueRenderPass() {
+    switch (cmdbuf_state) {
+    case CommandBufferState::RenderEncoderActive:
+    case CommandBufferState::RenderPipelineReady:
+    case CommandBufferState::TessellationRenderPipelineReady:
+      break;
+    default:
+      return false;
+    }
+    auto previous_encoder = GetLastEncoder();
+    if (previous_encoder->kind != EncoderKind::Render)
+      return false;
+    auto pass_info = (ENCODER_RENDER_INFO *)previous_encoder;
+    auto &OutputMerger = state_.OutputMerger;
+    if (pass_info->num_attachments != OutputMerger.NumRTVs + 1)
+      return false;
+    bool has_attachment = OutputMerger.DSV != nullptr;
+    for (unsigned i = 0; i < OutputMerger.NumRTVs; i++) {
+      if (pass_info->attachments[i].view_id != (uint64_t)OutputMerger.RTVs[i].ptr())
+        return false;
+      has_attachment |= OutputMerger.RTVs[i] != nullptr;
+    }
+    if (pass_info->attachments[OutputMerger.NumRTVs].view_id != (uint64_t)OutputMerger.DSV.ptr())
+      return false;
+    // size of uav-only render pass depends on viewport
+    return has_attachment;
+  }
+
   /**
   Switch to render encoder and set all states (expect for pipeline state)
   */
   bool
   SwitchToRenderEncoder() {
+    if (pending_render_target_change) {
+      pending_render_target_change = false;
+      if (!CanContinueRenderPass())
+        InvalidateCurrentPass();
+    }
     if (cmdbuf_state == CommandBufferState::RenderPipelineReady)
       return true;
     if (cmdbuf_state == CommandBufferState::TessellationRenderPipelineReady)
@@ -3156,6 +3531,9 @@ public:
       // FIXME: is this value always valid?
       uint32_t render_target_array = state_.OutputMerger.ArrayLength;
       auto rtvs = AllocateCommandData<RENDER_TARGET_STATE>(state_.OutputMerger.NumRTVs);
+      // trivially destructible, so it can outlive the list
+      static_assert(std::is_trivially_destructible_v<ENCODER_RENDER_ATTACHMENT>);
+      auto attachments = AllocateCommandData<ENCODER_RENDER_ATTACHMENT>(state_.OutputMerger.NumRTVs + 1);
       for (unsigned i = 0; i < state_.OutputMerger.NumRTVs; i++) {
         auto &rtv = state_.OutputMerger.RTVs[i];
         if (rtv) {
@@ -3163,6 +3541,22 @@ public:
           rtvs[i] = {Use(rtv.ptr()), i, props.Level, props.Slice, props.DepthPlane, rtv->GetPixelFormat()};
           D3D11_ASSERT(rtv->GetPixelFormat() != MTL::PixelFormatInvalid);
           effective_render_target++;
+          auto &attachment = attachments[i];
+          attachment.resource_id = rtv->GetUnderlyingResourceId();
+          attachment.view_id = (uint64_t)rtv.ptr();
+          if (props.SampleCount > 1) {
+            D3D11_RENDER_TARGET_VIEW_DESC desc;
+            rtv->GetDesc(&desc);
+            if (desc.ViewDimension == D3D11_RTV_DIMENSION_TEXTURE2DMS) {
+              attachment.resolvable = 1;
+              attachment.slice = 0;
+            } else if (desc.ViewDimension == D3D11_RTV_DIMENSION_TEXTURE2DMSARRAY &&
+                       desc.Texture2DMSArray.ArraySize == 1) {
+              attachment.resolvable = 1;
+              attachment.slice = desc.Texture2DMSArray.FirstArraySlice;
+            }
+            attachment.format = desc.Format;
+          }
         } else {
           rtvs[i].RenderTargetIndex = i;
         }
@@ -3186,6 +3580,9 @@ public:
       if (state_.OutputMerger.DSV) {
         dsv_info.Texture = Use(state_.OutputMerger.DSV.ptr());
         dsv_info.PixelFormat = state_.OutputMerger.DSV->GetPixelFormat();
+        auto &attachment = attachments[state_.OutputMerger.NumRTVs];
+        attachment.resource_id = state_.OutputMerger.DSV->GetUnderlyingResourceId();
+        attachment.view_id = (uint64_t)state_.OutputMerger.DSV.ptr();
       } else if (effective_render_target == 0) {
         if (state_.OutputMerger.NumRTVs) {
           ERR("NumRTVs is non-zero but all render targets are null.");
@@ -3206,6 +3603,23 @@ public:
       }
 
       auto previous_encoder = GetLastEncoder();
+      if (!discarded_attachments.empty()) {
+        // anything encoded since the discard may have written to them
+        if (previous_encoder == discarded_after && previous_encoder->encoder_id == discarded_after_id) {
+          for (auto &discarded : discarded_attachments) {
+            for (auto &rtv : rtvs.span()) {
+              if (rtv.Texture && discarded.matches(attachments[rtv.RenderTargetIndex]))
+                rtv.LoadAction = MTL::LoadActionDontCare;
+            }
+            if (discarded.matches(attachments[state_.OutputMerger.NumRTVs])) {
+              dsv_info.DepthLoadAction = MTL::LoadActionDontCare;
+              dsv_info.StencilLoadAction = MTL::LoadActionDontCare;
+            }
+          }
+        }
+        discarded_attachments.clear();
+        discarded_after = nullptr;
+      }
       if (previous_encoder->kind == EncoderKind::ClearPass) {
         auto previous_clearpass = (ENCODER_CLEARPASS_INFO *)previous_encoder;
         while (previous_clearpass) {
@@ -3246,6 +3660,8 @@ public:
       };
 
       auto pass_info = MarkRenderPass();
+      pass_info->num_attachments = attachments.size();
+      pass_info->attachments = attachments.data();
 
       vro_state.beginEncoder();
 
@@ -3265,14 +3681,29 @@ public:
           colorAttachment->setDepthPlane(rtv.DepthPlane);
           colorAttachment->setLoadAction(rtv.LoadAction);
           colorAttachment->setClearColor(rtv.ClearColor);
-          colorAttachment->setStoreAction(MTL::StoreActionStore);
+          auto &attachment = pass_info->attachments[rtv.RenderTargetIndex];
+          if (attachment.resolve) {
+            colorAttachment->setResolveTexture(attachment.resolve->texture.texture(&ctx));
+            colorAttachment->setResolveLevel(attachment.resolve->level);
+            colorAttachment->setResolveSlice(attachment.resolve->slice);
+            colorAttachment->setStoreAction(
+                attachment.dont_store ? MTL::StoreActionMultisampleResolve
+                                      : MTL::StoreActionStoreAndMultisampleResolve
+            );
+          } else {
+            colorAttachment->setStoreAction(
+                attachment.dont_store ? MTL::StoreActionDontCare : MTL::StoreActionStore
+            );
+          }
         };
         uint32_t dsv_planar_flags = 0;
 
         if (dsv.Texture) {
           dsv_planar_flags = DepthStencilPlanarFlags(dsv.PixelFormat);
           MTL::Texture *texture = dsv.Texture.texture(&ctx);
-          // TODO: ...should know more about store behavior (e.g. DiscardView)
+          auto store_action = pass_info->attachments[pass_info->num_attachments - 1].dont_store
+                                  ? MTL::StoreActionDontCare
+                                  : MTL::StoreActionStore;
           if (dsv_planar_flags & 1) {
             auto depthAttachment = renderPassDescriptor->depthAttachment();
             depthAttachment->setTexture(texture);
@@ -3280,7 +3711,7 @@ public:
             depthAttachment->setSlice(dsv.ArrayIndex);
             depthAttachment->setLoadAction(dsv.DepthLoadAction);
             depthAttachment->setClearDepth(dsv.ClearDepth);
-            depthAttachment->setStoreAction(MTL::StoreActionStore);
+            depthAttachment->setStoreAction(store_action);
           }
 
           if (dsv_planar_flags & 2) {
@@ -3290,7 +3721,7 @@ public:
             stencilAttachment->setSlice(dsv.ArrayIndex);
             stencilAttachment->setLoadAction(dsv.StencilLoadAction);
             stencilAttachment->setClearStencil(dsv.ClearStencil);
-            stencilAttachment->setStoreAction(MTL::StoreActionStore);
+            stencilAttachment->setStoreAction(store_action);
           }
         }
         if (effective_render_target == 0) {
@@ -3310,21 +3741,11 @@ public:
 
         renderPassDescriptor->setRenderTargetArrayLength(render_target_array);
         ctx.render_encoder = ctx.cmdbuf->renderCommandEncoder(renderPassDescriptor);
-        auto [h, _] = ctx.chk->inspect_gpu_heap();
+        ctx.render_state.reset();
         ctx.dsv_planar_flags = dsv_planar_flags;
+        ctx.tessellation_pass = pass_info->tessellation_pass;
         D3D11_ASSERT(ctx.render_encoder);
-        ctx.render_encoder->setVertexBuffer(h, 0, 16);
-        ctx.render_encoder->setVertexBuffer(h, 0, 29);
-        ctx.render_encoder->setVertexBuffer(h, 0, 30);
-        ctx.render_encoder->setFragmentBuffer(h, 0, 29);
-        ctx.render_encoder->setFragmentBuffer(h, 0, 30);
-        if (pass_info->tessellation_pass) {
-          ctx.render_encoder->setMeshBuffer(h, 0, 29);
-          ctx.render_encoder->setMeshBuffer(h, 0, 30);
-          ctx.render_encoder->setObjectBuffer(h, 0, 16);
-          ctx.render_encoder->setObjectBuffer(h, 0, 29);
-          ctx.render_encoder->setObjectBuffer(h, 0, 30);
-        }
+        BindArgumentHeap(ctx);
       });
     }
 
@@ -3333,6 +3754,22 @@ public:
     return true;
   }
 
+  /**
+  Continue the compute or blit encoder that has been ended last, instead of
+  starting a new one of the same kind, if nothing has been emitted since then.
+  Dispatches and copies are serialized within such an encoder just like across
+  encoders, so no barrier is needed.
+  */
+  bool
+  ContinueEndedPass(EncoderKind kind) {
+    auto pass = ended_pass;
+    ended_pass = nullptr;
+    if (!pass || GetLastEncoder() != pass || pass->encoder_id != ended_pass_id || pass->kind != kind)
+      return false;
+    pass->num_continuations++;
+    return true;
+  }
+
   /**
   Switch to blit encoder
   */
@@ -3342,6 +3779,11 @@ public:
       return;
     InvalidateCurrentPass();
 
+    if (ContinueEndedPass(EncoderKind::Blit)) {
+      cmdbuf_state = BlitKind;
+      return;
+    }
+
     {
       /* Setup ComputeCommandEncoder */
       MarkPass(EncoderKind::Blit);
@@ -3362,6 +3804,12 @@ public:
       return;
     InvalidateCurrentPass();
 
+    if (ContinueEndedPass(EncoderKind::Compute)) {
+      // bindings are still there, only the pipeline has to be set again
+      cmdbuf_state = CommandBufferState::ComputeEncoderActive;
+      return;
+    }
+
     // set dirty state
     state_.ShaderStages[5].ConstantBuffers.set_dirty();
     state_.ShaderStages[5].Samplers.set_dirty();
@@ -3372,9 +3820,7 @@ public:
       MarkPass(EncoderKind::Compute);
       EmitCommand([](CommandChunk::context &ctx) {
         ctx.compute_encoder = ctx.cmdbuf->computeCommandEncoder();
-        auto [heap, offset] = ctx.chk->inspect_gpu_heap();
-        ctx.compute_encoder->setBuffer(heap, 0, 29);
-        ctx.compute_encoder->setBuffer(heap, 0, 30);
+        BindArgumentHeap(ctx);
       });
     }
 
@@ -3391,6 +3837,8 @@ public:
   template <bool IndexedDraw>
   void
   InitializeGraphicsPipelineDesc(MTL_GRAPHICS_PIPELINE_DESC &Desc) {
+    // the desc is compared with memcmp, so padding must be zeroed as well
+    memset(&Desc, 0, sizeof(Desc));
     // TODO: reduce branching
     auto PS = GetManagedShader<ShaderType::Pixel>();
     auto GS = GetManagedShader<ShaderType::Geometry>();
@@ -3438,6 +3886,7 @@ public:
       Desc.IndexBufferFormat = SM50_INDEX_BUFFER_FORMAT_NONE;
     }
     Desc.SampleCount = state_.OutputMerger.SampleCount;
+    ComputeGraphicsPipelineHash(Desc);
   }
 
   template <bool IndexedDraw>
@@ -3570,32 +4019,43 @@ public:
     if (!FinalizeCurrentRenderPipeline<IndexedDraw>()) {
       return false;
     }
+    // argument tables of the bound stages, and the vertex buffer table
+    size_t vertex_buffer_table = 0;
+    if (state_.InputAssembler.InputLayout)
+      vertex_buffer_table =
+          16 * __builtin_popcount(state_.InputAssembler.InputLayout->GetManagedInputLayout()->input_slot_mask()) + 16;
+    if (cmdbuf_state == CommandBufferState::TessellationRenderPipelineReady)
+      ReserveArgumentHeapForStages<ShaderType::Vertex, ShaderType::Pixel, ShaderType::Hull, ShaderType::Domain>(
+          vertex_buffer_table
+      );
+    else
+      ReserveArgumentHeapForStages<ShaderType::Vertex, ShaderType::Pixel>(vertex_buffer_table);
     UpdateVertexBuffer();
     UpdateSOTargets();
     if (dirty_state.any(DirtyState::DepthStencilState)) {
       IMTLD3D11DepthStencilState *state =
           state_.OutputMerger.DepthStencilState ? state_.OutputMerger.DepthStencilState : default_depth_stencil_state;
       EmitCommand([state, stencil_ref = state_.OutputMerger.StencilRef](CommandChunk::context &ctx) {
-        auto encoder = ctx.render_encoder;
-        encoder->setDepthStencilState(state->GetDepthStencilState(ctx.dsv_planar_flags));
-        encoder->setStencilReferenceValue(stencil_ref);
+        auto encoder = ctx.render_encoder.ptr();
+        ctx.render_state.setDepthStencilState(encoder, state->GetDepthStencilState(ctx.dsv_planar_flags));
+        ctx.render_state.setStencilReferenceValue(encoder, stencil_ref);
       });
     }
     if (dirty_state.any(DirtyState::RasterizerState)) {
       IMTLD3D11RasterizerState *state =
           state_.Rasterizer.RasterizerState ? state_.Rasterizer.RasterizerState : default_rasterizer_state;
       EmitCommand([state](CommandChunk::context &ctx) {
-        auto &encoder = ctx.render_encoder;
-        state->SetupRasterizerState(encoder);
+        if (ctx.render_state.updateRasterizerState(state))
+          state->SetupRasterizerState(ctx.render_encoder);
       });
     }
     if (dirty_state.any(DirtyState::BlendFactorAndStencilRef)) {
       EmitCommand([r = state_.OutputMerger.BlendFactor[0], g = state_.OutputMerger.BlendFactor[1],
                    b = state_.OutputMerger.BlendFactor[2], a = state_.OutputMerger.BlendFactor[3],
                    stencil_ref = state_.OutputMerger.StencilRef](CommandChunk::context &ctx) {
-        auto &encoder = ctx.render_encoder;
-        encoder->setBlendColor(r, g, b, a);
-        encoder->setStencilReferenceValue(stencil_ref);
+        auto encoder = ctx.render_encoder.ptr();
+        ctx.render_state.setBlendColor(encoder, r, g, b, a);
+        ctx.render_state.setStencilReferenceValue(encoder, stencil_ref);
       });
     }
     IMTLD3D11RasterizerState *current_rs =
@@ -3615,8 +4075,7 @@ public:
                         d3dViewport.Height,   d3dViewport.MinDepth, d3dViewport.MaxDepth};
       }
       EmitCommand([viewports = std::move(viewports)](CommandChunk::context &ctx) {
-        auto &encoder = ctx.render_encoder;
-        encoder->setViewports(viewports.data(), viewports.size());
+        ctx.render_state.setViewports(ctx.render_encoder, viewports.data(), viewports.size());
       });
     }
     if (dirty_state.any(DirtyState::Scissors)) {
@@ -3640,8 +4099,7 @@ public:
         }
       }
       EmitCommand([scissors = std::move(scissors)](CommandChunk::context &ctx) {
-        auto &encoder = ctx.render_encoder;
-        encoder->setScissorRects(scissors.data(), scissors.size());
+        ctx.render_state.setScissorRects(ctx.render_encoder, scissors.data(), scissors.size());
       });
     }
     if (dirty_state.any(DirtyState::IndexBuffer)) {
@@ -3674,14 +4132,21 @@ public:
       }
     }
     dirty_state.clrAll();
+    bool ready;
     if (cmdbuf_state == CommandBufferState::TessellationRenderPipelineReady) {
-      return UploadShaderStageResourceBinding<ShaderType::Vertex, true>() &&
-             UploadShaderStageResourceBinding<ShaderType::Pixel, true>() &&
-             UploadShaderStageResourceBinding<ShaderType::Hull, true>() &&
-             UploadShaderStageResourceBinding<ShaderType::Domain, true>();
+      ready = UploadShaderStageResourceBinding<ShaderType::Vertex, true>() &&
+              UploadShaderStageResourceBinding<ShaderType::Pixel, true>() &&
+              UploadShaderStageResourceBinding<ShaderType::Hull, true>() &&
+              UploadShaderStageResourceBinding<ShaderType::Domain, true>();
+    } else {
+      ready = UploadShaderStageResourceBinding<ShaderType::Vertex, false>() &&
+              UploadShaderStageResourceBinding<ShaderType::Pixel, false>();
+    }
+    if (pending_resource_usage) {
+      EmitCommand([](CommandChunk::context &ctx) { ctx.resource_usage.flush(ctx.render_encoder.ptr()); });
+      pending_resource_usage = false;
     }
-    return UploadShaderStageResourceBinding<ShaderType::Vertex, false>() &&
-           UploadShaderStageResourceBinding<ShaderType::Pixel, false>();
+    return ready;
   }
 
   /**
@@ -3724,7 +4189,12 @@ public:
     if (!FinalizeCurrentComputePipeline()) {
       return false;
     }
+    ReserveArgumentHeapForStages<ShaderType::Compute>(0);
     UploadShaderStageResourceBinding<ShaderType::Compute, false>();
+    if (pending_resource_usage) {
+      EmitCommand([](CommandChunk::context &ctx) { ctx.resource_usage.flush(ctx.compute_encoder.ptr()); });
+      pending_resource_usage = false;
+    }
     return true;
   }
 
@@ -3883,26 +4353,16 @@ public:
       ManagedDeviceChild(pDevice),
       context_flag(context_flag),
       cmdlist_pool(pPool),
-      monoid(),
-      monoid_list(&monoid, nullptr),
-      list_end(&monoid_list),
-      monoid_event(),
-      monoid_list_event(&monoid_event),
-      list_end_event(&monoid_list_event),
       last_encoder_info(&init_encoder_info),
       staging_allocator(
           pDevice->GetMTLDevice(), MTL::ResourceOptionCPUCacheModeWriteCombined |
                                        MTL::ResourceHazardTrackingModeUntracked | MTL::ResourceStorageModeShared
       ) {
-    cpu_argument_heap = (char *)malloc(kCommandChunkCPUHeapSize);
-    cpu_dynamic_heap = (char *)malloc(kCommandChunkCPUHeapSize);
   };
 
   ~MTLD3D11CommandList() {
     Reset();
     staging_allocator.free_blocks(~0uLL);
-    free(cpu_argument_heap);
-    free(cpu_dynamic_heap);
   }
 
   ULONG
@@ -3930,24 +4390,8 @@ public:
   void
   Reset() {
     staging_allocator.free_blocks(++local_coherence);
-    {
-      auto cur = monoid_list.next;
-      while (cur) {
-        assert((uint64_t)cur->value >= (uint64_t)cpu_argument_heap);
-        assert((uint64_t)cur->value < ((uint64_t)cpu_argument_heap + cpu_arugment_heap_offset));
-        cur->value->~BFunc<CommandChunk::context>();
-        cur = cur->next;
-      }
-    }
-    {
-      auto cur = monoid_list_event.next;
-      while (cur) {
-        assert((uint64_t)cur->value >= (uint64_t)cpu_argument_heap);
-        assert((uint64_t)cur->value < ((uint64_t)cpu_argument_heap + cpu_arugment_heap_offset));
-        cur->value->~BFunc<EventContext>();
-        cur = cur->next;
-      }
-    }
+    commands.clear();
+    events.clear();
 
     {
       for (auto bindable : track_bindable)
@@ -3966,13 +4410,9 @@ public:
       residency_tracker.clear();
       dynamic_view.clear();
     }
-    cpu_arugment_heap_offset = 0;
-    cpu_dynamic_heap_offset = 0;
+    cpu_argument_heap.reset();
+    cpu_dynamic_heap.reset();
     gpu_arugment_heap_offset = 0;
-    monoid_list.next = nullptr;
-    list_end = &monoid_list;
-    monoid_list_event.next = nullptr;
-    list_end_event = &monoid_list_event;
     last_encoder_info = &init_encoder_info;
     encoder_seq_local = 1;
 
@@ -4020,27 +4460,17 @@ public:
   template <typename Fn>
   void
   EmitEvent(Fn &&fn) {
-    using TT = CommandChunk::EFunc<EventContext, Fn>;
-    using NodeT = CommandChunk::Node<CommandChunk::BFunc<EventContext> *>;
-    auto ptr = allocate_cpu_heap<TT>();
-    new (ptr) TT(std::forward<Fn>(fn));
-    auto ptr_node = allocate_cpu_heap<NodeT>();
-    *ptr_node = {ptr, nullptr};
-    list_end_event->next = ptr_node;
-    list_end_event = ptr_node;
+    using stream = CommandStream<EventContext>;
+    auto storage = allocate_cpu_heap(stream::template record_size<Fn>, stream::template record_alignment<Fn>);
+    events.append(storage, std::forward<Fn>(fn));
   }
 
   template <typename Fn>
   void
   EmitCommand(Fn &&fn) {
-    using TT = CommandChunk::EFunc<CommandChunk::context, Fn>;
-    using NodeT = CommandChunk::Node<CommandChunk::BFunc<CommandChunk::context> *>;
-    auto ptr = allocate_cpu_heap<TT>();
-    new (ptr) TT(std::forward<Fn>(fn));
-    auto ptr_node = allocate_cpu_heap<NodeT>();
-    *ptr_node = {ptr, nullptr};
-    list_end->next = ptr_node;
-    list_end = ptr_node;
+    using stream = CommandStream<CommandChunk::context>;
+    auto storage = allocate_cpu_heap(stream::template record_size<Fn>, stream::template record_alignment<Fn>);
+    commands.append(storage, std::forward<Fn>(fn));
   }
 
   BindingRef
@@ -4130,6 +4560,7 @@ public:
     auto ptr = allocate_cpu_heap<ENCODER_INFO>();
     ptr->kind = kind;
     ptr->encoder_id = encoder_seq_local++;
+    ptr->num_continuations = 0;
     last_encoder_info = ptr;
     return ptr;
   }
@@ -4147,13 +4578,7 @@ public:
 
   void *
   allocate_cpu_heap(size_t size, size_t alignment) {
-    std::size_t adjustment = align_forward_adjustment((void *)cpu_arugment_heap_offset, alignment);
-    auto aligned = cpu_arugment_heap_offset + adjustment;
-    cpu_arugment_heap_offset = aligned + size;
-    if (cpu_arugment_heap_offset >= kCommandChunkCPUHeapSize) {
-      ERR(cpu_arugment_heap_offset, " - cpu argument heap overflow, expect error.");
-    }
-    return ptr_add(cpu_argument_heap, aligned);
+    return cpu_argument_heap.allocate(size, alignment);
   }
 
   template <typename T>
@@ -4164,11 +4589,7 @@ public:
 
   void *
   AllocateDynamicTempBuffer(IMTLDynamicBuffer *token, size_t size) {
-    auto ptr = cpu_dynamic_heap + cpu_dynamic_heap_offset;
-    cpu_dynamic_heap_offset+=size;
-    if (cpu_dynamic_heap_offset >= kCommandChunkCPUHeapSize) {
-      ERR(cpu_dynamic_heap_offset, " - cpu dynamic heap overflow, expect error.");
-    }
+    auto ptr = cpu_dynamic_heap.allocate(size, 16);
     dynamic_buffer.push_back(ptr);
     dynamic_buffer_map[token] = ptr;
     for (auto view : dynamic_view[token]) {
@@ -4211,7 +4632,7 @@ public:
 
   bool
   Noop() {
-    return cpu_arugment_heap_offset == 0 && gpu_arugment_heap_offset == 0;
+    return cpu_argument_heap.empty() && gpu_arugment_heap_offset == 0;
   };
 
   void
@@ -4225,24 +4646,12 @@ public:
         dsv->UseBindable(ctx.cmd_queue.CurrentSeqId());
     }
 
-    auto cur = monoid_list_event.next;
-    while (cur) {
-      assert((uint64_t)cur->value >= (uint64_t)cpu_argument_heap);
-      assert((uint64_t)cur->value < ((uint64_t)cpu_argument_heap + cpu_arugment_heap_offset));
-      cur->value->invoke(ctx);
-      cur = cur->next;
-    }
+    events.execute(ctx);
   }
 
   void
   EncodeCommands(CommandChunk::context &ctx) {
-    auto cur = monoid_list.next;
-    while (cur) {
-      assert((uint64_t)cur->value >= (uint64_t)cpu_argument_heap);
-      assert((uint64_t)cur->value < ((uint64_t)cpu_argument_heap + cpu_arugment_heap_offset));
-      cur->value->invoke(ctx);
-      cur = cur->next;
-    }
+    commands.execute(ctx);
   }
 
 #pragma endregion
@@ -4257,20 +4666,13 @@ private:
   UINT context_flag;
   MTLD3D11CommandListPoolBase *cmdlist_pool;
 
-  uint64_t cpu_arugment_heap_offset = 0;
-  char *cpu_argument_heap;
-  char *cpu_dynamic_heap;
-  uint64_t cpu_dynamic_heap_offset = 0;
-
-  CommandChunk::MFunc<CommandChunk::context> monoid;
-  CommandChunk::Node<CommandChunk::BFunc<CommandChunk::context> *> monoid_list;
-  CommandChunk::Node<CommandChunk::BFunc<CommandChunk::context> *> *list_end;
+  CPUArena cpu_argument_heap{"command list cpu argument heap"};
+  CPUArena cpu_dynamic_heap{"command list cpu dynamic heap"};
 
-  CommandChunk::MFunc<EventContext> monoid_event;
-  CommandChunk::Node<CommandChunk::BFunc<EventContext> *> monoid_list_event;
-  CommandChunk::Node<CommandChunk::BFunc<EventContext> *> *list_end_event;
+  CommandStream<CommandChunk::context> commands;
+  CommandStream<EventContext> events;
 
-  ENCODER_INFO init_encoder_info{EncoderKind::Nil, 0};
+  ENCODER_INFO init_encoder_info{EncoderKind::Nil, 0, 0};
   ENCODER_INFO *last_encoder_info;
   uint64_t encoder_seq_local = 1;
 
@@ -35,6 +35,8 @@ struct CONSTANT_BUFFER_B {
   Com<IMTLBindable> Buffer;
   UINT FirstConstant;
   UINT NumConstants;
+  // same object as Buffer, if its contents can be inlined
+  IMTLDynamicBuffer *InlineSource = nullptr;
 };
 
 typedef BindingSet<CONSTANT_BUFFER_B, 14> ConstantBufferBindingSet;
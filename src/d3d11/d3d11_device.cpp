@@ -69,6 +69,11 @@ public:
     pipeline_cache_ = InitializePipelineCache(this);
     context_ = InitializeImmediateContext(this, device_.queue());
     is_traced_ = !!::GetModuleHandle("dxgitrace.dll");
+    // same as dedicated dynamic buffers, see DynamicBuffer
+    if (is_traced_)
+      device_.queue().dynamic_buffer_ring.set_block_options(
+          MTL::ResourceCPUCacheModeDefaultCache |
+          MTL::ResourceStorageModeShared);
     format_inspector.Inspect(container->GetMTLDevice());
   }
 
@@ -1069,6 +1074,17 @@ public:
                   device_.queue().CoherentSeqId(), pBuffer, gpuAddr, cpuAddr);
   }
 
+  bool ExchangeFromRing(BufferRingAllocation *pAllocation, size_t size) final {
+    D3D11_ASSERT(size <= kBufferRingMaxAllocationSize);
+    auto &queue = device_.queue();
+    return queue.dynamic_buffer_ring.Exchange(queue.CurrentSeqId(),
+                                       queue.CoherentSeqId(), size, pAllocation);
+  }
+
+  void ReleaseToRing(BufferRingAllocation *pAllocation) final {
+    device_.queue().dynamic_buffer_ring.Release(pAllocation);
+  }
+
   void CreateCommandList(ID3D11CommandList** pCommandList) final {
     commandlist_pool_->CreateCommandList(pCommandList);
   };
@@ -67,6 +67,20 @@ public:
   virtual void ExchangeFromPool(MTL::Buffer * *ppBuffer, uint64_t * gpuAddr,
                                 void **cpuAddr, dxmt::BufferPool *pool) = 0;
 
+  /**
+  Same as above, but the buffer is a sub-allocation of the device-wide ring
+  of small dynamic buffers. `pAllocation` may be empty, and the previous one
+  is released. Return false if the ring is full, then the caller needs a
+  dedicated buffer.
+  */
+  virtual bool ExchangeFromRing(dxmt::BufferRingAllocation *pAllocation,
+                                size_t size) = 0;
+
+  /**
+  Release a sub-allocation of the ring that isn't used by GPU anymore.
+  */
+  virtual void ReleaseToRing(dxmt::BufferRingAllocation *pAllocation) = 0;
+
   virtual void CreateCommandList(ID3D11CommandList** pCommandList) = 0;
 };
 
@@ -9,6 +9,7 @@
 #include "d3d11_shader.hpp"
 #include "d3d11_state_object.hpp"
 #include "util_hash.hpp"
+#include <cstring>
 
 struct MTL_GRAPHICS_PIPELINE_DESC {
   ManagedShader VertexShader;
@@ -27,6 +28,11 @@ struct MTL_GRAPHICS_PIPELINE_DESC {
   SM50_INDEX_BUFFER_FORAMT IndexBufferFormat;
   uint32_t SampleMask;
   uint32_t GSPassthrough;
+  /**
+  content hash, must be updated by ComputeGraphicsPipelineHash after all
+  fields are filled
+   */
+  uint64_t Hash;
 };
 
 struct MTL_COMPUTE_PIPELINE_DESC {
@@ -82,93 +88,44 @@ DEFINE_COM_INTERFACE("f5075e27-fd85-4c5a-9031-d438f859e6e9",
 namespace std {
 template <> struct hash<MTL_GRAPHICS_PIPELINE_DESC> {
   size_t operator()(const MTL_GRAPHICS_PIPELINE_DESC &v) const noexcept {
-    dxmt::HashState state;
-    state.add((size_t)v.VertexShader);
-    state.add((size_t)v.PixelShader);
-    state.add((size_t)v.HullShader);
-    state.add((size_t)v.DomainShader);
-    state.add((size_t)v.InputLayout);
-    /* don't add blend */
-    // state.add((size_t)v.BlendState);
-    state.add((size_t)v.DepthStencilFormat);
-    state.add((size_t)v.TopologyClass);
-    state.add((size_t)v.IndexBufferFormat);
-    state.add((size_t)v.SampleMask);
-    state.add((size_t)v.GSPassthrough);
-    state.add((size_t)v.SampleCount);
-    state.add((size_t)v.NumColorAttachments);
-    for (unsigned i = 0; i < v.NumColorAttachments; i++) {
-      state.add(v.ColorAttachmentFormats[i]);
-    }
-    return state;
+    return v.Hash;
   };
 };
 template <> struct equal_to<MTL_GRAPHICS_PIPELINE_DESC> {
   bool operator()(const MTL_GRAPHICS_PIPELINE_DESC &x,
                   const MTL_GRAPHICS_PIPELINE_DESC &y) const {
-    if (x.NumColorAttachments != y.NumColorAttachments)
-      return false;
-    for (unsigned i = 0; i < x.NumColorAttachments; i++) {
-      if (x.ColorAttachmentFormats[i] != y.ColorAttachmentFormats[i])
-        return false;
-    }
-    if (x.BlendState != y.BlendState) {
-      D3D11_BLEND_DESC1 x_, y_;
-      x.BlendState->GetDesc1(&x_);
-      y.BlendState->GetDesc1(&y_);
-      if (x_.IndependentBlendEnable != y_.IndependentBlendEnable)
-        return false;
-      if (x_.AlphaToCoverageEnable != y_.AlphaToCoverageEnable)
-        return false;
-      uint32_t num_blend_target =
-          x_.IndependentBlendEnable ? x.NumColorAttachments : 1;
-      for (unsigned i = 0; i < num_blend_target; i++) {
-        auto &blend_target_x = x_.RenderTarget[i];
-        auto &blend_target_y = y_.RenderTarget[i];
-        if (blend_target_x.RenderTargetWriteMask !=
-            blend_target_y.RenderTargetWriteMask)
-          return false;
-        if (blend_target_x.BlendEnable != blend_target_y.BlendEnable)
-          return false;
-        if (blend_target_x.LogicOpEnable != blend_target_y.LogicOpEnable)
-          return false;
-        if (blend_target_x.BlendEnable) {
-          if (blend_target_x.BlendOp != blend_target_y.BlendOp)
-            return false;
-          if (blend_target_x.BlendOpAlpha != blend_target_y.BlendOpAlpha)
-            return false;
-          if (blend_target_x.SrcBlend != blend_target_y.SrcBlend)
-            return false;
-          if (blend_target_x.SrcBlendAlpha != blend_target_y.SrcBlendAlpha)
-            return false;
-          if (blend_target_x.DestBlend != blend_target_y.DestBlend)
-            return false;
-          if (blend_target_x.DestBlendAlpha != blend_target_y.DestBlendAlpha)
-            return false;
-        }
-        if (blend_target_x.LogicOpEnable) {
-          if (blend_target_x.LogicOp != blend_target_y.LogicOp)
-            return false;
-        }
-      }
-    }
-    return (x.VertexShader == y.VertexShader) &&
-           (x.PixelShader == y.PixelShader) && (x.HullShader == y.HullShader) &&
-           (x.DomainShader == y.DomainShader) &&
-           (x.InputLayout == y.InputLayout) &&
-           (x.DepthStencilFormat == y.DepthStencilFormat) &&
-           (x.TopologyClass == y.TopologyClass) &&
-           (x.RasterizationEnabled == y.RasterizationEnabled) &&
-           (x.SampleCount == y.SampleCount) &&
-           (x.IndexBufferFormat == y.IndexBufferFormat) &&
-           (x.SampleMask == y.SampleMask) &&
-           (x.GSPassthrough == y.GSPassthrough);
+    /* padding is zeroed and blend states are deduplicated by content */
+    return std::memcmp(&x, &y, sizeof(MTL_GRAPHICS_PIPELINE_DESC)) == 0;
   }
 };
 } // namespace std
 
 namespace dxmt {
 
+inline void
+ComputeGraphicsPipelineHash(MTL_GRAPHICS_PIPELINE_DESC &Desc) {
+  HashState state;
+  state.add((size_t)Desc.VertexShader);
+  state.add((size_t)Desc.PixelShader);
+  state.add((size_t)Desc.HullShader);
+  state.add((size_t)Desc.DomainShader);
+  state.add((size_t)Desc.InputLayout);
+  state.add((size_t)Desc.SOLayout);
+  state.add(Desc.BlendState ? Desc.BlendState->GetContentHash() : 0);
+  state.add((size_t)Desc.DepthStencilFormat);
+  state.add((size_t)Desc.TopologyClass);
+  state.add((size_t)Desc.RasterizationEnabled);
+  state.add((size_t)Desc.IndexBufferFormat);
+  state.add((size_t)Desc.SampleMask);
+  state.add((size_t)Desc.GSPassthrough);
+  state.add((size_t)Desc.SampleCount);
+  state.add((size_t)Desc.NumColorAttachments);
+  for (unsigned i = 0; i < Desc.NumColorAttachments; i++) {
+    state.add(Desc.ColorAttachmentFormats[i]);
+  }
+  Desc.Hash = state;
+}
+
 Com<IMTLCompiledGraphicsPipeline> CreateGraphicsPipeline(
     MTLD3D11Device *pDevice, MTL_GRAPHICS_PIPELINE_DESC* pDesc);
 
@@ -3,7 +3,10 @@
 #include "d3d11_device.hpp"
 #include "d3d11_shader.hpp"
 #include "d3d11_pipeline.hpp"
+#include "d3d11_shader_pack.hpp"
+#include "d3d11_shader_variants.hpp"
 #include "log/log.hpp"
+#include "util_concurrent_map.hpp"
 #include <shared_mutex>
 
 namespace dxmt {
@@ -12,23 +15,56 @@ std::atomic_uint64_t global_id = 0;
 
 class CachedSM50Shader final : public Shader {
   MTLD3D11Device *device;
-  SM50Shader *shader = nullptr;
+  std::atomic<SM50Shader *> shader = nullptr;
   MTL_SHADER_REFLECTION reflection_;
   uint64_t id_ = ~0uLL;
-  std::unordered_map<ShaderVariant, std::unique_ptr<CompiledShader>>
-      variants;
+  Xxh3Hash hash_;
+  /* non-null if the shader is served from a shader pack */
+  const DXMT_SHADER_PACK_SHADER *packed_ = nullptr;
+  /* only kept for packed shaders, which are initialized on demand */
+  std::vector<char> bytecode_;
+  dxmt::mutex mutex_;
+  ShaderVariantTable<ShaderVariant, CompiledShader> variants;
+
+  SM50Shader *initialize() {
+    std::lock_guard<dxmt::mutex> lock(mutex_);
+    if (auto sm50 = shader.load(std::memory_order_relaxed))
+      return sm50;
+    SM50Error *err;
+    SM50Shader *sm50;
+    // reflection has been provided by the shader pack
+    if (SM50Initialize(bytecode_.data(), bytecode_.size(), &sm50, nullptr,
+                       &err)) {
+      ERR("Failed to initialize shader: ", SM50GetErrorMesssage(err));
+      SM50FreeError(err);
+      return nullptr;
+    }
+    shader.store(sm50, std::memory_order_release);
+    return sm50;
+  }
 
 public:
-  CachedSM50Shader(MTLD3D11Device *device, SM50Shader *shader_transfered,
+  CachedSM50Shader(MTLD3D11Device *device, const Xxh3Hash &hash,
+                   SM50Shader *shader_transfered,
+                   MTL_SHADER_REFLECTION &reflection)
+      : device(device), shader(shader_transfered), reflection_(reflection),
+        hash_(hash) {
+    id_ = global_id++;
+  }
+
+  CachedSM50Shader(MTLD3D11Device *device, const Xxh3Hash &hash,
+                   const DXMT_SHADER_PACK_SHADER *packed,
+                   const void *pBytecode, uint32_t BytecodeLength,
                    MTL_SHADER_REFLECTION &reflection)
-      : device(device), shader(shader_transfered), reflection_(reflection) {
+      : device(device), reflection_(reflection), hash_(hash), packed_(packed),
+        bytecode_((const char *)pBytecode,
+                  (const char *)pBytecode + BytecodeLength) {
     id_ = global_id++;
   }
 
   ~CachedSM50Shader() {
-    if (shader) {
-      SM50Destroy(shader);
-      shader = nullptr;
+    if (auto sm50 = shader.exchange(nullptr)) {
+      SM50Destroy(sm50);
     }
   };
 
@@ -36,24 +72,46 @@ public:
     memcpy(&reflection_, &moved.reflection_, sizeof(reflection_));
     id_ = moved.id_;
     moved.id_ = ~0uLL;
-    shader = moved.shader;
-    moved.shader = nullptr;
+    shader = moved.shader.exchange(nullptr);
+    hash_ = moved.hash_;
+    packed_ = moved.packed_;
+    bytecode_ = std::move(moved.bytecode_);
   };
   CachedSM50Shader(const CachedSM50Shader &copy) = delete;
 
-  virtual SM50Shader *handle() { return shader; };
+  virtual SM50Shader *handle() {
+    if (auto sm50 = shader.load(std::memory_order_acquire))
+      return sm50;
+    return initialize();
+  };
   virtual MTL_SHADER_REFLECTION &reflection() { return reflection_; }
   virtual Com<CompiledShader> get_shader(ShaderVariant variant) {
-    auto c = variants.insert({variant, nullptr});
-    if (c.second) {
-      c.first->second = std::visit(
-          [=, this](auto var) {
-            return CreateVariantShader(device, this, var);
-          },
-          variant);
-      device->SubmitThreadgroupWork(c.first->second.get());
-    }
-    return c.first->second.get();
+    return variants.get(
+        variant,
+        [&, this]() -> std::unique_ptr<CompiledShader> {
+          auto pack = packed_ ? ShaderPack::instance() : nullptr;
+          auto recorder = ShaderPackRecorder::instance();
+          std::vector<char> desc;
+          if ((pack || recorder) && GetShaderPackVariantDesc(variant, desc)) {
+            if (pack) {
+              auto key = Xxh3Hash::compute(desc.data(), desc.size());
+              if (auto entry = pack->FindVariant(packed_, key))
+                return CreatePackedVariantShader(device,
+                                                 pack->GetMetallib(entry),
+                                                 entry->MetallibSize);
+            }
+            if (recorder)
+              recorder->RecordVariant(hash_, desc);
+          }
+          return std::visit(
+              [=, this](auto var) {
+                return CreateVariantShader(device, this, var);
+              },
+              variant);
+        },
+        [this](CompiledShader *compiled) {
+          device->SubmitThreadgroupWork(compiled);
+        });
   }
   virtual uint64_t id() { return id_; };
 
@@ -136,17 +194,15 @@ class PipelineCache : public MTLD3D11PipelineCacheBase {
   StateObjectCache<MTL_STREAM_OUTPUT_DESC, IMTLD3D11StreamOutputLayout>
       so_layouts;
 
-  std::unordered_map<MTL_GRAPHICS_PIPELINE_DESC,
-                     Com<IMTLCompiledGraphicsPipeline>>
+  ConcurrentHashMap<MTL_GRAPHICS_PIPELINE_DESC,
+                    Com<IMTLCompiledGraphicsPipeline>>
       pipelines_;
-  dxmt::mutex mutex_;
 
-  std::unordered_map<MTL_GRAPHICS_PIPELINE_DESC,
-                     Com<IMTLCompiledTessellationPipeline>>
+  ConcurrentHashMap<MTL_GRAPHICS_PIPELINE_DESC,
+                    Com<IMTLCompiledTessellationPipeline>>
       pipelines_ts_;
-  dxmt::mutex mutex_ts_;
 
-  std::unordered_map<Sha1Hash, std::unique_ptr<CachedSM50Shader>> shaders_;
+  std::unordered_map<Xxh3Hash, std::unique_ptr<CachedSM50Shader>> shaders_;
   std::shared_mutex mutex_shares;
 
   HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid,
@@ -167,31 +223,45 @@ class PipelineCache : public MTLD3D11PipelineCacheBase {
 
   CachedSM50Shader *CreateShader(const void *pBytecode,
                                  uint32_t BytecodeLength) {
-    auto sha1 = Sha1Hash::compute(pBytecode, BytecodeLength);
+    auto hash = Xxh3Hash::compute(pBytecode, BytecodeLength);
     {
       std::shared_lock<std::shared_mutex> lock(mutex_shares);
-      auto result = shaders_.find(sha1);
+      auto result = shaders_.find(hash);
       if (result != shaders_.end()) {
-        return shaders_.at(sha1).get();
+        return shaders_.at(hash).get();
       }
     }
-    SM50Error *err;
-    SM50Shader *sm50;
+    std::unique_ptr<CachedSM50Shader> shader;
     MTL_SHADER_REFLECTION reflection;
-    if (SM50Initialize(pBytecode, BytecodeLength, &sm50, &reflection, &err)) {
-      ERR("Failed to initialize shader: ", SM50GetErrorMesssage(err));
-      SM50FreeError(err);
-      return nullptr;
+    auto pack = ShaderPack::instance();
+    if (auto packed = pack ? pack->FindShader(hash) : nullptr) {
+      pack->GetReflection(packed, &reflection);
+      shader = std::make_unique<CachedSM50Shader>(
+          device, hash, packed, pBytecode, BytecodeLength, reflection);
+    } else {
+      SM50Error *err;
+      SM50Shader *sm50;
+      if (SM50Initialize(pBytecode, BytecodeLength, &sm50, &reflection,
+                         &err)) {
+        ERR("Failed to initialize shader: ", SM50GetErrorMesssage(err));
+        SM50FreeError(err);
+        return nullptr;
+      }
+      shader =
+          std::make_unique<CachedSM50Shader>(device, hash, sm50, reflection);
     }
-    auto shader = std::make_unique<CachedSM50Shader>(device, sm50, reflection);
+    CachedSM50Shader *inserted;
     {
       std::unique_lock<std::shared_mutex> lock(mutex_shares);
-      auto result = shaders_.find(sha1);
+      auto result = shaders_.find(hash);
       if (result != shaders_.end()) {
-        return shaders_.at(sha1).get();
+        return shaders_.at(hash).get();
       }
-      return shaders_.emplace(sha1, std::move(shader)).first->second.get();
+      inserted = shaders_.emplace(hash, std::move(shader)).first->second.get();
     }
+    if (auto recorder = ShaderPackRecorder::instance())
+      recorder->RecordShader(hash, pBytecode, BytecodeLength);
+    return inserted;
   }
 
   virtual HRESULT AddVertexShader(const void *pBytecode,
@@ -317,37 +387,19 @@ class PipelineCache : public MTLD3D11PipelineCacheBase {
 
   void GetGraphicsPipeline(MTL_GRAPHICS_PIPELINE_DESC *pDesc,
                            IMTLCompiledGraphicsPipeline **ppPipeline) override {
-    std::lock_guard<dxmt::mutex> lock(mutex_);
-
-    auto iter = pipelines_.find(*pDesc);
-    if (iter != pipelines_.end()) {
-      *ppPipeline = iter->second.ref();
-      return;
-    }
-    auto temp = dxmt::CreateGraphicsPipeline(device, pDesc);
-    if (!pipelines_.insert({*pDesc, temp}).second) // copy
-    {
-      D3D11_ASSERT(0 && "duplicated graphics pipeline");
-    }
-    *ppPipeline = std::move(temp);                          // move
+    auto &pipeline = pipelines_.get_or_insert(*pDesc, [&]() {
+      return dxmt::CreateGraphicsPipeline(device, pDesc);
+    }).first;
+    *ppPipeline = pipeline.ref();
   }
 
   void GetTessellationPipeline(
       MTL_GRAPHICS_PIPELINE_DESC *pDesc,
       IMTLCompiledTessellationPipeline **ppPipeline) override {
-    std::lock_guard<dxmt::mutex> lock(mutex_ts_);
-
-    auto iter = pipelines_ts_.find(*pDesc);
-    if (iter != pipelines_ts_.end()) {
-      *ppPipeline = iter->second.ref();
-      return;
-    }
-    auto temp = dxmt::CreateTessellationPipeline(device, pDesc);
-    if (!pipelines_ts_.insert({*pDesc, temp}).second) // copy
-    {
-      D3D11_ASSERT(0 && "duplicated tessellation pipeline");
-    }
-    *ppPipeline = std::move(temp);
+    auto &pipeline = pipelines_ts_.get_or_insert(*pDesc, [&]() {
+      return dxmt::CreateTessellationPipeline(device, pDesc);
+    }).first;
+    *ppPipeline = pipeline.ref();
   }
 
 public:
@@ -2,18 +2,17 @@
 #include "Metal/MTLLibrary.hpp"
 #include "airconv_public.h"
 #include "d3d11_input_layout.hpp"
+#include "d3d11_shader_pack.hpp"
 
 namespace dxmt {
 
-template <typename Proc>
-class GeneralShaderCompileTask : public CompiledShader {
+/**
+Loads the function of a compiled shader from a metallib, on a worker thread
+ */
+class ShaderLibraryTask : public CompiledShader {
 public:
-  GeneralShaderCompileTask(MTLD3D11Device *pDevice, ManagedShader shader,
-                           Proc &&proc)
-      : CompiledShader(), proc(std::forward<Proc>(proc)), device_(pDevice),
-        shader_(shader) {}
-
-  ~GeneralShaderCompileTask() {}
+  ShaderLibraryTask(MTLD3D11Device *pDevice)
+      : CompiledShader(), device_(pDevice) {}
 
   ULONG STDMETHODCALLTYPE AddRef() {
     uint32_t refCount = m_refCount++;
@@ -42,66 +41,112 @@ public:
   bool GetShader(MTL_COMPILED_SHADER *pShaderData) final {
     bool ret = false;
     if ((ret = ready_.load(std::memory_order_acquire))) {
-      *pShaderData = {function_.ptr(), &hash_};
+      *pShaderData = {function_.ptr()};
     }
     return ret;
   }
 
-  IMTLThreadpoolWork *RunThreadpoolWork() {
-    auto pool = transfer(NS::AutoreleasePool::alloc()->init());
-    Obj<NS::Error> err;
-    std::string func_name = "shader_main_" + std::to_string(shader_->id());
-    SM50CompiledBitcode *compile_result = proc(func_name.c_str());
+  bool GetIsDone() { return ready_; }
 
-    if (!compile_result)
-      return this;
+  void SetIsDone(bool state) { ready_.store(state); }
 
-    MTL_SHADER_BITCODE bitcode;
-    SM50GetCompiledBitcode(compile_result, &bitcode);
-    hash_.compute(bitcode.Data, bitcode.Size);
-    auto dispatch_data =
-        dispatch_data_create(bitcode.Data, bitcode.Size, nullptr, nullptr);
-    D3D11_ASSERT(dispatch_data);
+protected:
+  /**
+  Create the function `func_name` of the metallib in `data`, which is released
+   */
+  void LoadFunction(dispatch_data_t data, const char *func_name) {
+    D3D11_ASSERT(data);
+    Obj<NS::Error> err;
     Obj<MTL::Library> library =
-        transfer(device_->GetMTLDevice()->newLibrary(dispatch_data, &err));
+        transfer(device_->GetMTLDevice()->newLibrary(data, &err));
+    dispatch_release(data);
 
     if (err) {
       ERR("Failed to create MTLLibrary: ",
           err->localizedDescription()->utf8String());
-      return this;
+      return;
     }
 
-    dispatch_release(dispatch_data);
-    SM50DestroyBitcode(compile_result);
     function_ = transfer(library->newFunction(
-        NS::String::string(func_name.c_str(), NS::UTF8StringEncoding)));
+        NS::String::string(func_name, NS::UTF8StringEncoding)));
     if (function_ == nullptr) {
       ERR("Failed to create MTLFunction: ", func_name);
     }
-
-    return this;
   }
 
-  bool GetIsDone() { return ready_; }
-
-  void SetIsDone(bool state) { ready_.store(state); }
-
 private:
-  Proc proc;
   MTLD3D11Device *device_;
-  ManagedShader shader_;
   std::atomic_bool ready_;
-  Sha1Hash hash_;
   Obj<MTL::Function> function_;
   std::atomic<uint32_t> m_refCount = {0ul};
 };
 
+template <typename Proc>
+class GeneralShaderCompileTask : public ShaderLibraryTask {
+public:
+  GeneralShaderCompileTask(MTLD3D11Device *pDevice, ManagedShader shader,
+                           Proc &&proc)
+      : ShaderLibraryTask(pDevice), proc(std::forward<Proc>(proc)),
+        shader_(shader) {}
+
+  ~GeneralShaderCompileTask() {}
+
+  IMTLThreadpoolWork *RunThreadpoolWork() {
+    auto pool = transfer(NS::AutoreleasePool::alloc()->init());
+    std::string func_name = "shader_main_" + std::to_string(shader_->id());
+    SM50CompiledBitcode *compile_result = proc(func_name.c_str());
+
+    if (!compile_result)
+      return this;
+
+    // compile_result is owned by dispatch_data from now on
+    LoadFunction(winemetal_create_bitcode_data(compile_result),
+                 func_name.c_str());
+    return this;
+  }
+
+private:
+  Proc proc;
+  ManagedShader shader_;
+};
+
+class PackedShaderLoadTask : public ShaderLibraryTask {
+public:
+  PackedShaderLoadTask(MTLD3D11Device *pDevice, const void *pMetallib,
+                       size_t MetallibSize)
+      : ShaderLibraryTask(pDevice), metallib_(pMetallib),
+        metallib_size_(MetallibSize) {}
+
+  IMTLThreadpoolWork *RunThreadpoolWork() {
+    auto pool = transfer(NS::AutoreleasePool::alloc()->init());
+    // the shader pack stays mapped for the lifetime of the process
+    LoadFunction(winemetal_create_unowned_data(metallib_, metallib_size_),
+                 DXMT_SHADER_PACK_FUNCTION_NAME);
+    return this;
+  }
+
+private:
+  const void *metallib_;
+  size_t metallib_size_;
+};
+
+std::unique_ptr<CompiledShader>
+CreatePackedVariantShader(MTLD3D11Device *pDevice, const void *pMetallib,
+                          size_t MetallibSize) {
+  return std::make_unique<PackedShaderLoadTask>(pDevice, pMetallib,
+                                                MetallibSize);
+}
+
 template <>
 std::unique_ptr<CompiledShader>
 CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
                     ShaderVariantVertex variant) {
 
   auto proc = [=](const char *func_name) -> SM50CompiledBitcode * {
+    // lazily initialized for shaders loaded from a pack, and it may fail
+    auto sm50 = shader->handle();
+    if (!sm50)
+      return nullptr;
     SM50_SHADER_IA_INPUT_LAYOUT_DATA data_ia_layout;
     SM50_SHADER_GS_PASS_THROUGH_DATA data_gs_passthrough;
     data_gs_passthrough.type = SM50_SHADER_GS_PASS_THROUGH;
@@ -112,6 +157,7 @@ CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
       data_gs_passthrough.next = &data_ia_layout;
       data_ia_layout.type = SM50_SHADER_IA_INPUT_LAYOUT;
       data_ia_layout.next = nullptr;
+      data_ia_layout.index_buffer_format = SM50_INDEX_BUFFER_FORMAT_NONE;
       data_ia_layout.slot_mask =
           ((ManagedInputLayout)variant.input_layout_handle)->input_slot_mask();
       data_ia_layout.num_elements =
@@ -123,7 +169,7 @@ CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
     SM50CompiledBitcode *compile_result = nullptr;
     SM50Error *sm50_err = nullptr;
     if (auto ret = SM50Compile(
-            shader->handle(),
+            sm50,
             (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&data_gs_passthrough,
             func_name, &compile_result, &sm50_err)) {
       if (ret == 42) {
@@ -145,6 +191,9 @@ std::unique_ptr<CompiledShader>
 CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
                     ShaderVariantPixel variant) {
   auto proc = [=](const char *func_name) -> SM50CompiledBitcode * {
+    auto sm50 = shader->handle();
+    if (!sm50)
+      return nullptr;
     SM50_SHADER_PSO_PIXEL_SHADER_DATA data;
     data.type = SM50_SHADER_PSO_PIXEL_SHADER;
     data.next = nullptr;
@@ -154,7 +203,7 @@ CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
 
     SM50CompiledBitcode *compile_result = nullptr;
     SM50Error *sm50_err = nullptr;
-    if (auto ret = SM50Compile(shader->handle(),
+    if (auto ret = SM50Compile(sm50,
                                (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&data,
                                func_name, &compile_result, &sm50_err)) {
       if (ret == 42) {
@@ -176,9 +225,12 @@ std::unique_ptr<CompiledShader>
 CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
                     ShaderVariantDefault) {
   auto proc = [=](const char *func_name) -> SM50CompiledBitcode * {
+    auto sm50 = shader->handle();
+    if (!sm50)
+      return nullptr;
     SM50CompiledBitcode *compile_result = nullptr;
     SM50Error *sm50_err = nullptr;
-    if (auto ret = SM50Compile(shader->handle(), nullptr, func_name,
+    if (auto ret = SM50Compile(sm50, nullptr, func_name,
                                &compile_result, &sm50_err)) {
       if (ret == 42) {
         ERR("Failed to compile shader due to failed assertion");
@@ -199,6 +251,9 @@ std::unique_ptr<CompiledShader>
 CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
                     ShaderVariantTessellationVertex variant) {
   auto proc = [=](const char *func_name) -> SM50CompiledBitcode * {
+    auto sm50 = shader->handle();
+    if (!sm50 || !variant.hull_shader_handle)
+      return nullptr;
     SM50_SHADER_IA_INPUT_LAYOUT_DATA ia_layout;
     ia_layout.index_buffer_format = variant.index_buffer_format;
     ia_layout.slot_mask =
@@ -213,7 +268,7 @@ CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
     SM50CompiledBitcode *compile_result = nullptr;
     SM50Error *sm50_err = nullptr;
     if (auto ret = SM50CompileTessellationPipelineVertex(
-            shader->handle(), (SM50Shader *)variant.hull_shader_handle,
+            sm50, (SM50Shader *)variant.hull_shader_handle,
             (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&ia_layout, func_name,
             &compile_result, &sm50_err)) {
       if (ret == 42) {
@@ -235,10 +290,13 @@ std::unique_ptr<CompiledShader>
 CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
                     ShaderVariantTessellationHull variant) {
   auto proc = [=](const char *func_name) -> SM50CompiledBitcode * {
+    auto sm50 = shader->handle();
+    if (!sm50 || !variant.vertex_shader_handle)
+      return nullptr;
     SM50CompiledBitcode *compile_result = nullptr;
     SM50Error *sm50_err = nullptr;
     if (auto ret = SM50CompileTessellationPipelineHull(
-            (SM50Shader *)variant.vertex_shader_handle, shader->handle(),
+            (SM50Shader *)variant.vertex_shader_handle, sm50,
             nullptr, func_name, &compile_result, &sm50_err)) {
       if (ret == 42) {
         ERR("Failed to compile shader due to failed assertion");
@@ -259,6 +317,9 @@ std::unique_ptr<CompiledShader>
 CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
                     ShaderVariantTessellationDomain variant) {
   auto proc = [=](const char *func_name) -> SM50CompiledBitcode * {
+    auto sm50 = shader->handle();
+    if (!sm50 || !variant.hull_shader_handle)
+      return nullptr;
     SM50_SHADER_GS_PASS_THROUGH_DATA gs_passthrough;
     gs_passthrough.DataEncoded = variant.gs_passthrough;
     gs_passthrough.RasterizationDisabled = variant.rasterization_disabled;
@@ -267,7 +328,7 @@ CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
     SM50CompiledBitcode *compile_result = nullptr;
     SM50Error *sm50_err = nullptr;
     if (auto ret = SM50CompileTessellationPipelineDomain(
-            (SM50Shader *)variant.hull_shader_handle, shader->handle(),
+            (SM50Shader *)variant.hull_shader_handle, sm50,
             (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&gs_passthrough, func_name,
             &compile_result, &sm50_err)) {
       if (ret == 42) {
@@ -290,6 +351,9 @@ CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
                     ShaderVariantVertexStreamOutput variant) {
 
   auto proc = [=](const char *func_name) -> SM50CompiledBitcode * {
+    auto sm50 = shader->handle();
+    if (!sm50)
+      return nullptr;
     SM50_SHADER_EMULATE_VERTEX_STREAM_OUTPUT_DATA data_so;
     SM50_SHADER_IA_INPUT_LAYOUT_DATA data_vertex_pulling;
     data_so.type = SM50_SHADER_EMULATE_VERTEX_STREAM_OUTPUT;
@@ -316,7 +380,7 @@ CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
     SM50CompiledBitcode *compile_result = nullptr;
     SM50Error *sm50_err = nullptr;
     if (auto ret = SM50Compile(
-            shader->handle(), (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&data_so,
+            sm50, (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&data_so,
             func_name, &compile_result, &sm50_err)) {
       if (ret == 42) {
         ERR("Failed to compile shader due to failed assertion");
@@ -6,7 +6,7 @@
 #include "d3d11_device_child.hpp"
 #include "d3d11_input_layout.hpp"
 #include "objc-wrapper/dispatch.h"
-#include "sha1/sha1_util.hpp"
+#include "util_hash.hpp"
 #include "log/log.hpp"
 
 struct MTL_COMPILED_SHADER {
@@ -14,7 +14,6 @@ struct MTL_COMPILED_SHADER {
   NOTE: it's not retained by design
   */
   MTL::Function *Function;
-  dxmt::Sha1Hash *MetallibHash;
 };
 
 namespace dxmt {
@@ -83,6 +82,13 @@ struct ShaderVariantVertex {
            gs_passthrough == rhs.gs_passthrough &&
            rasterization_disabled == rhs.rasterization_disabled;
   }
+  size_t hash() const {
+    HashState state;
+    state.add(input_layout_handle);
+    state.add(gs_passthrough);
+    state.add(rasterization_disabled);
+    return state;
+  }
 };
 
 struct ShaderVariantPixel {
@@ -95,6 +101,13 @@ struct ShaderVariantPixel {
            dual_source_blending == rhs.dual_source_blending &&
            disable_depth_output == rhs.disable_depth_output;
   }
+  size_t hash() const {
+    HashState state;
+    state.add(sample_mask);
+    state.add(dual_source_blending);
+    state.add(disable_depth_output);
+    return state;
+  }
 };
 
 struct ShaderVariantTessellationVertex {
@@ -107,6 +120,13 @@ struct ShaderVariantTessellationVertex {
            hull_shader_handle == rhs.hull_shader_handle &&
            index_buffer_format == rhs.index_buffer_format;
   }
+  size_t hash() const {
+    HashState state;
+    state.add(input_layout_handle);
+    state.add(hull_shader_handle);
+    state.add(index_buffer_format);
+    return state;
+  }
 };
 
 struct ShaderVariantTessellationHull {
@@ -115,6 +135,7 @@ struct ShaderVariantTessellationHull {
   bool operator==(const this_type &rhs) const {
     return vertex_shader_handle == rhs.vertex_shader_handle;
   }
+  size_t hash() const { return vertex_shader_handle; }
 };
 
 struct ShaderVariantTessellationDomain {
@@ -127,11 +148,19 @@ struct ShaderVariantTessellationDomain {
            gs_passthrough == rhs.gs_passthrough &&
            rasterization_disabled == rhs.rasterization_disabled;
   }
+  size_t hash() const {
+    HashState state;
+    state.add(hull_shader_handle);
+    state.add(gs_passthrough);
+    state.add(rasterization_disabled);
+    return state;
+  }
 };
 
 struct ShaderVariantDefault {
   using this_type = ShaderVariantDefault;
   bool operator==(const this_type &rhs) const { return true; }
+  size_t hash() const { return 0; }
 };
 
 struct ShaderVariantVertexStreamOutput {
@@ -142,6 +171,12 @@ struct ShaderVariantVertexStreamOutput {
     return input_layout_handle == rhs.input_layout_handle &&
            stream_output_layout_handle == rhs.stream_output_layout_handle;
   }
+  size_t hash() const {
+    HashState state;
+    state.add(input_layout_handle);
+    state.add(stream_output_layout_handle);
+    return state;
+  }
 };
 
 using ShaderVariant =
@@ -183,12 +218,23 @@ template <typename Variant>
 std::unique_ptr<CompiledShader>
 CreateVariantShader(MTLD3D11Device *, ManagedShader, Variant);
 
+/**
+Load a precompiled variant from a shader pack. The metallib must outlive the
+returned object.
+ */
+std::unique_ptr<CompiledShader>
+CreatePackedVariantShader(MTLD3D11Device *, const void *pMetallib,
+                          size_t MetallibSize);
+
 } // namespace dxmt
 
 namespace std {
 template <> struct hash<dxmt::ShaderVariant> {
   size_t operator()(const dxmt::ShaderVariant &v) const noexcept {
-    return v.index(); // FIXME:
+    dxmt::HashState state;
+    state.add(v.index());
+    state.add(std::visit([](auto &var) { return var.hash(); }, v));
+    return state;
   };
 };
 } // namespace std
@@ -0,0 +1,271 @@
+#include "d3d11_shader_pack.hpp"
+#include "d3d11_input_layout.hpp"
+#include "log/log.hpp"
+#include "util_env.hpp"
+#include "util_string.hpp"
+#include <algorithm>
+#include <cstring>
+#include <version.h>
+
+static_assert(sizeof(MTL_SHADER_INPUT_LAYOUT_ELEMENT_DESC) ==
+              sizeof(SM50_IA_INPUT_ELEMENT));
+
+namespace dxmt {
+
+const ShaderPack *ShaderPack::instance() {
+  static const ShaderPack *pack = []() -> const ShaderPack * {
+    std::string path = env::getEnvVar("DXMT_SHADER_PACK");
+    if (path.empty())
+      return nullptr;
+    auto pack = new ShaderPack();
+    if (!pack->Open(path)) {
+      delete pack;
+      return nullptr;
+    }
+    Logger::info(str::format("Loaded shader pack: ", path, " (",
+                             pack->header_->NumShaders, " shaders, ",
+                             pack->header_->NumVariants, " variants)"));
+    return pack;
+  }();
+  return pack;
+}
+
+bool ShaderPack::Open(const std::string &path) {
+  HANDLE file = CreateFileW(str::tows(path.c_str()).c_str(), GENERIC_READ,
+                            FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    ERR("ShaderPack: failed to open ", path);
+    return false;
+  }
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file, &file_size) ||
+      (size_t)file_size.QuadPart < sizeof(DXMT_SHADER_PACK_HEADER)) {
+    ERR("ShaderPack: invalid pack ", path);
+    CloseHandle(file);
+    return false;
+  }
+  HANDLE mapping =
+      CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (!mapping) {
+    ERR("ShaderPack: failed to map ", path);
+    return false;
+  }
+  // the view keeps the mapping alive
+  base_ = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (!base_) {
+    ERR("ShaderPack: failed to map ", path);
+    return false;
+  }
+  size_ = file_size.QuadPart;
+
+  header_ = (const DXMT_SHADER_PACK_HEADER *)base_;
+  if (header_->Magic != DXMT_SHADER_PACK_MAGIC ||
+      header_->Version != DXMT_SHADER_PACK_VERSION) {
+    ERR("ShaderPack: incompatible pack ", path);
+    Close();
+    return false;
+  }
+  if (strncmp(header_->ConverterVersion, DXMT_VERSION,
+              sizeof(header_->ConverterVersion)) ||
+      header_->MetallibVersionMajor != AIRCONV_METALLIB_VERSION_MAJOR ||
+      header_->MetallibVersionMinor != AIRCONV_METALLIB_VERSION_MINOR ||
+      header_->MetallibOSVersionMajor != AIRCONV_METALLIB_OS_VERSION_MAJOR ||
+      header_->MetallibOSVersionMinor != AIRCONV_METALLIB_OS_VERSION_MINOR) {
+    ERR("ShaderPack: stale pack ", path, " built by ",
+        std::string(header_->ConverterVersion,
+                    strnlen(header_->ConverterVersion,
+                            sizeof(header_->ConverterVersion))),
+        ", expected ", DXMT_VERSION);
+    Close();
+    return false;
+  }
+  if (!InBounds(header_->ShaderTableOffset,
+                (uint64_t)header_->NumShaders *
+                    sizeof(DXMT_SHADER_PACK_SHADER)) ||
+      !InBounds(header_->VariantTableOffset,
+                (uint64_t)header_->NumVariants *
+                    sizeof(DXMT_SHADER_PACK_VARIANT))) {
+    ERR("ShaderPack: corrupted pack ", path);
+    Close();
+    return false;
+  }
+  shaders_ = (const DXMT_SHADER_PACK_SHADER *)(base_ +
+                                               header_->ShaderTableOffset);
+  variants_ = (const DXMT_SHADER_PACK_VARIANT *)(base_ +
+                                                 header_->VariantTableOffset);
+  // validate every entry once, so lookups can trust the tables
+  for (uint32_t i = 0; i < header_->NumShaders; i++) {
+    if (!ValidateShader(shaders_[i])) {
+      ERR("ShaderPack: corrupted pack ", path);
+      Close();
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < header_->NumVariants; i++) {
+    if (!InBounds(variants_[i].MetallibOffset, variants_[i].MetallibSize)) {
+      ERR("ShaderPack: corrupted pack ", path);
+      Close();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ShaderPack::InBounds(uint64_t offset, uint64_t size) const {
+  return offset <= size_ && size <= size_ - offset;
+}
+
+bool ShaderPack::ValidateShader(const DXMT_SHADER_PACK_SHADER &shader) const {
+  if ((uint64_t)shader.FirstVariant + shader.NumVariants >
+      header_->NumVariants)
+    return false;
+  if (!InBounds(shader.ReflectionOffset, sizeof(MTL_SHADER_REFLECTION)))
+    return false;
+  auto reflection =
+      (const MTL_SHADER_REFLECTION *)(base_ + shader.ReflectionOffset);
+  return InBounds(shader.ReflectionOffset + sizeof(MTL_SHADER_REFLECTION),
+                  ((uint64_t)reflection->NumConstantBuffers +
+                   reflection->NumArguments) *
+                      sizeof(MTL_SM50_SHADER_ARGUMENT));
+}
+
+void ShaderPack::Close() {
+  UnmapViewOfFile(base_);
+  base_ = nullptr;
+  header_ = nullptr;
+  shaders_ = nullptr;
+  variants_ = nullptr;
+}
+
+const DXMT_SHADER_PACK_SHADER *
+ShaderPack::FindShader(const Xxh3Hash &hash) const {
+  auto end = shaders_ + header_->NumShaders;
+  auto it = std::lower_bound(
+      shaders_, end, hash,
+      [](const DXMT_SHADER_PACK_SHADER &entry, const Xxh3Hash &value) {
+        return entry.HashHi != value.high64() ? entry.HashHi < value.high64()
+                                              : entry.HashLo < value.low64();
+      });
+  if (it == end || it->HashHi != hash.high64() || it->HashLo != hash.low64())
+    return nullptr;
+  return it;
+}
+
+const DXMT_SHADER_PACK_VARIANT *
+ShaderPack::FindVariant(const DXMT_SHADER_PACK_SHADER *shader,
+                        const Xxh3Hash &key) const {
+  auto begin = variants_ + shader->FirstVariant;
+  auto end = begin + shader->NumVariants;
+  auto it = std::lower_bound(
+      begin, end, key,
+      [](const DXMT_SHADER_PACK_VARIANT &entry, const Xxh3Hash &value) {
+        return entry.KeyHi != value.high64() ? entry.KeyHi < value.high64()
+                                             : entry.KeyLo < value.low64();
+      });
+  if (it == end || it->KeyHi != key.high64() || it->KeyLo != key.low64())
+    return nullptr;
+  return it;
+}
+
+void ShaderPack::GetReflection(const DXMT_SHADER_PACK_SHADER *shader,
+                               MTL_SHADER_REFLECTION *pReflection) const {
+  auto serialized =
+      (const MTL_SHADER_REFLECTION *)(base_ + shader->ReflectionOffset);
+  *pReflection = *serialized;
+  auto args = (MTL_SM50_SHADER_ARGUMENT *)(serialized + 1);
+  pReflection->ConstantBuffers = args;
+  pReflection->Arguments = args + serialized->NumConstantBuffers;
+}
+
+bool GetShaderPackVariantDesc(const ShaderVariant &variant,
+                              std::vector<char> &desc) {
+  DXMT_SHADER_PACK_VARIANT_DESC data = {};
+  MTL_SHADER_INPUT_LAYOUT_ELEMENT_DESC *elements = nullptr;
+
+  if (std::holds_alternative<ShaderVariantDefault>(variant)) {
+    data.Type = DXMT_SHADER_PACK_VARIANT_DEFAULT;
+  } else if (auto pixel = std::get_if<ShaderVariantPixel>(&variant)) {
+    data.Type = DXMT_SHADER_PACK_VARIANT_PIXEL;
+    data.SampleMask = pixel->sample_mask;
+    data.DualSourceBlending = pixel->dual_source_blending;
+    data.DisableDepthOutput = pixel->disable_depth_output;
+  } else if (auto vertex = std::get_if<ShaderVariantVertex>(&variant)) {
+    data.Type = DXMT_SHADER_PACK_VARIANT_VERTEX;
+    data.GSPassthrough = vertex->gs_passthrough;
+    data.RasterizationDisabled = vertex->rasterization_disabled;
+    if (vertex->input_layout_handle) {
+      auto input_layout = (ManagedInputLayout)vertex->input_layout_handle;
+      data.HasInputLayout = true;
+      data.InputSlotMask = input_layout->input_slot_mask();
+      data.NumInputElements = input_layout->input_layout_element(&elements);
+    }
+  } else {
+    return false;
+  }
+
+  size_t elements_size = data.NumInputElements * sizeof(SM50_IA_INPUT_ELEMENT);
+  desc.resize(sizeof(data) + elements_size);
+  memcpy(desc.data(), &data, sizeof(data));
+  if (elements_size)
+    memcpy(desc.data() + sizeof(data), elements, elements_size);
+  return true;
+}
+
+ShaderPackRecorder *ShaderPackRecorder::instance() {
+  static ShaderPackRecorder *recorder = []() -> ShaderPackRecorder * {
+    std::string directory = env::getEnvVar("DXMT_SHADER_PACK_RECORD");
+    if (directory.empty())
+      return nullptr;
+    auto recorder = new ShaderPackRecorder();
+    if (!recorder->Open(directory)) {
+      delete recorder;
+      return nullptr;
+    }
+    Logger::info(str::format("Recording shaders to ", directory));
+    return recorder;
+  }();
+  return recorder;
+}
+
+bool ShaderPackRecorder::Open(const std::string &directory) {
+  directory_ = directory;
+  if (directory_.back() != '/' && directory_.back() != '\\')
+    directory_ += '/';
+  CreateDirectoryW(str::tows(directory_.c_str()).c_str(), nullptr);
+  variants_.open(
+      str::topath((directory_ + DXMT_SHADER_PACK_VARIANT_LIST).c_str()),
+      std::ios::out | std::ios::binary | std::ios::app);
+  if (!variants_) {
+    ERR("ShaderPackRecorder: failed to open ", directory_,
+        DXMT_SHADER_PACK_VARIANT_LIST);
+    return false;
+  }
+  return true;
+}
+
+void ShaderPackRecorder::RecordShader(const Xxh3Hash &hash,
+                                      const void *pBytecode,
+                                      size_t BytecodeLength) {
+  std::string path = directory_ + hash.toString() + ".dxbc";
+  std::ofstream out(str::topath(path.c_str()),
+                    std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out) {
+    ERR("ShaderPackRecorder: failed to write ", path);
+    return;
+  }
+  out.write((const char *)pBytecode, BytecodeLength);
+}
+
+void ShaderPackRecorder::RecordVariant(const Xxh3Hash &hash,
+                                       const std::vector<char> &desc) {
+  uint64_t shader_hash[2] = {hash.low64(), hash.high64()};
+  std::lock_guard<dxmt::mutex> lock(mutex_);
+  variants_.write((const char *)shader_hash, sizeof(shader_hash));
+  variants_.write(desc.data(), desc.size());
+  variants_.flush();
+}
+
+} // namespace dxmt
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "airconv_public.h"
+#include "airconv_shader_pack.h"
+#include "d3d11_shader.hpp"
+#include "thread.hpp"
+#include "xxhash/xxhash_util.hpp"
+#include <fstream>
+#include <vector>
+
+namespace dxmt {
+
+/**
+Read-only view of a shader pack produced by `airconv --pack`, mapped for the
+lifetime of the process. Every offset is validated against the mapping when
+the pack is opened, then lookups are binary searches over the mapped tables,
+nothing is parsed or copied.
+ */
+class ShaderPack {
+public:
+  /**
+  The pack specified by DXMT_SHADER_PACK, or nullptr
+   */
+  static const ShaderPack *instance();
+
+  const DXMT_SHADER_PACK_SHADER *FindShader(const Xxh3Hash &hash) const;
+
+  const DXMT_SHADER_PACK_VARIANT *
+  FindVariant(const DXMT_SHADER_PACK_SHADER *shader, const Xxh3Hash &key) const;
+
+  /**
+  The argument arrays of the returned reflection point into the mapping
+   */
+  void GetReflection(const DXMT_SHADER_PACK_SHADER *shader,
+                     MTL_SHADER_REFLECTION *pReflection) const;
+
+  const void *GetMetallib(const DXMT_SHADER_PACK_VARIANT *variant) const {
+    return base_ + variant->MetallibOffset;
+  }
+
+private:
+  bool Open(const std::string &path);
+  void Close();
+  bool InBounds(uint64_t offset, uint64_t size) const;
+  bool ValidateShader(const DXMT_SHADER_PACK_SHADER &shader) const;
+
+  const char *base_ = nullptr;
+  size_t size_ = 0;
+  const DXMT_SHADER_PACK_HEADER *header_ = nullptr;
+  const DXMT_SHADER_PACK_SHADER *shaders_ = nullptr;
+  const DXMT_SHADER_PACK_VARIANT *variants_ = nullptr;
+};
+
+/**
+Fill the canonical description of a variant (see airconv_shader_pack.h).
+Return false if the variant can't be packed.
+ */
+bool GetShaderPackVariantDesc(const ShaderVariant &variant,
+                              std::vector<char> &desc);
+
+/**
+Writes the shader dump consumed by `airconv --pack` into the directory
+specified by DXMT_SHADER_PACK_RECORD.
+ */
+class ShaderPackRecorder {
+public:
+  /**
+  nullptr if recording is not enabled
+   */
+  static ShaderPackRecorder *instance();
+
+  void RecordShader(const Xxh3Hash &hash, const void *pBytecode,
+                    size_t BytecodeLength);
+
+  void RecordVariant(const Xxh3Hash &hash, const std::vector<char> &desc);
+
+private:
+  bool Open(const std::string &directory);
+
+  std::string directory_;
+  std::ofstream variants_;
+  dxmt::mutex mutex_;
+};
+
+} // namespace dxmt
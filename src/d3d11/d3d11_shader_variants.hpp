@@ -0,0 +1,42 @@
+#pragma once
+
+#include "util_concurrent_map.hpp"
+#include <memory>
+#include <utility>
+
+namespace dxmt {
+
+/**
+Most shaders have one or two variants
+ */
+constexpr size_t kShaderVariantTableInitialSize = 4;
+
+/**
+Compiled variants of a shader, independent of the device.
+ */
+template <typename Variant, typename Compiled> class ShaderVariantTable {
+public:
+  /**
+  Returns the compiled variant. If absent, `create()` and then `submit()` are
+  invoked exactly once, by the thread that inserted it; the other threads get
+  the same object and wait for its compilation like any other.
+   */
+  template <typename CreateFn, typename SubmitFn>
+  Compiled *
+  get(const Variant &variant, CreateFn &&create, SubmitFn &&submit) {
+    auto c = variants_.get_or_insert(variant, std::forward<CreateFn>(create));
+    if (c.second)
+      submit(c.first.get());
+    return c.first.get();
+  }
+
+  size_t
+  size() const {
+    return variants_.size();
+  }
+
+private:
+  ConcurrentHashMap<Variant, std::unique_ptr<Compiled>> variants_{kShaderVariantTableInitialSize};
+};
+
+} // namespace dxmt
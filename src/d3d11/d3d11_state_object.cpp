@@ -247,6 +247,7 @@ public:
          desc_.RenderTarget[0].SrcBlendAlpha >= D3D11_BLEND_SRC1_COLOR ||
          desc_.RenderTarget[0].DestBlendAlpha >= D3D11_BLEND_SRC1_COLOR ||
          desc_.RenderTarget[0].DestBlend >= D3D11_BLEND_SRC1_COLOR);
+    content_hash_ = std::hash<D3D11_BLEND_DESC1>{}(desc_);
   }
   ~MTLD3D11BlendState() {}
 
@@ -295,6 +296,8 @@ public:
 
   bool IsDualSourceBlending() { return dual_source_blending_; }
 
+  uint64_t GetContentHash() { return content_hash_; }
+
   void SetupMetalPipelineDescriptor(
       MTL::RenderPipelineDescriptor *render_pipeline_descriptor, uint32_t num_rt) {
     for (unsigned rt = 0; rt < num_rt; rt++) {
@@ -332,6 +335,7 @@ public:
 private:
   const D3D11_BLEND_DESC1 desc_;
   bool dual_source_blending_;
+  uint64_t content_hash_;
 };
 
 // RasterizerState
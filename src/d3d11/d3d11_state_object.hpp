@@ -36,6 +36,10 @@ DEFINE_COM_INTERFACE("279a1d66-2fc1-460c-a0a7-a7a5f2b7a48f",
                      IMTLD3D11BlendState)
     : public ID3D11BlendState1 {
   virtual bool IsDualSourceBlending() = 0;
+  /**
+  hash of the normalized blend description, computed at creation
+   */
+  virtual uint64_t GetContentHash() = 0;
   virtual void SetupMetalPipelineDescriptor(MTL::RenderPipelineDescriptor *
                                             render_pipeline_descriptor, uint32_t num_rt) = 0;
 };
@@ -61,6 +61,8 @@ enum MTL_BINDABLE_RESIDENCY_MASK : uint32_t {
 struct SIMPLE_RESIDENCY_TRACKER {
   uint64_t last_encoder_id = 0;
   MTL_BINDABLE_RESIDENCY_MASK last_residency_mask = MTL_RESIDENCY_NULL;
+  // placed in a heap that is made resident as a whole, see CheckBindingResidency() of context
+  bool heap_resident = false;
   void CheckResidency(uint64_t encoderId,
                       MTL_BINDABLE_RESIDENCY_MASK residencyMask,
                       MTL_BINDABLE_RESIDENCY_MASK *newResidencyMask) {
@@ -142,6 +144,21 @@ DEFINE_COM_INTERFACE("daf21510-d136-44dd-bb16-068a94690775",
   virtual void Destroy() = 0;
 };
 
+constexpr size_t kInlineConstantBufferMaxSize = 0x1000; // 4KB
+
+/**
+Whether a buffer is allocated in private storage, so that it's only written by
+blit commands. Constant buffers of default usage are meant to be updated by
+UpdateSubresource, and are kept CPU-visible so that it can write them directly
+when they are not in use by GPU.
+ */
+inline bool
+IsPrivateBuffer(const D3D11_BUFFER_DESC &desc) {
+  if (desc.Usage == D3D11_USAGE_IMMUTABLE)
+    return true;
+  return desc.Usage == D3D11_USAGE_DEFAULT && !(desc.BindFlags & D3D11_BIND_CONSTANT_BUFFER);
+}
+
 DEFINE_COM_INTERFACE("65feb8c5-01de-49df-bf58-d115007a117d", IMTLDynamicBuffer)
     : public IUnknown {
   virtual void *GetMappedMemory(UINT * pBytesPerRow, UINT * pBytesPerImage) = 0;
@@ -149,6 +166,12 @@ DEFINE_COM_INTERFACE("65feb8c5-01de-49df-bf58-d115007a117d", IMTLDynamicBuffer)
   virtual void RotateBuffer(dxmt::MTLD3D11Device * pool) = 0;
   virtual dxmt::BindingRef GetCurrentBufferBinding() = 0;
   virtual D3D11_BIND_FLAG GetBindFlag() = 0;
+  /**
+  Return the contents of a small constant buffer, which can be copied when it's
+  bound to a shader stage instead of being bound by address, or nullptr.
+  As long as the buffer is only bound that way, a discard doesn't rename it.
+   */
+  virtual const void *GetInlineContents(UINT * pByteWidth) = 0;
 };
 
 DEFINE_COM_INTERFACE("252c1a0e-1c61-42e7-9b57-23dfe3d73d49", IMTLD3D11Staging)
@@ -20,30 +20,51 @@ private:
   bool allow_raw_view;
   SIMPLE_RESIDENCY_TRACKER residency{};
   SIMPLE_OCCUPANCY_TRACKER occupancy{};
+  PlacementHeapPool &placement_heaps;
+  PlacementHeapAllocation placement{};
+  uint64_t initial_upload_seq = 0;
 
 public:
   DeviceBuffer(const tag_buffer::DESC1 *pDesc,
                const D3D11_SUBRESOURCE_DATA *pInitialData,
                MTLD3D11Device *device)
-      : TResourceBase<tag_buffer, IMTLBindable>(*pDesc, device) {
+      : TResourceBase<tag_buffer, IMTLBindable>(*pDesc, device),
+        placement_heaps(device->GetDXMTDevice().queue().placement_heaps) {
     auto metal = device->GetMTLDevice();
-    MTL::ResourceOptions options = MTL::ResourceStorageModeManaged;
-    if(pDesc->Usage == D3D11_USAGE_IMMUTABLE) {
-      options |= MTL::ResourceHazardTrackingModeUntracked;
-    }
-    buffer = transfer(metal->newBuffer(
-        (pDesc->BindFlags & D3D11_BIND_UNORDERED_ACCESS) ? (pDesc->ByteWidth + 16) : pDesc->ByteWidth, options
-    ));
+    // private buffers stay tracked: the initial upload is in another encoder
+    MTL::ResourceOptions options = IsPrivateBuffer(*pDesc) ? MTL::ResourceStorageModePrivate
+                                                           : MTL::ResourceStorageModeManaged;
+    auto length = (pDesc->BindFlags & D3D11_BIND_UNORDERED_ACCESS) ? (pDesc->ByteWidth + 16) : pDesc->ByteWidth;
+    buffer = transfer(placement_heaps.newBuffer(length, options, &placement));
+    if (!buffer)
+      buffer = transfer(metal->newBuffer(length, options));
     if (pInitialData) {
-      memcpy(buffer->contents(), pInitialData->pSysMem, pDesc->ByteWidth);
-      buffer->didModifyRange({0, pDesc->ByteWidth});
+      if (IsPrivateBuffer(*pDesc)) {
+        initial_upload_seq = device->GetDXMTDevice().queue().UploadInitialData(
+            buffer.ptr(), pInitialData->pSysMem, pDesc->ByteWidth
+        );
+      } else {
+        memcpy(buffer->contents(), pInitialData->pSysMem, pDesc->ByteWidth);
+        buffer->didModifyRange({0, pDesc->ByteWidth});
+      }
     }
     buffer_handle = buffer->gpuAddress();
+    residency.heap_resident = placement_heaps.isHeapResident(placement);
     structured = pDesc->MiscFlags & D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
     allow_raw_view =
         pDesc->MiscFlags & D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
   }
 
+  ~DeviceBuffer() {
+    // it's not used by GPU anymore: every command using it holds a reference,
+    // except the initial upload
+    buffer = nullptr;
+    if (initial_upload_seq > m_parent->GetDXMTDevice().queue().CoherentSeqId())
+      placement_heaps.releaseAfter(&placement, initial_upload_seq);
+    else
+      placement_heaps.release(&placement);
+  }
+
   BindingRef UseBindable(uint64_t seq_id) override {
     occupancy.MarkAsOccupied(seq_id);
     return BindingRef(static_cast<ID3D11DeviceChild *>(this), buffer.ptr(),
@@ -76,7 +97,10 @@ public:
     SRV(const tag_shader_resource_view<>::DESC1 *pDesc, DeviceBuffer *pResource,
         MTLD3D11Device *pDevice, ArgumentData argument_data, F &&fn)
         : SRVBase(pDesc, pResource, pDevice), argument_data(argument_data),
-          f(std::forward<F>(fn)) {}
+          f(std::forward<F>(fn)) {
+      // a texture view isn't allocated from the heap of its buffer
+      tracker.heap_resident = pResource->residency.heap_resident && !argument_data.texture();
+    }
 
     BindingRef UseBindable(uint64_t seq_id) override {
       this->resource->occupancy.MarkAsOccupied(seq_id);
@@ -188,7 +212,9 @@ public:
         DeviceBuffer *pResource, MTLD3D11Device *pDevice,
         ArgumentData argument_data, F &&fn)
         : UAVBase(pDesc, pResource, pDevice), argument_data(argument_data),
-          f(std::forward<F>(fn)) {}
+          f(std::forward<F>(fn)) {
+      tracker.heap_resident = pResource->residency.heap_resident && !argument_data.texture();
+    }
 
     BindingRef UseBindable(uint64_t seq_id) override {
       this->resource->occupancy.MarkAsOccupied(seq_id);
@@ -383,6 +409,7 @@ private:
   SIMPLE_RESIDENCY_TRACKER residency{};
   SIMPLE_OCCUPANCY_TRACKER occupancy{};
   float min_lod = 0.0;
+  PlacementHeapAllocation placement;
 
   using SRVBase =
       TResourceViewBase<tag_shader_resource_view<DeviceTexture<tag_texture>>,
@@ -398,7 +425,9 @@ private:
                const tag_shader_resource_view<>::DESC1 *pDesc,
                DeviceTexture *pResource, MTLD3D11Device *pDevice)
         : SRVBase(pDesc, pResource, pDevice), view(view),
-          view_handle(view->gpuResourceID()) {}
+          view_handle(view->gpuResourceID()) {
+      tracker.heap_resident = pResource->residency.heap_resident;
+    }
 
     BindingRef UseBindable(uint64_t seq_id) override {
       this->resource->occupancy.MarkAsOccupied(seq_id);
@@ -438,7 +467,9 @@ private:
                const tag_unordered_access_view<>::DESC1 *pDesc,
                DeviceTexture *pResource, MTLD3D11Device *pDevice)
         : UAVBase(pDesc, pResource, pDevice), view(view),
-          view_handle(view->gpuResourceID()) {}
+          view_handle(view->gpuResourceID()) {
+      tracker.heap_resident = pResource->residency.heap_resident;
+    }
 
     BindingRef UseBindable(uint64_t seq_id) override {
       this->resource->occupancy.MarkAsOccupied(seq_id);
@@ -537,10 +568,21 @@ private:
 
 public:
   DeviceTexture(const tag_texture::DESC1 *pDesc, MTL::Texture *texture,
-                MTLD3D11Device *pDevice)
+                MTLD3D11Device *pDevice,
+                const PlacementHeapAllocation &placement = {})
       : TResourceBase<tag_texture, IMTLBindable, IMTLMinLODClampable>(*pDesc,
                                                                       pDevice),
-        texture(texture), texture_handle(texture->gpuResourceID()) {}
+        texture(texture), texture_handle(texture->gpuResourceID()),
+        placement(placement) {
+    residency.heap_resident =
+        pDevice->GetDXMTDevice().queue().placement_heaps.isHeapResident(placement);
+  }
+
+  ~DeviceTexture() {
+    // it's not used by GPU anymore: every command using it holds a reference
+    texture = nullptr;
+    this->m_parent->GetDXMTDevice().queue().placement_heaps.release(&placement);
+  }
 
   BindingRef UseBindable(uint64_t seq_id) override {
     occupancy.MarkAsOccupied(seq_id);
@@ -674,11 +716,27 @@ HRESULT CreateDeviceTextureInternal(MTLD3D11Device *pDevice,
                                         &textureDescriptor))) {
     return E_INVALIDARG;
   }
-  auto texture = transfer(metal->newTexture(textureDescriptor));
+  Obj<MTL::Texture> texture;
+  PlacementHeapAllocation placement{};
+  if (!pInitialData && finalDesc.Usage == D3D11_USAGE_DEFAULT &&
+      (finalDesc.BindFlags &
+       (D3D11_BIND_RENDER_TARGET | D3D11_BIND_DEPTH_STENCIL))) {
+    // GPU-only once placed: UpdateSubresource goes through staging memory
+    auto options = textureDescriptor->resourceOptions();
+    textureDescriptor->setStorageMode(MTL::StorageModePrivate);
+    texture = transfer(pDevice->GetDXMTDevice().queue().placement_heaps.newTexture(
+        textureDescriptor, &placement));
+    // otherwise keep the default storage, which can be replaced directly
+    if (!texture)
+      textureDescriptor->setResourceOptions(options);
+  }
+  if (!texture)
+    texture = transfer(metal->newTexture(textureDescriptor));
   if (pInitialData) {
     initWithSubresourceData(texture, &finalDesc, pInitialData);
   }
-  *ppTexture = ref(new DeviceTexture<tag>(&finalDesc, texture, pDevice));
+  *ppTexture = ref(
+      new DeviceTexture<tag>(&finalDesc, texture, pDevice, placement));
   return S_OK;
 }
 
@@ -8,6 +8,7 @@
 #include "dxmt_format.hpp"
 #include "mtld11_resource.hpp"
 #include "objc_pointer.hpp"
+#include "util_memcpy.hpp"
 #include <vector>
 
 namespace dxmt {
@@ -21,6 +22,15 @@ private:
   uint64_t buffer_handle;
   uint64_t buffer_len;
   void *buffer_mapped;
+  // non-zero only if suballocated
+  uint64_t buffer_offset = 0;
+  // renamed within the device-wide ring instead of the pool
+  bool suballocated;
+  BufferRingAllocation ring_allocation;
+  // only ever bound as a constant buffer, and small enough to be inlined
+  bool inline_contents;
+  // the storage has been used by GPU since the last rename
+  bool referenced = false;
 #ifdef DXMT_DEBUG
   std::string debug_name;
 #endif
@@ -52,7 +62,8 @@ private:
       if (!seq_id)
         return BindingRef();
       return BindingRef(static_cast<ID3D11View *>(this),
-                        resource->buffer_dynamic, width, offset);
+                        resource->buffer_dynamic, width,
+                        resource->buffer_offset + offset);
     };
 
     ArgumentData
@@ -151,29 +162,58 @@ private:
 
   SIMPLE_RESIDENCY_TRACKER tracker{};
 
-public:
-  DynamicBuffer(const tag_buffer::DESC1 *pDesc,
-                const D3D11_SUBRESOURCE_DATA *pInitialData,
-                MTLD3D11Device *device)
-      : TResourceBase<tag_buffer, IMTLDynamicBuffer, IMTLBindable>(
-            *pDesc, device) {
-    auto metal = device->GetMTLDevice();
+  void AllocateDedicated() {
+    auto metal = m_parent->GetMTLDevice();
     // sadly it needs to be tracked since it's a legal blit dst
     auto options = m_parent->IsTraced()
                        ? MTL::ResourceCPUCacheModeDefaultCache
                        : MTL::ResourceOptionCPUCacheModeWriteCombined;
-    buffer_dynamic = transfer(metal->newBuffer(pDesc->ByteWidth, options));
-    if (pInitialData) {
-      memcpy(buffer_dynamic->contents(), pInitialData->pSysMem,
-             pDesc->ByteWidth);
-    }
+    buffer_dynamic = transfer(metal->newBuffer(desc.ByteWidth, options));
     buffer_handle = buffer_dynamic->gpuAddress();
     buffer_len = buffer_dynamic->length();
     buffer_mapped = buffer_dynamic->contents();
-    pool = std::make_unique<BufferPool>(metal, pDesc->ByteWidth, options);
+    buffer_offset = 0;
+    pool = std::make_unique<BufferPool>(metal, desc.ByteWidth, options);
+  }
+
+public:
+  DynamicBuffer(const tag_buffer::DESC1 *pDesc,
+                const D3D11_SUBRESOURCE_DATA *pInitialData,
+                MTLD3D11Device *device)
+      : TResourceBase<tag_buffer, IMTLDynamicBuffer, IMTLBindable>(
+            *pDesc, device) {
     structured = pDesc->MiscFlags & D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
     allow_raw_view =
         pDesc->MiscFlags & D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+    // typed views are textures created from the buffer, and index or
+    // indirect argument buffers are bound without offset
+    suballocated = pDesc->ByteWidth <= kBufferRingMaxAllocationSize &&
+                   !(pDesc->BindFlags & D3D11_BIND_INDEX_BUFFER) &&
+                   !(pDesc->MiscFlags & D3D11_RESOURCE_MISC_DRAWINDIRECT_ARGS) &&
+                   (structured || !(pDesc->BindFlags & D3D11_BIND_SHADER_RESOURCE));
+    if (suballocated) {
+      buffer_len = pDesc->ByteWidth;
+      suballocated = m_parent->ExchangeFromRing(&ring_allocation, buffer_len);
+    }
+    if (suballocated) {
+      buffer_dynamic = ring_allocation.buffer;
+      buffer_handle = ring_allocation.gpu_addr;
+      buffer_mapped = ring_allocation.cpu_addr;
+      buffer_offset = ring_allocation.offset;
+    } else {
+      AllocateDedicated();
+    }
+    if (pInitialData) {
+      memcpy(buffer_mapped, pInitialData->pSysMem, pDesc->ByteWidth);
+    }
+    inline_contents = pDesc->BindFlags == D3D11_BIND_CONSTANT_BUFFER &&
+                      pDesc->ByteWidth <= kInlineConstantBufferMaxSize;
+  }
+
+  ~DynamicBuffer() {
+    if (suballocated) {
+      m_parent->ReleaseToRing(&ring_allocation);
+    }
   }
 
   void *GetMappedMemory(UINT *pBytesPerRow, UINT *pBytesPerImage) override {
@@ -189,8 +229,9 @@ public:
   };
 
   BindingRef GetCurrentBufferBinding() override {
+    referenced = true;
     return BindingRef(static_cast<ID3D11Resource *>(this), buffer_dynamic.ptr(),
-                      buffer_len, 0);
+                      buffer_len, buffer_offset);
   };
 
   D3D11_BIND_FLAG GetBindFlag() override {
@@ -200,8 +241,9 @@ public:
   BindingRef UseBindable(uint64_t seq_id) override {
     if (!seq_id)
       return BindingRef();
+    referenced = true;
     return BindingRef(static_cast<ID3D11Resource *>(this), buffer_dynamic.ptr(),
-                      buffer_len, 0);
+                      buffer_len, buffer_offset);
   }
 
   ArgumentData GetArgumentData(SIMPLE_RESIDENCY_TRACKER **ppTracker) override {
@@ -216,12 +258,35 @@ public:
     QueryInterface(riid, ppLogicalResource);
   }
 
+  const void *GetInlineContents(UINT *pByteWidth) override {
+    if (!inline_contents)
+      return nullptr;
+    *pByteWidth = desc.ByteWidth;
+    return buffer_mapped;
+  }
+
   void RotateBuffer(MTLD3D11Device *exch) override {
+    if (inline_contents && !referenced) {
+      // contents have only been copied so far
+      return;
+    }
+    referenced = false;
     tracker = {};
-    exch->ExchangeFromPool(&buffer_dynamic, &buffer_handle, &buffer_mapped,
-                           pool.get());
+    if (suballocated && !exch->ExchangeFromRing(&ring_allocation, buffer_len)) {
+      // the ring is full, the previous allocation has been released
+      suballocated = false;
+      AllocateDedicated();
+    } else if (suballocated) {
+      buffer_dynamic = ring_allocation.buffer;
+      buffer_handle = ring_allocation.gpu_addr;
+      buffer_mapped = ring_allocation.cpu_addr;
+      buffer_offset = ring_allocation.offset;
+    } else {
+      exch->ExchangeFromPool(&buffer_dynamic, &buffer_handle, &buffer_mapped,
+                             pool.get());
+    }
 #ifdef DXMT_DEBUG
-    {
+    if (!suballocated) {
       auto pool = transfer(NS::AutoreleasePool::alloc()->init());
       buffer_dynamic->setLabel(
           NS::String::string(debug_name.c_str(), NS::ASCIIStringEncoding));
@@ -295,6 +360,7 @@ public:
       return E_FAIL;
     }
 
+    D3D11_ASSERT(!suballocated);
     Obj<MTL::TextureDescriptor> desc;
     MTL_TEXTURE_BUFFER_LAYOUT layout;
     if (FAILED(CreateMTLTextureBufferView(this->m_parent, &finalDesc, &desc,
@@ -441,6 +507,8 @@ public:
                       buffer->length(), 0);
   };
 
+  const void *GetInlineContents(UINT *pByteWidth) override { return nullptr; }
+
   void RotateBuffer(MTLD3D11Device *exch) override {
     exch->ExchangeFromPool(&buffer, &buffer_handle, &buffer_mapped,
                            pool_.get());
@@ -532,8 +600,12 @@ CreateDynamicTexture2D(MTLD3D11Device *pDevice,
                      ? MTL::ResourceCPUCacheModeDefaultCache
                      : MTL::ResourceOptionCPUCacheModeWriteCombined));
   if (pInitialData) {
-    D3D11_ASSERT(pInitialData->SysMemPitch == bytesPerRow);
-    memcpy(buffer->contents(), pInitialData->pSysMem, bufferLen);
+    // bytesPerRow is aligned for Metal, the app's rows are only as long as
+    // the texels they hold
+    copy_rows({buffer->contents(), bytesPerRow, 0},
+              {pInitialData->pSysMem, pInitialData->SysMemPitch, 0},
+              format.BytesPerTexel * finalDesc.Width, finalDesc.Height, 1,
+              !pDevice->IsTraced());
   }
   *ppTexture =
       ref(new DynamicTexture2D(pDesc, std::move(buffer), pDevice, bytesPerRow));
@@ -1,7 +1,10 @@
 #include "d3d11_private.h"
 #include "d3d11_enumerable.hpp"
+#include "dxmt_format.hpp"
 #include "mtld11_resource.hpp"
 #include "objc_pointer.hpp"
+#include "util_memcpy.hpp"
+#include <algorithm>
 
 namespace dxmt {
 
@@ -231,6 +234,10 @@ HRESULT CreateStagingTextureInternal(MTLD3D11Device *pDevice,
           CreateMTLTextureDescriptor(pDevice, pDesc, &finalDesc, &texDesc))) {
     return E_INVALIDARG;
   }
+  MTL_DXGI_FORMAT_DESC format;
+  if (FAILED(MTLQueryDXGIFormat(metal, finalDesc.Format, format))) {
+    return E_FAIL;
+  }
   std::vector<StagingBufferInternal> subresources;
   for (auto &sub : EnumerateSubresources(finalDesc)) {
     uint32_t w, h, d;
@@ -244,9 +251,18 @@ HRESULT CreateStagingTextureInternal(MTLD3D11Device *pDevice,
     auto buffer =
         transfer(metal->newBuffer(buf_len, MTL::ResourceStorageModeShared));
     if (pInitialData) {
-      // FIXME: SysMemPitch and SysMemSlicePitch should be respected!
-      memcpy(buffer->contents(), pInitialData[sub.SubresourceId].pSysMem,
-             buf_len);
+      auto &data = pInitialData[sub.SubresourceId];
+      // bpr is aligned for Metal, the app's rows are only as long as the
+      // texels (or blocks) they hold
+      uint32_t bytes_per_row = format.BytesPerTexel * w;
+      uint32_t rows = h;
+      if (format.Flag & MTL_DXGI_FORMAT_BC) {
+        bytes_per_row = format.BlockSize * ((w + 3) >> 2);
+        rows = (h + 3) >> 2;
+      }
+      copy_rows({buffer->contents(), bpr, bpi},
+                {data.pSysMem, data.SysMemPitch, data.SysMemSlicePitch},
+                bytes_per_row, rows, d, false);
     }
     subresources.push_back(StagingBufferInternal(std::move(buffer), bpr, bpi));
   }
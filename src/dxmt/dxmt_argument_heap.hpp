@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Metal/MTLBuffer.hpp"
+#include "Metal/MTLDevice.hpp"
+#include "Metal/MTLResource.hpp"
+#include "dxmt_argument_heap_blocks.hpp"
+#include "log/log.hpp"
+#include "thread.hpp"
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace dxmt {
+
+/**
+Pool of GPU-visible blocks backing the argument heap of command chunks.
+
+A block is held by a single chunk while it's recorded and encoded, then
+retired with the chunk's seq id and reused once the GPU is done with it, see
+GPUArgumentHeapBlockQueue.
+ */
+class GPUArgumentHeapAllocator {
+
+public:
+  GPUArgumentHeapAllocator(MTL::Device *device, MTL::ResourceOptions block_options) :
+      device(device),
+      block_options(block_options) {}
+
+  ~GPUArgumentHeapAllocator() {
+    queue.clear(dropped);
+    destroy_dropped_blocks();
+  }
+
+  GPUArgumentHeapBlock *
+  acquire(uint64_t coherent_id, size_t min_size, bool under_pressure) {
+    std::lock_guard<dxmt::mutex> lock(mutex);
+    auto previous_size = queue.block_size();
+    auto block = queue.pop(coherent_id, min_size, under_pressure, dropped);
+    if (queue.block_size() != previous_size)
+      TRACE("gpu argument heap: block size changes to ", queue.block_size());
+    destroy_dropped_blocks();
+    if (block)
+      return block;
+    auto size = queue.new_block_size(min_size);
+    auto buffer = device->newBuffer(size, block_options);
+    return new GPUArgumentHeapBlock{
+        .buffer = buffer,
+        .contents = (char *)buffer->contents(),
+        .size = size,
+        .last_used_seq_id = 0,
+        .next = nullptr,
+    };
+  };
+
+  /**
+  Retire a chain of blocks, which must not be accessed by CPU after `seq_id`
+   */
+  void
+  retire(GPUArgumentHeapBlock *chain, uint64_t seq_id) {
+    std::lock_guard<dxmt::mutex> lock(mutex);
+    queue.push(chain, seq_id);
+  };
+
+  void
+  free_blocks(uint64_t coherent_id) {
+    std::lock_guard<dxmt::mutex> lock(mutex);
+    queue.expire(coherent_id, dropped);
+    destroy_dropped_blocks();
+  };
+
+private:
+  void
+  destroy_dropped_blocks() {
+    for (auto block : dropped) {
+      block->buffer->release();
+      delete block;
+    }
+    dropped.clear();
+  }
+
+  GPUArgumentHeapBlockQueue queue;
+  std::vector<GPUArgumentHeapBlock *> dropped;
+  MTL::Device *device;
+  dxmt::mutex mutex;
+  MTL::ResourceOptions block_options;
+};
+
+} // namespace dxmt
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "dxmt_argument_heap_size.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <queue>
+#include <vector>
+
+namespace MTL {
+class Buffer;
+}
+
+namespace dxmt {
+
+constexpr size_t kGPUArgumentHeapBlockLifetime = 300;
+
+struct GPUArgumentHeapBlock {
+  MTL::Buffer *buffer;
+  char *contents;
+  size_t size;
+  uint64_t last_used_seq_id;
+  // blocks held by the same chunk
+  GPUArgumentHeapBlock *next;
+};
+
+/**
+Retired blocks of the argument heap, independent of the device: which one to
+reuse, and which ones to drop. Blocks are reused in FIFO order once the chunk
+that used them last is completed. Dropped blocks are handed back to the
+caller, who owns their memory.
+
+Not thread-safe.
+ */
+class GPUArgumentHeapBlockQueue {
+public:
+  /**
+  Called once for every block acquired, see GPUArgumentHeapBlockSize::update().
+  Return a retired block of at least `min_size` bytes that the GPU is done
+  with, or nullptr if a new one of `new_block_size()` bytes is needed.
+   */
+  GPUArgumentHeapBlock *
+  pop(uint64_t coherent_id, size_t min_size, bool under_pressure, std::vector<GPUArgumentHeapBlock *> &dropped) {
+    block_size_.update(under_pressure);
+    while (!fifo_.empty()) {
+      auto front = fifo_.front();
+      if (front->last_used_seq_id >= coherent_id)
+        break;
+      if (!block_size_.reusable(front->size)) {
+        dropped.push_back(front);
+        fifo_.pop();
+        continue;
+      }
+      if (front->size < min_size)
+        break;
+      fifo_.pop();
+      front->next = nullptr;
+      return front;
+    }
+    return nullptr;
+  }
+
+  size_t
+  new_block_size(size_t min_size) const {
+    auto size = std::max(min_size, block_size_.value());
+    return (size + kGPUArgumentHeapMinBlockSize - 1) & ~(kGPUArgumentHeapMinBlockSize - 1);
+  }
+
+  /**
+  Retire a chain of blocks, which must not be accessed by CPU after `seq_id`
+   */
+  void
+  push(GPUArgumentHeapBlock *chain, uint64_t seq_id) {
+    while (chain) {
+      auto next = chain->next;
+      chain->last_used_seq_id = seq_id;
+      chain->next = nullptr;
+      fifo_.push(chain);
+      chain = next;
+    }
+  }
+
+  /**
+  Drop blocks unused for kGPUArgumentHeapBlockLifetime chunks
+   */
+  void
+  expire(uint64_t coherent_id, std::vector<GPUArgumentHeapBlock *> &dropped) {
+    while (!fifo_.empty()) {
+      auto front = fifo_.front();
+      if (front->last_used_seq_id > coherent_id || coherent_id - front->last_used_seq_id <= kGPUArgumentHeapBlockLifetime)
+        break;
+      dropped.push_back(front);
+      fifo_.pop();
+    }
+  }
+
+  void
+  clear(std::vector<GPUArgumentHeapBlock *> &dropped) {
+    while (!fifo_.empty()) {
+      dropped.push_back(fifo_.front());
+      fifo_.pop();
+    }
+  }
+
+  size_t
+  block_size() const {
+    return block_size_.value();
+  }
+
+  size_t
+  size() const {
+    return fifo_.size();
+  }
+
+private:
+  std::queue<GPUArgumentHeapBlock *> fifo_;
+  GPUArgumentHeapBlockSize block_size_;
+};
+
+} // namespace dxmt
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dxmt {
+
+constexpr size_t kGPUArgumentHeapMinBlockSize = 0x40000;    // 256KB
+constexpr size_t kGPUArgumentHeapMaxBlockSize = 0x1000000;  // 16MB
+// consecutive chunks fitting in a single block before the block size halves
+constexpr uint32_t kGPUArgumentHeapShrinkInterval = 256;
+
+/**
+Preferred block size of the argument heap, independent of the device.
+
+It doubles every time a chunk runs out of its block, and halves once
+kGPUArgumentHeapShrinkInterval chunks in a row fit in a single block, so a
+burst of heavy frames doesn't keep large blocks around forever.
+ */
+class GPUArgumentHeapBlockSize {
+public:
+  size_t
+  value() const {
+    return size_;
+  }
+
+  /**
+  Called once for every block acquired. `under_pressure` is set if the chunk
+  ran out of its previous block, otherwise the block is the first of a chunk.
+   */
+  void
+  update(bool under_pressure) {
+    if (under_pressure) {
+      chunks_fit_ = 0;
+      if (size_ < kGPUArgumentHeapMaxBlockSize)
+        size_ *= 2;
+      return;
+    }
+    if (++chunks_fit_ < kGPUArgumentHeapShrinkInterval)
+      return;
+    chunks_fit_ = 0;
+    if (size_ > kGPUArgumentHeapMinBlockSize)
+      size_ /= 2;
+  }
+
+  /**
+  Whether a retired block of `block_size` bytes is kept for reuse: blocks
+  that are outgrown, or more than twice as large after shrinking, are dropped.
+   */
+  bool
+  reusable(size_t block_size) const {
+    return block_size >= size_ && block_size <= size_ * 2;
+  }
+
+private:
+  size_t size_ = kGPUArgumentHeapMinBlockSize;
+  uint32_t chunks_fit_ = 0;
+};
+
+} // namespace dxmt
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace MTL {
+class Buffer;
+}
+
+namespace dxmt {
+
+constexpr size_t kArgumentTableCacheEntries = 4;
+
+/**
+Argument tables of a shader stage recently written to the argument heap of
+the current chunk. A table is built in a scratch copy first: if it's identical
+to one that has been written before to the same heap block, that one is reused
+by offset instead. The scratch copy is kept after a successful build, so that
+the next build with the same layout in the same encoder only has to patch the
+dirty slots.
+ */
+class ArgumentTableCache {
+public:
+  /**
+  Return the scratch table to build into. `patch` is set if it still holds the
+  last successfully built table for `layout`, so that only dirty slots have to
+  be written, otherwise it's zero-filled.
+   */
+  uint64_t *
+  begin(uint64_t chunk_id, uint64_t encoder_id, const void *layout, size_t qwords, bool &patch) {
+    if (chunk_id_ != chunk_id) {
+      // heap blocks may have been recycled
+      chunk_id_ = chunk_id;
+      num_entries_ = 0;
+      bound_heap_ = nullptr;
+      patchable_ = false;
+    }
+    patch = patchable_ && encoder_id_ == encoder_id && layout_ == layout;
+    if (!patch) {
+      scratch_.assign(qwords, 0);
+      encoder_id_ = encoder_id;
+      layout_ = layout;
+    }
+    // until `end()`: a failed build leaves the scratch table incomplete
+    patchable_ = false;
+    return scratch_.data();
+  }
+
+  /**
+  Finish a build. Pass `reusable = false` if some entries of the table are
+  written to the heap later, in which case it's neither looked up nor patched.
+  Return true and set `offset` if an identical table exists in `heap`.
+   */
+  bool
+  end(MTL::Buffer *heap, bool reusable, uint64_t &offset) {
+    patchable_ = reusable;
+    if (!reusable)
+      return false;
+    auto size = scratch_.size() * sizeof(uint64_t);
+    for (unsigned i = 0; i < num_entries_; i++) {
+      auto &entry = entries_[i];
+      if (entry.heap == heap && entry.table.size() == scratch_.size() &&
+          memcmp(entry.table.data(), scratch_.data(), size) == 0) {
+        offset = entry.offset;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+  Record that the scratch table has been written to `heap` at `offset`
+   */
+  void
+  insert(MTL::Buffer *heap, uint64_t offset) {
+    auto &entry = entries_[next_entry_];
+    next_entry_ = (next_entry_ + 1) % kArgumentTableCacheEntries;
+    num_entries_ = std::min(num_entries_ + 1, kArgumentTableCacheEntries);
+    entry.heap = heap;
+    entry.offset = offset;
+    entry.table = scratch_;
+  }
+
+  /**
+  Return false if the table at `offset` of `heap` is already bound to the
+  encoder, otherwise record it and return true: the caller binds it.
+   */
+  bool
+  bind(MTL::Buffer *heap, uint64_t offset, uint64_t encoder_id, uint32_t binding_key) {
+    if (bound_heap_ == heap && bound_offset_ == offset && bound_encoder_id_ == encoder_id &&
+        bound_key_ == binding_key)
+      return false;
+    bound_heap_ = heap;
+    bound_offset_ = offset;
+    bound_encoder_id_ = encoder_id;
+    bound_key_ = binding_key;
+    return true;
+  }
+
+  /**
+  Forget the bound table, when the binding point has been taken by another
+  stage
+   */
+  void
+  unbind() {
+    bound_heap_ = nullptr;
+  }
+
+private:
+  struct Entry {
+    MTL::Buffer *heap;
+    uint64_t offset;
+    std::vector<uint64_t> table;
+  };
+
+  std::vector<uint64_t> scratch_;
+  const void *layout_ = nullptr;
+  uint64_t encoder_id_ = 0;
+  uint64_t chunk_id_ = 0;
+  bool patchable_ = false;
+  std::array<Entry, kArgumentTableCacheEntries> entries_;
+  size_t num_entries_ = 0;
+  size_t next_entry_ = 0;
+  MTL::Buffer *bound_heap_ = nullptr;
+  uint64_t bound_offset_ = 0;
+  uint64_t bound_encoder_id_ = 0;
+  uint32_t bound_key_ = 0;
+};
+
+} // namespace dxmt
@@ -15,6 +15,9 @@ template <typename Element, size_t NumElements> class BindingSet {
   bit::bitset<NumElements> dirty;
   bit::bitset<NumElements> bound;
   std::array<Element, NumElements> storage;
+  // reverse index of renamable resources, see `set_dirty_keyed()`
+  bit::bitset<NumElements> keyed;
+  std::array<const void *, NumElements> keys{};
 
 public:
   BindingSet() {};
@@ -22,6 +25,8 @@ public:
   BindingSet(BindingSet &&move) : storage(std::move(move.storage)) {
     bound = move.bound;
     dirty = move.bound; // intended behavior
+    keyed = move.keyed;
+    keys = move.keys;
   };
 
   BindingSet &
@@ -29,6 +34,8 @@ public:
     storage = std::move(move.storage);
     bound = move.bound;
     dirty = move.bound; // intended behavior
+    keyed = move.keyed;
+    keys = move.keys;
     return *this;
   }
 
@@ -104,6 +111,31 @@ public:
     dirty.set(slot, true);
   };
 
+  /**
+  Associate the element at `slot` with `key` (typically the resource it refers
+  to) until it's replaced or unbound
+   */
+  inline void
+  set_key(size_t slot, const void *key) {
+    keys[slot] = key;
+    keyed.set(slot, true);
+  };
+
+  /**
+  Only mark dirty the slots associated with `key`, i.e. where a resource that
+  has just been renamed is bound
+   */
+  inline void
+  set_dirty_keyed(const void *key) {
+    for (size_t i = 0; i < (NumElements + 63) / 64; i++) {
+      for (uint64_t bits = keyed.qword(i); bits; bits &= bits - 1) {
+        size_t slot = i * 64 + __builtin_ctzll(bits);
+        if (keys[slot] == key)
+          dirty.set(slot, true);
+      }
+    }
+  };
+
   /**
   try to bind element at specific slot, and return a reference to the
   corresponding element storage it also tells if a replacement does happen
@@ -124,6 +156,7 @@ public:
     // idk why placement construction kills performance
     storage[slot] = std::forward<Element>(element);
     dirty.set(slot, true);
+    keyed.set(slot, false);
     replacement = true;
     return storage[slot];
   };
@@ -140,6 +173,7 @@ public:
       storage[slot] = {};
       bound.set(slot, false);
       dirty.set(slot, true);
+      keyed.set(slot, false);
     }
   }
 };
@@ -1,5 +1,9 @@
 #include "./dxmt_buffer_pool.hpp"
 #include "Metal/MTLDevice.hpp"
+#include "log/log.hpp"
+#include "util_math.hpp"
+#include <algorithm>
+#include <mutex>
 
 namespace dxmt {
 
@@ -28,4 +32,94 @@ BufferPool::GetNext(
   *gpuAddr = buffer->gpuAddress();
   *cpuAddr = buffer->contents();
 }
+
+BufferRing::~BufferRing() {
+  for (auto block : blocks) {
+    block->buffer->release();
+    delete block;
+  }
+}
+
+bool
+BufferRing::Exchange(uint64_t currentSeqId, uint64_t coherentSeqId, size_t size, BufferRingAllocation *allocation) {
+  std::lock_guard<dxmt::mutex> lock(mutex);
+  if (auto previous = allocation->block) {
+    previous->num_live--;
+    previous->last_released_seq_id = std::max(previous->last_released_seq_id, currentSeqId);
+  }
+  auto offset = current ? align(current->allocated_size, kBufferRingAlignment) : 0;
+  if (!current || offset + size > kBufferRingBlockSize) {
+    auto block = acquire_block(coherentSeqId);
+    if (!block) {
+      *allocation = {};
+      return false;
+    }
+    current = block;
+    offset = 0;
+  }
+  current->allocated_size = offset + size;
+  current->num_live++;
+  allocation->block = current;
+  allocation->buffer = current->buffer;
+  allocation->offset = offset;
+  allocation->gpu_addr = current->gpu_addr + offset;
+  allocation->cpu_addr = current->cpu_addr + offset;
+  return true;
+}
+
+void
+BufferRing::Release(BufferRingAllocation *allocation) {
+  std::lock_guard<dxmt::mutex> lock(mutex);
+  if (auto block = allocation->block)
+    block->num_live--;
+  *allocation = {};
+}
+
+BufferRingBlock *
+BufferRing::acquire_block(uint64_t coherent_id) {
+  for (auto block : blocks) {
+    if (block != current && !block->num_live && block->last_released_seq_id < coherent_id) {
+      block->allocated_size = 0;
+      return block;
+    }
+  }
+  if (blocks.size() >= kBufferRingMaxBlocks) {
+    if (!full_reported) {
+      uint32_t pinned = 0, live = 0;
+      for (auto block : blocks) {
+        pinned += block->num_live != 0;
+        live += block->num_live;
+      }
+      WARN("BufferRing: ", pinned, " of ", blocks.size(), " blocks pinned by ", live,
+           " live allocations, falling back to dedicated buffers");
+      full_reported = true;
+    }
+    return nullptr;
+  }
+  auto buffer = device->newBuffer(kBufferRingBlockSize, block_options);
+  auto block = new BufferRingBlock{
+      .buffer = buffer,
+      .cpu_addr = (char *)buffer->contents(),
+      .gpu_addr = buffer->gpuAddress(),
+      .allocated_size = 0,
+      .num_live = 0,
+      .last_released_seq_id = 0,
+  };
+  blocks.push_back(block);
+  return block;
+}
+
+void
+BufferRing::free_blocks(uint64_t coherent_id) {
+  std::lock_guard<dxmt::mutex> lock(mutex);
+  std::erase_if(blocks, [&](BufferRingBlock *block) {
+    if (block == current || block->num_live || block->last_released_seq_id > coherent_id ||
+        coherent_id - block->last_released_seq_id <= kBufferRingBlockLifetime)
+      return false;
+    block->buffer->release();
+    delete block;
+    return true;
+  });
+}
+
 }; // namespace dxmt
\ No newline at end of file
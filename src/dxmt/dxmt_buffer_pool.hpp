@@ -1,7 +1,9 @@
 #pragma once
 
 #include "Metal/MTLBuffer.hpp"
+#include "thread.hpp"
 #include <queue>
+#include <vector>
 namespace dxmt {
 
 class BufferPool {
@@ -36,4 +38,85 @@ public:
   MTL::ResourceOptions options;
 };
 
+constexpr size_t kBufferRingBlockSize = 0x400000;        // 4MB
+constexpr size_t kBufferRingMaxAllocationSize = 0x10000; // 64KB
+constexpr size_t kBufferRingAlignment = 256;
+constexpr size_t kBufferRingBlockLifetime = 300;
+// a single long-lived allocation pins its whole block, so the ring is capped
+constexpr size_t kBufferRingMaxBlocks = 32; // 128MB
+
+struct BufferRingBlock {
+  MTL::Buffer *buffer;
+  char *cpu_addr;
+  uint64_t gpu_addr;
+  size_t allocated_size;
+  // allocations not released yet
+  uint32_t num_live;
+  uint64_t last_released_seq_id;
+};
+
+/**
+A sub-allocation of a `BufferRing`, held until it's exchanged or released
+ */
+struct BufferRingAllocation {
+  BufferRingBlock *block = nullptr;
+  MTL::Buffer *buffer = nullptr;
+  uint64_t offset = 0;
+  uint64_t gpu_addr = 0;
+  void *cpu_addr = nullptr;
+};
+
+/**
+Blocks shared by small dynamic buffers, so that renaming one on discard is a
+bump allocation instead of a dedicated buffer. Unlike a staging allocation,
+a dynamic buffer allocation lives until the buffer is discarded again, which
+can be many chunks later: a block is only recycled once all allocations made
+from it have been released, and the GPU is done with the last of them.
+
+Once kBufferRingMaxBlocks are pinned that way, allocations fail and callers
+fall back to dedicated buffers.
+ */
+class BufferRing {
+public:
+  BufferRing(MTL::Device *device, MTL::ResourceOptions block_options) :
+      device(device),
+      block_options(block_options) {};
+
+  ~BufferRing();
+
+  /**
+  Replace `allocation` (if any) by a new one of `size` bytes. The previous one
+  may still be used by GPU until `currentSeqId` is coherent. Return false if
+  the ring is full, then the previous allocation is released and `allocation`
+  is cleared.
+   */
+  bool Exchange(uint64_t currentSeqId, uint64_t coherentSeqId, size_t size, BufferRingAllocation *allocation);
+
+  /**
+  Release `allocation` that isn't used by GPU anymore
+   */
+  void Release(BufferRingAllocation *allocation);
+
+  void free_blocks(uint64_t coherent_id);
+
+  /**
+  Must be set before the first allocation
+   */
+  void
+  set_block_options(MTL::ResourceOptions options) {
+    block_options = options;
+  }
+
+private:
+  BufferRingBlock *acquire_block(uint64_t coherent_id);
+
+  std::vector<BufferRingBlock *> blocks;
+  // the block allocations are made from
+  BufferRingBlock *current = nullptr;
+  MTL::Device *device;
+  dxmt::mutex mutex;
+  MTL::ResourceOptions block_options;
+  bool full_reported = false;
+};
+
 }; // namespace dxmt
\ No newline at end of file
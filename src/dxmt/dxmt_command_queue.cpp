@@ -2,13 +2,39 @@
 #include "Metal/MTLCaptureManager.hpp"
 #include "Metal/MTLFunctionLog.hpp"
 #include "Foundation/NSAutoreleasePool.hpp"
+#include "config/config.hpp"
 #include "util_env.hpp"
+#include "util_memcpy.hpp"
+#include <algorithm>
 #include <atomic>
+#include <cmath>
 
 #define ASYNC_ENCODING 1
 
 namespace dxmt {
 
+void
+CommandChunk::encode(MTL::CommandBuffer *cmdbuf) {
+  attached_cmdbuf = cmdbuf;
+  context_t context(this, cmdbuf);
+  auto &initial_uploads = queue->TakeInitialUploads();
+  if (!initial_uploads.empty() || !prologue_commands.empty()) {
+    context.blit_encoder = cmdbuf->blitCommandEncoder();
+    for (auto &upload : initial_uploads) {
+      context.blit_encoder->copyFromBuffer(
+          upload.staging_buffer, upload.staging_offset, upload.dst, 0, upload.size
+      );
+    }
+    // retained by the command buffer
+    initial_uploads.clear();
+    prologue_commands.execute(context);
+    context.blit_encoder->endEncoding();
+    context.blit_encoder = nullptr;
+  }
+  commands.execute(context);
+  queue->filtered_render_state_calls += context.render_state.filtered();
+};
+
 ENCODER_RENDER_INFO *
 CommandChunk::mark_render_pass() {
   linear_allocator<ENCODER_RENDER_INFO> allocator(this);
@@ -35,11 +61,31 @@ CommandChunk::mark_pass(EncoderKind kind) {
   auto ptr = allocator.allocate(1);
   ptr->kind = kind;
   ptr->encoder_id = queue->GetNextEncoderId();
+  ptr->num_continuations = 0;
   last_encoder_info = ptr;
   return ptr;
 };
 
+void
+CommandChunk::switch_gpu_heap(size_t min_size) {
+  auto block = queue->argument_heap_allocator.acquire(queue->CoherentSeqId(), min_size, gpu_argument_heap != nullptr);
+  block->next = gpu_argument_heap;
+  gpu_argument_heap = block;
+  gpu_argument_heap_offset = 0;
+  gpu_argument_heap_reserved = 0;
+}
+
+static uint32_t
+GetCommandChunkCount() {
+  auto count = Config::getInstance().getOption<int32_t>("d3d11.commandChunkCount", kCommandChunkCount);
+  return std::clamp<int32_t>(count, kCommandChunkMinCount, kCommandChunkMaxCount);
+}
+
 CommandQueue::CommandQueue(MTL::Device *device) :
+    chunk_count(GetCommandChunkCount()),
+    chunks(new CommandChunk[chunk_count]),
+    max_chunk_ongoing(chunk_count - 1),
+    adaptive_chunk_ongoing(Config::getInstance().getOption<bool>("d3d11.adaptiveChunkDepth", false)),
     encodeThread([this]() { this->EncodingThread(); }),
     finishThread([this]() { this->WaitForFinishThread(); }),
     staging_allocator(
@@ -47,25 +93,35 @@ CommandQueue::CommandQueue(MTL::Device *device) :
                     MTL::ResourceStorageModeShared
     ),
     copy_temp_allocator(device, MTL::ResourceHazardTrackingModeUntracked | MTL::ResourceStorageModePrivate),
+    argument_heap_allocator(
+        device, MTL::ResourceHazardTrackingModeUntracked | MTL::ResourceCPUCacheModeWriteCombined |
+                    MTL::ResourceStorageModeShared
+    ),
     clear_cmd(device),
-    counter_pool(device) {
-  commandQueue = transfer(device->newCommandQueue(kCommandChunkCount));
-  for (unsigned i = 0; i < kCommandChunkCount; i++) {
+    counter_pool(device),
+    dynamic_buffer_ring(device, MTL::ResourceOptionCPUCacheModeWriteCombined | MTL::ResourceStorageModeShared),
+    placement_heaps(device) {
+  commandQueue = transfer(device->newCommandQueue(chunk_count));
+  for (unsigned i = 0; i < chunk_count; i++) {
     auto &chunk = chunks[i];
     chunk.queue = this;
-    chunk.cpu_argument_heap = (char *)malloc(kCommandChunkCPUHeapSize);
-    chunk.gpu_argument_heap = transfer(device->newBuffer(
-        kCommandChunkGPUHeapSize, MTL::ResourceHazardTrackingModeUntracked | MTL::ResourceCPUCacheModeWriteCombined |
-                                      MTL::ResourceStorageModeShared
-    ));
     chunk.visibility_result_heap = transfer(device->newBuffer(
         kOcclusionSampleCount * sizeof(uint64_t),
         MTL::ResourceHazardTrackingModeUntracked | MTL::ResourceStorageModeShared
     ));
-    chunk.gpu_argument_heap_contents = (uint64_t *)chunk.gpu_argument_heap->contents();
     chunk.reset();
   };
 
+  auto &config = Config::getInstance();
+  chunk_command_threshold = std::max(config.getOption<int32_t>("d3d11.chunkCommandThreshold", 4096), 0);
+  chunk_heap_threshold = (size_t)std::max(config.getOption<int32_t>("d3d11.chunkHeapThreshold", 8192), 0) << 10;
+  chunk_time_threshold =
+      std::chrono::microseconds(std::max(config.getOption<int32_t>("d3d11.chunkTimeThreshold", 2000), 0));
+  last_commit_time = std::chrono::steady_clock::now();
+  hoist_uploads = config.getOption<bool>("d3d11.hoistUploads", true);
+  placement_heaps.enabled = config.getOption<bool>("d3d11.placementHeaps", true);
+  placement_heaps.heap_residency = config.getOption<bool>("d3d11.heapResidency", true);
+
   std::string env = env::getEnvVar("DXMT_CAPTURE_FRAME");
 
   if (!env.empty()) {
@@ -85,23 +141,66 @@ CommandQueue::~CommandQueue() {
   ready_for_commit.notify_one();
   encodeThread.join();
   finishThread.join();
-  for (unsigned i = 0; i < kCommandChunkCount; i++) {
+  for (unsigned i = 0; i < chunk_count; i++) {
     auto &chunk = chunks[i];
     chunk.reset();
-    free(chunk.cpu_argument_heap);
+    argument_heap_allocator.retire(chunk.gpu_argument_heap, 0);
     chunk.gpu_argument_heap = nullptr;
   };
+  Logger::info(str::format(
+      "Committed ", submit_statistics.committed, " chunks, early by commands: ",
+      submit_statistics.committed_by_commands, ", by heap usage: ", submit_statistics.committed_by_heap_usage,
+      ", by time: ", submit_statistics.committed_by_time, ", postponed: ", submit_statistics.postponed,
+      ", waited on ring: ", submit_statistics.ring_waits, " times for ",
+      std::chrono::duration_cast<std::chrono::microseconds>(submit_statistics.ring_wait_time).count(), "us"
+  ));
+  Logger::info(str::format("Filtered ", filtered_render_state_calls, " redundant render encoder state calls"));
+  if (encoder_statistics.frames) {
+    Logger::info(str::format(
+        "Started ", encoder_statistics.encoders, " encoders in ", encoder_statistics.frames, " frames, ",
+        encoder_statistics.encoders / encoder_statistics.frames, " per frame on average, ",
+        encoder_statistics.max_encoders_per_frame, " at most"
+    ));
+  }
+  Logger::info(str::format(
+      "Updated subresources ", upload_statistics.direct, " times directly, ", upload_statistics.renamed,
+      " by renaming, ", upload_statistics.staged, " through staging, ", upload_statistics.batched, " in ",
+      upload_statistics.batches, " batches"
+  ));
+  uint64_t resource_usage_requests = 0, resource_usage_calls = 0;
+  for (unsigned i = 0; i < chunk_count; i++) {
+    auto [requests, calls] = chunks[i].resource_usage.statistics();
+    resource_usage_requests += requests;
+    resource_usage_calls += calls;
+  }
+  Logger::info(str::format(
+      "Made ", resource_usage_requests, " residency requests in ", resource_usage_calls, " useResources/useHeaps calls"
+  ));
   TRACE("Destructed command queue");
 }
 
 void
 CommandQueue::CommitCurrentChunk() {
-  chunk_ongoing.wait(kCommandChunkCount - 1, std::memory_order_acquire);
+  auto now = std::chrono::steady_clock::now();
+  if (adaptive_chunk_ongoing)
+    UpdateMaxChunkOngoing(now - last_commit_time);
+  uint64_t ongoing = chunk_ongoing.load(std::memory_order_acquire);
+  if (ongoing >= max_chunk_ongoing) {
+    do {
+      chunk_ongoing.wait(ongoing, std::memory_order_acquire);
+    } while ((ongoing = chunk_ongoing.load(std::memory_order_acquire)) >= max_chunk_ongoing);
+    auto waited = std::chrono::steady_clock::now() - now;
+    submit_statistics.ring_waits++;
+    submit_statistics.ring_wait_time += waited;
+    now += waited;
+  }
   chunk_ongoing.fetch_add(1, std::memory_order_relaxed);
   auto chunk_id = ready_for_encode.load(std::memory_order_relaxed);
-  auto &chunk = chunks[chunk_id % kCommandChunkCount];
+  auto &chunk = chunks[chunk_id % chunk_count];
   chunk.chunk_id = chunk_id;
   chunk.frame_ = present_seq;
+  submit_statistics.committed++;
+  last_commit_time = now;
 #if ASYNC_ENCODING
   ready_for_encode.fetch_add(1, std::memory_order_release);
   ready_for_encode.notify_one();
@@ -110,6 +209,66 @@ CommandQueue::CommitCurrentChunk() {
 #endif
 }
 
+bool
+CommandQueue::ShouldCommitCurrentChunk() {
+  auto &chunk = *CurrentChunk();
+  if (chunk.has_no_work_encoded_yet())
+    return false;
+  uint64_t *reason;
+  if (chunk_command_threshold && chunk.num_commands() >= chunk_command_threshold)
+    reason = &submit_statistics.committed_by_commands;
+  else if (chunk_heap_threshold && chunk.heap_usage() >= chunk_heap_threshold)
+    reason = &submit_statistics.committed_by_heap_usage;
+  else if (chunk_time_threshold.count() &&
+           std::chrono::steady_clock::now() - last_commit_time >= chunk_time_threshold)
+    reason = &submit_statistics.committed_by_time;
+  else
+    return false;
+  // don't let an early commit block the caller, the chunk keeps growing until
+  // the encoder catches up
+  if (chunk_ongoing.load(std::memory_order_relaxed) + 1 >= max_chunk_ongoing) {
+    submit_statistics.postponed++;
+    return false;
+  }
+  (*reason)++;
+  return true;
+}
+
+/**
+Keep just enough chunks in flight to cover the GPU time of a chunk at the
+current submission rate, plus one. The interval doesn't include time spent
+waiting on the ring, and the GPU time doesn't include queueing, so a deeper
+ring doesn't feed back into a larger depth.
+*/
+void
+CommandQueue::UpdateMaxChunkOngoing(std::chrono::steady_clock::duration submit_interval) {
+  submit_interval_avg += (std::chrono::duration<double>(submit_interval).count() - submit_interval_avg) / 16;
+  uint32_t max_depth = chunk_count - 1;
+  uint32_t min_depth = std::min(2u, max_depth);
+  uint32_t depth = max_depth;
+  if (submit_interval_avg > 0) {
+    double ratio = gpu_time_avg.load(std::memory_order_relaxed) / submit_interval_avg;
+    depth = std::clamp((uint32_t)std::min(std::ceil(ratio), (double)max_depth) + 1, min_depth, max_depth);
+  }
+  if (depth != max_chunk_ongoing) {
+    TRACE("command queue: max chunks in flight ", max_chunk_ongoing, " -> ", depth);
+    max_chunk_ongoing = depth;
+  }
+}
+
+uint64_t
+CommandQueue::UploadInitialData(MTL::Buffer *dst, const void *data, size_t size) {
+  // with the lock held, the chunk being recorded can't have taken the uploads
+  // yet: this one is encoded by it at the latest
+  std::lock_guard<dxmt::mutex> lock(initial_upload_mutex);
+  auto seq = ready_for_encode.load(std::memory_order_acquire);
+  auto [ptr, staging_buffer, offset] =
+      staging_allocator.allocate(seq, cpu_coherent.load(std::memory_order_acquire), size, 16);
+  memcpy_streaming(ptr, data, size);
+  initial_uploads.push_back({dst, staging_buffer, offset, size});
+  return seq;
+}
+
 void
 CommandQueue::CommitChunkInternal(CommandChunk &chunk, uint64_t seq) {
 
@@ -152,6 +311,11 @@ CommandQueue::CommitChunkInternal(CommandChunk &chunk, uint64_t seq) {
   auto cmdbuf = chunk.attached_cmdbuf;
   counter_pool.FillCounters(seq, cmdbuf);
   chunk.encode(cmdbuf);
+  // nothing is allocated from the argument heap after encoding
+  argument_heap_allocator.retire(chunk.gpu_argument_heap, seq);
+  chunk.gpu_argument_heap = nullptr;
+  chunk.gpu_argument_heap_offset = 0;
+  chunk.gpu_argument_heap_reserved = 0;
   cmdbuf->commit();
 
   ready_for_commit.fetch_add(1, std::memory_order_release);
@@ -170,7 +334,7 @@ CommandQueue::EncodingThread() {
     if (stopped.load())
       break;
     // perform...
-    auto &chunk = chunks[internal_seq % kCommandChunkCount];
+    auto &chunk = chunks[internal_seq % chunk_count];
     CommitChunkInternal(chunk, internal_seq);
     internal_seq++;
   }
@@ -189,7 +353,7 @@ CommandQueue::WaitForFinishThread() {
     ready_for_commit.wait(internal_seq, std::memory_order_acquire);
     if (stopped.load())
       break;
-    auto &chunk = chunks[internal_seq % kCommandChunkCount];
+    auto &chunk = chunks[internal_seq % chunk_count];
     if (chunk.attached_cmdbuf->status() <= MTL::CommandBufferStatusScheduled) {
       chunk.attached_cmdbuf->waitUntilCompleted();
     }
@@ -203,6 +367,13 @@ CommandQueue::WaitForFinishThread() {
         ERR(chunk.attached_cmdbuf->logs()->debugDescription()->cString(NS::ASCIIStringEncoding));
       }
     }
+    if (adaptive_chunk_ongoing) {
+      double gpu_time = chunk.attached_cmdbuf->GPUEndTime() - chunk.attached_cmdbuf->GPUStartTime();
+      if (gpu_time > 0) {
+        double avg = gpu_time_avg.load(std::memory_order_relaxed);
+        gpu_time_avg.store(avg + (gpu_time - avg) / 16, std::memory_order_relaxed);
+      }
+    }
 
     chunk.reset();
     cpu_coherent.fetch_add(1, std::memory_order_relaxed);
@@ -212,6 +383,9 @@ CommandQueue::WaitForFinishThread() {
 
     staging_allocator.free_blocks(internal_seq);
     copy_temp_allocator.free_blocks(internal_seq);
+    argument_heap_allocator.free_blocks(internal_seq);
+    dynamic_buffer_ring.free_blocks(internal_seq);
+    placement_heaps.free_blocks(internal_seq);
     counter_pool.ReleaseCounters(internal_seq);
 
     internal_seq++;
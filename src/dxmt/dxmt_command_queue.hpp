@@ -8,18 +8,29 @@
 #include "Metal/MTLRenderCommandEncoder.hpp"
 #include "Metal/MTLDevice.hpp"
 #include "Metal/MTLTypes.hpp"
+#include "dxmt_argument_heap.hpp"
 #include "dxmt_binding.hpp"
+#include "dxmt_buffer_pool.hpp"
 #include "dxmt_capture.hpp"
 #include "dxmt_command.hpp"
+#include "dxmt_command_stream.hpp"
+#include "dxmt_cpu_arena.hpp"
+#include "dxmt_encoder_state.hpp"
 #include "dxmt_counter_pool.hpp"
+#include "dxmt_placement_heap.hpp"
 #include "dxmt_ring_bump_allocator.hpp"
 #include "log/log.hpp"
 #include "objc_pointer.hpp"
 #include "thread.hpp"
+#include "util_math.hpp"
+#include <algorithm>
 #include <atomic>
+#include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <memory>
 #include <span>
 
 namespace dxmt {
@@ -29,6 +40,33 @@ enum class EncoderKind : uint32_t { Nil, ClearPass, Render, Compute, Blit, Resol
 struct ENCODER_INFO {
   EncoderKind kind;
   uint64_t encoder_id;
+  // compute and blit passes only: the number of times the encoder has been
+  // ended and then continued, which turns the ending commands into no-op
+  uint32_t num_continuations;
+};
+
+struct ENCODER_RENDER_RESOLVE {
+  BindingRef texture;
+  uint32_t level;
+  uint32_t slice;
+};
+
+/**
+An attachment of a render pass. Its store action is only decided when the
+pass is encoded, so later calls can still flip it: see `dont_store` and
+`resolve`.
+ */
+struct ENCODER_RENDER_ATTACHMENT {
+  uint64_t resource_id = 0; // 0 if the attachment is unused
+  uint64_t view_id = 0;
+  // the attachment is a single slice of a multisampled resource
+  uint32_t resolvable: 1 = 0;
+  // contents are discarded after the pass
+  uint32_t dont_store: 1 = 0;
+  uint32_t format = 0; // DXGI_FORMAT of the view, if resolvable
+  uint32_t slice = 0;  // array slice of the resource, if resolvable
+  // resolved at the end of the pass instead of by a separate resolve pass
+  ENCODER_RENDER_RESOLVE *resolve = nullptr;
 };
 
 struct ENCODER_RENDER_INFO {
@@ -36,6 +74,9 @@ struct ENCODER_RENDER_INFO {
   uint64_t encoder_id;
   uint32_t tessellation_pass: 1 = 0;
   uint32_t use_visibility_result: 1 = 0;
+  // color attachments, followed by depth stencil attachment
+  uint32_t num_attachments = 0;
+  ENCODER_RENDER_ATTACHMENT *attachments = nullptr;
 };
 
 struct CLEAR_DEPTH_STENCIL {
@@ -145,9 +186,9 @@ ptr_add(const void *const p, const std::uintptr_t &amount) noexcept {
   return reinterpret_cast<void *>(reinterpret_cast<std::uintptr_t>(p) + amount);
 }
 
-constexpr uint32_t kCommandChunkCount = 8;
-constexpr size_t kCommandChunkCPUHeapSize = 0x800000; // is 8MB too large?
-constexpr size_t kCommandChunkGPUHeapSize = 0x400000;
+constexpr uint32_t kCommandChunkCount = 8; // default
+constexpr uint32_t kCommandChunkMinCount = 2;
+constexpr uint32_t kCommandChunkMaxCount = 32;
 constexpr size_t kOcclusionSampleCount = 1024;
 
 class CommandQueue;
@@ -184,44 +225,16 @@ class CommandChunk {
     CommandChunk *chunk;
   };
 public:
-  template <typename context> class BFunc {
-  public:
-    virtual void invoke(context &) = 0;
-    virtual ~BFunc() noexcept {};
-  };
-
-  template <typename context, typename F> class EFunc final : public BFunc<context> {
-  public:
-    void
-    invoke(context &ctx) final {
-      std::invoke(func, ctx);
-    };
-    ~EFunc() noexcept final = default;
-    EFunc(F &&ff) : func(std::forward<F>(ff)) {}
-    EFunc(const EFunc &copy) = delete;
-    EFunc &operator=(const EFunc &copy_assign) = delete;
-
-  private:
-    F func;
-  };
-
-  template <typename context> class MFunc final : public BFunc<context> {
-  public:
-    void invoke(context &ctx) final { /* nop */ };
-    ~MFunc() noexcept = default;
-  };
-
-  template <typename value_t> struct Node {
-    value_t value;
-    Node *next;
-  };
-
   class context_t : public EncodingContext {
   public:
     CommandChunk *chk;
     CommandQueue *queue;
     MTL::CommandBuffer *cmdbuf;
     Obj<MTL::RenderCommandEncoder> render_encoder;
+    // reset when render_encoder is created
+    RenderEncoderState render_state;
+    // flushed before each draw and dispatch
+    ResourceUsageBatch &resource_usage;
     Obj<MTL::ComputeCommandEncoder> compute_encoder;
     MTL::Size cs_threadgroup_size{};
     Obj<MTL::BlitCommandEncoder> blit_encoder;
@@ -236,10 +249,18 @@ public:
     uint32_t tess_num_output_patch_constant_scalar;
     uint32_t tess_threads_per_patch;
 
+    // the argument heap bound to encoders, see CommandChunk::reserve_gpu_heap()
+    MTL::Buffer *argument_heap{};
+    bool tessellation_pass = false;
+
     uint64_t offset_base = 0;
     uint64_t visibility_offset_base = 0;
 
-    context_t(CommandChunk *chk, MTL::CommandBuffer *cmdbuf) : chk(chk), queue(chk->queue), cmdbuf(cmdbuf) {}
+    context_t(CommandChunk *chk, MTL::CommandBuffer *cmdbuf) :
+        chk(chk),
+        queue(chk->queue),
+        cmdbuf(cmdbuf),
+        resource_usage(chk->resource_usage) {}
 
   private:
   };
@@ -249,61 +270,95 @@ public:
 
   void *
   allocate_cpu_heap(size_t size, size_t alignment) {
-    std::size_t adjustment = align_forward_adjustment((void *)cpu_arugment_heap_offset, alignment);
-    auto aligned = cpu_arugment_heap_offset + adjustment;
-    cpu_arugment_heap_offset = aligned + size;
-    if (cpu_arugment_heap_offset >= kCommandChunkCPUHeapSize) {
-      ERR(cpu_arugment_heap_offset, " - cpu argument heap overflow, expect error.");
-    }
-    return ptr_add(cpu_argument_heap, aligned);
+    return cpu_argument_heap.allocate(size, alignment);
   }
 
-  std::pair<MTL::Buffer *, uint64_t>
-  inspect_gpu_heap() {
-    return {gpu_argument_heap, gpu_arugment_heap_offset};
+  const CPUArena &
+  inspect_cpu_heap() const {
+    return cpu_argument_heap;
   }
 
-  std::pair<MTL::Buffer *, uint64_t>
+  /**
+  Allocate from the current block of the argument heap, or from a new block
+  if it doesn't fit. Allocations made while recording are only addressable
+  through the bound heap if they have been covered by `reserve_gpu_heap()`.
+   */
+  std::tuple<void *, MTL::Buffer *, uint64_t>
   allocate_gpu_heap(size_t size, size_t alignment) {
-    std::size_t adjustment = align_forward_adjustment((void *)gpu_arugment_heap_offset, alignment);
-    auto aligned = gpu_arugment_heap_offset + adjustment;
-    gpu_arugment_heap_offset = aligned + size;
-    if (gpu_arugment_heap_offset > kCommandChunkGPUHeapSize) {
-      ERR("gpu argument heap overflow, expect error.");
+    auto aligned = gpu_argument_heap ? align(gpu_argument_heap_offset, alignment) : 0;
+    if (!gpu_argument_heap || aligned + size > gpu_argument_heap->size) {
+      // the bound heap would silently change in the middle of a reservation
+      assert(gpu_argument_heap_offset >= gpu_argument_heap_reserved && "argument heap reservation overflowed");
+      switch_gpu_heap(size);
+      aligned = 0;
     }
-    return {gpu_argument_heap, aligned};
+    gpu_argument_heap_offset = aligned + size;
+    gpu_argument_heap_allocated += size;
+    return {gpu_argument_heap->contents + aligned, gpu_argument_heap->buffer, aligned};
   }
 
-  uint64_t *gpu_argument_heap_contents;
+  /**
+  Make sure the next `size` bytes (including alignment padding) are allocated
+  from the current block. If a new block is needed, it's returned and must be
+  bound to encoders, and offsets into the previous one must be set again.
+  Otherwise return nullptr.
+   */
+  MTL::Buffer *
+  reserve_gpu_heap(size_t size) {
+    if (gpu_argument_heap && gpu_argument_heap_offset + size <= gpu_argument_heap->size) {
+      gpu_argument_heap_reserved = gpu_argument_heap_offset + size;
+      return nullptr;
+    }
+    switch_gpu_heap(size);
+    gpu_argument_heap_reserved = size;
+    return gpu_argument_heap->buffer;
+  }
+
+  /**
+  the block of the argument heap allocations are currently made from
+   */
+  MTL::Buffer *
+  current_gpu_heap() const {
+    return gpu_argument_heap ? gpu_argument_heap->buffer : nullptr;
+  }
 
   using context = context_t;
 
   template <cpu_cmd<context> F>
   void
   emit(F &&func) {
-    linear_allocator<EFunc<context, F>> allocator(this);
-    auto ptr = allocator.allocate(1);
-    new (ptr) EFunc<context, F>(std::forward<F>(func)); // in placement
-    linear_allocator<Node<BFunc<context> *>>            // force break
-        allocator_node(this);
-    auto ptr_node = allocator_node.allocate(1);
-    *ptr_node = {ptr, nullptr};
-    list_end->next = ptr_node;
-    list_end = ptr_node;
+    using stream = CommandStream<context>;
+    auto storage = allocate_cpu_heap(stream::template record_size<F>, stream::template record_alignment<F>);
+    commands.append(storage, std::forward<F>(func));
   }
 
+  /**
+  Emit a command to the blit encoder encoded before anything else in the
+  chunk. The caller is responsible for it not to depend on, or affect, any
+  command that has been emitted before.
+   */
+  template <cpu_cmd<context> F>
   void
-  encode(MTL::CommandBuffer *cmdbuf) {
-    attached_cmdbuf = cmdbuf;
-    context_t context(this, cmdbuf);
-    auto cur = monoid_list.next;
-    while (cur) {
-      assert((uint64_t)cur->value >= (uint64_t)cpu_argument_heap);
-      assert((uint64_t)cur->value < ((uint64_t)cpu_argument_heap + cpu_arugment_heap_offset));
-      cur->value->invoke(context);
-      cur = cur->next;
-    }
-  };
+  emit_prologue(F &&func) {
+    using stream = CommandStream<context>;
+    auto storage = allocate_cpu_heap(stream::template record_size<F>, stream::template record_alignment<F>);
+    prologue_commands.append(storage, std::forward<F>(func));
+  }
+
+  void encode(MTL::CommandBuffer *cmdbuf);
+
+  size_t
+  num_commands() const {
+    return prologue_commands.size() + commands.size();
+  }
+
+  /**
+  bytes allocated from both argument heaps since the chunk was reset
+   */
+  size_t
+  heap_usage() const {
+    return cpu_argument_heap.allocated() + gpu_argument_heap_allocated;
+  }
 
   ENCODER_RENDER_INFO *mark_render_pass();
 
@@ -328,49 +383,81 @@ public:
 
   uint64_t chunk_id;
   uint64_t frame_;
+  // only used while encoding, kept to reuse its storage
+  ResourceUsageBatch resource_usage;
   Obj<MTL::Buffer> visibility_result_heap;
 
 private:
   CommandQueue *queue;
-  char *cpu_argument_heap;
-  Obj<MTL::Buffer> gpu_argument_heap;
-  uint64_t cpu_arugment_heap_offset;
-  uint64_t gpu_arugment_heap_offset;
-  MFunc<context> monoid;
-  Node<BFunc<context> *> monoid_list;
-  Node<BFunc<context> *> *list_end;
+  CPUArena cpu_argument_heap{"chunk cpu argument heap"};
+  // blocks held by this chunk, the current one first
+  GPUArgumentHeapBlock *gpu_argument_heap = nullptr;
+  uint64_t gpu_argument_heap_offset = 0;
+  // end of the last reservation in the current block
+  uint64_t gpu_argument_heap_reserved = 0;
+  size_t gpu_argument_heap_allocated = 0;
+  CommandStream<context> prologue_commands;
+  CommandStream<context> commands;
   Obj<MTL::CommandBuffer> attached_cmdbuf;
-  ENCODER_INFO init_encoder_info{EncoderKind::Nil, 0};
+  ENCODER_INFO init_encoder_info{EncoderKind::Nil, 0, 0};
   ENCODER_INFO *last_encoder_info;
   uint64_t encoder_id;
 
+  void switch_gpu_heap(size_t min_size);
+
   friend class CommandQueue;
 
 public:
-  CommandChunk() :
-      monoid(),
-      monoid_list{&monoid, nullptr},
-      list_end(&monoid_list),
-      last_encoder_info(&init_encoder_info) {}
+  CommandChunk() : last_encoder_info(&init_encoder_info) {}
 
   void
   reset() noexcept {
-    auto cur = monoid_list.next;
-    while (cur) {
-      assert((uint64_t)cur->value >= (uint64_t)cpu_argument_heap);
-      assert((uint64_t)cur->value < ((uint64_t)cpu_argument_heap + cpu_arugment_heap_offset));
-      cur->value->~BFunc<context>(); // call destructor
-      cur = cur->next;
-    }
-    cpu_arugment_heap_offset = 0;
-    gpu_arugment_heap_offset = 0;
-    monoid_list.next = nullptr;
-    list_end = &monoid_list;
+    prologue_commands.clear();
+    commands.clear();
+    cpu_argument_heap.reset();
+    gpu_argument_heap_allocated = 0;
     attached_cmdbuf = nullptr;
     last_encoder_info = &init_encoder_info;
   }
 };
 
+struct ChunkSubmitStatistics {
+  uint64_t committed = 0;
+  uint64_t committed_by_commands = 0;
+  uint64_t committed_by_heap_usage = 0;
+  uint64_t committed_by_time = 0;
+  // a threshold is passed, but the ring is (almost) full
+  uint64_t postponed = 0;
+  // commits blocked because too many chunks are in flight
+  uint64_t ring_waits = 0;
+  std::chrono::steady_clock::duration ring_wait_time{};
+};
+
+/**
+Encoders started on the immediate context (including clear passes that are
+later folded), counted at present
+ */
+struct EncoderStatistics {
+  uint64_t frames = 0;
+  uint64_t encoders = 0;
+  uint64_t max_encoders_per_frame = 0;
+};
+
+/**
+Paths taken by UpdateSubresource on the immediate context
+ */
+struct UploadStatistics {
+  // written to memory of a resource not in use by GPU
+  uint64_t direct = 0;
+  // dynamic buffers entirely updated by renaming
+  uint64_t renamed = 0;
+  // copied from staging memory by a blit command of their own
+  uint64_t staged = 0;
+  // small buffer updates copied by a shared blit command
+  uint64_t batched = 0;
+  uint64_t batches = 0;
+};
+
 class CommandQueue {
 
 private:
@@ -386,8 +473,16 @@ private:
   std::atomic_uint64_t cpu_coherent = 0;
   std::atomic_bool stopped;
 
-  std::array<CommandChunk, kCommandChunkCount> chunks;
+  const uint32_t chunk_count;
+  std::unique_ptr<CommandChunk[]> chunks;
+  // maximum number of chunks in flight, less than chunk_count
+  uint32_t max_chunk_ongoing;
+  bool adaptive_chunk_ongoing;
+  // moving averages in seconds
+  double submit_interval_avg = 0;
+  std::atomic<double> gpu_time_avg = 0;
   uint64_t encoder_seq = 1;
+  uint64_t encoder_seq_at_present = 1;
   uint64_t present_seq = 0;
 
   dxmt::thread encodeThread;
@@ -400,13 +495,54 @@ private:
     return encoder_seq++;
   }
 
+  size_t chunk_command_threshold;
+  size_t chunk_heap_threshold;
+  std::chrono::steady_clock::duration chunk_time_threshold;
+  std::chrono::steady_clock::time_point last_commit_time;
+
+  void UpdateMaxChunkOngoing(std::chrono::steady_clock::duration submit_interval);
+
   RingBumpAllocator<true> staging_allocator;
   RingBumpAllocator<false> copy_temp_allocator;
+  GPUArgumentHeapAllocator argument_heap_allocator;
   CaptureState capture_state;
 
+  struct InitialUpload {
+    Obj<MTL::Buffer> dst;
+    MTL::Buffer *staging_buffer;
+    uint64_t staging_offset;
+    size_t size;
+  };
+  dxmt::mutex initial_upload_mutex;
+  std::vector<InitialUpload> initial_uploads;
+  // only accessed by the encode thread
+  std::vector<InitialUpload> initial_uploads_encoding;
+
+  /**
+  Take the initial uploads made so far, to be encoded before anything else
+   */
+  std::vector<InitialUpload> &
+  TakeInitialUploads() {
+    std::lock_guard<dxmt::mutex> lock(initial_upload_mutex);
+    initial_uploads_encoding.swap(initial_uploads);
+    return initial_uploads_encoding;
+  }
+
 public:
   DXMTCommandContext clear_cmd;
   CounterPool counter_pool;
+  // renamed small dynamic buffers, see MTLD3D11Device::ExchangeFromRing()
+  BufferRing dynamic_buffer_ring;
+  // GPU-only buffers and render targets are created from it
+  PlacementHeapPool placement_heaps;
+  // uploads to resources unused by the current chunk go to its prologue
+  bool hoist_uploads;
+  ChunkSubmitStatistics submit_statistics;
+  EncoderStatistics encoder_statistics;
+  // written by the immediate context
+  UploadStatistics upload_statistics;
+  // written by the encode thread
+  uint64_t filtered_render_state_calls = 0;
 
   CommandQueue(MTL::Device *device);
 
@@ -415,7 +551,7 @@ public:
   CommandChunk *
   CurrentChunk() {
     auto id = ready_for_encode.load(std::memory_order_relaxed);
-    return &chunks[id % kCommandChunkCount];
+    return &chunks[id % chunk_count];
   };
 
   uint64_t
@@ -431,7 +567,7 @@ public:
   uint64_t
   EncodedWorkFinishAt() {
     auto id = ready_for_encode.load(std::memory_order_relaxed);
-    return id - chunks[id % kCommandChunkCount].has_no_work_encoded_yet();
+    return id - chunks[id % chunk_count].has_no_work_encoded_yet();
   };
 
   /**
@@ -441,9 +577,21 @@ public:
   */
   void CommitCurrentChunk();
 
+  /**
+  Whether the current chunk has passed a submission threshold and should be
+  committed at the next encoder boundary, without waiting for an explicit
+  flush. Should be called on the same thread as CommitCurrentChunk.
+  */
+  bool ShouldCommitCurrentChunk();
+
   void
   PresentBoundary() {
     present_seq++;
+    auto encoders = encoder_seq - encoder_seq_at_present;
+    encoder_seq_at_present = encoder_seq;
+    encoder_statistics.frames++;
+    encoder_statistics.encoders += encoders;
+    encoder_statistics.max_encoders_per_frame = std::max(encoder_statistics.max_encoders_per_frame, encoders);
   }
 
   void
@@ -462,6 +610,16 @@ public:
     cpu_coherent.wait(seq_id, std::memory_order_acquire);
   };
 
+  /**
+  Upload the initial contents of a private buffer. The data is copied to
+  staging memory right away, and the copy to `dst` is encoded at the beginning
+  of the next chunk to be encoded, before anything that may use it. Safe to
+  call from any thread.
+
+  Return the sequence id of a chunk: the copy is done once it's completed.
+   */
+  uint64_t UploadInitialData(MTL::Buffer *dst, const void *data, size_t size);
+
   std::tuple<void *, MTL::Buffer *, uint64_t>
   AllocateStagingBuffer(size_t size, size_t alignment) {
     return staging_allocator.allocate(ready_for_encode, cpu_coherent.load(std::memory_order_acquire), size, alignment);
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace dxmt {
+
+template <typename context> struct CommandThunks {
+  void (*invoke)(void *record, context &ctx);
+  /* nullptr if the command is trivially destructible */
+  void (*destroy)(void *record) noexcept;
+};
+
+template <typename context> struct CommandHeader {
+  const CommandThunks<context> *thunks;
+  CommandHeader *next;
+};
+
+/**
+A command is stored inline right after its header, so the whole record is a
+single allocation. Records are linked because the storage they live in is
+shared with other per-chunk allocations.
+ */
+template <typename context, typename F> struct CommandRecord {
+  CommandHeader<context> header;
+  F func;
+
+  template <typename G> CommandRecord(G &&g) : header{&thunks, nullptr}, func(std::forward<G>(g)) {}
+
+  static void
+  invoke(void *record, context &ctx) {
+    std::invoke(static_cast<CommandRecord *>(record)->func, ctx);
+  }
+
+  static void
+  destroy(void *record) noexcept {
+    static_cast<CommandRecord *>(record)->~CommandRecord();
+  }
+
+  static constexpr CommandThunks<context> thunks = {
+      &invoke, std::is_trivially_destructible_v<F> ? nullptr : &destroy
+  };
+};
+
+/**
+Singly linked stream of type-erased commands. Dispatch goes through a static
+thunk table per command type instead of a vtable, and destruction is skipped
+entirely when only trivially destructible commands have been appended.
+
+The stream doesn't own any memory: storage for each record is provided by
+the caller and must remain valid until `clear()`.
+ */
+template <typename context> class CommandStream {
+public:
+  template <typename F> using Record = CommandRecord<context, std::remove_cvref_t<F>>;
+
+  template <typename F> static constexpr size_t record_size = sizeof(Record<F>);
+  template <typename F> static constexpr size_t record_alignment = alignof(Record<F>);
+
+  CommandStream() = default;
+  CommandStream(const CommandStream &) = delete;
+  CommandStream &operator=(const CommandStream &) = delete;
+
+  ~CommandStream() {
+    clear();
+  }
+
+  template <typename F>
+  void
+  append(void *storage, F &&func) {
+    using R = Record<F>;
+    auto record = new (storage) R(std::forward<F>(func));
+    tail_->next = &record->header;
+    tail_ = &record->header;
+    size_++;
+    if constexpr (!std::is_trivially_destructible_v<std::remove_cvref_t<F>>)
+      num_destructible_++;
+  }
+
+  void
+  execute(context &ctx) const {
+    for (auto cur = head_.next; cur; cur = cur->next)
+      cur->thunks->invoke(cur, ctx);
+  }
+
+  void
+  clear() noexcept {
+    if (num_destructible_) {
+      for (auto cur = head_.next; cur;) {
+        // the record may be destroyed by the call
+        auto next = cur->next;
+        if (auto destroy = cur->thunks->destroy)
+          destroy(cur);
+        cur = next;
+      }
+    }
+    head_.next = nullptr;
+    tail_ = &head_;
+    size_ = 0;
+    num_destructible_ = 0;
+  }
+
+  size_t
+  size() const {
+    return size_;
+  }
+
+  bool
+  empty() const {
+    return size_ == 0;
+  }
+
+private:
+  CommandHeader<context> head_{nullptr, nullptr};
+  CommandHeader<context> *tail_ = &head_;
+  size_t size_ = 0;
+  size_t num_destructible_ = 0;
+};
+
+} // namespace dxmt
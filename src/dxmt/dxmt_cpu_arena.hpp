@@ -0,0 +1,190 @@
+#pragma once
+
+#include "log/log.hpp"
+#include "thread.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+
+namespace dxmt {
+
+constexpr size_t kCPUArenaBlockSize = 0x40000; // 256KB
+constexpr size_t kCPUArenaMaxPooledBlocks = 64;
+
+struct alignas(16) CPUArenaBlock {
+  CPUArenaBlock *next;
+  size_t size;
+
+  char *
+  begin() {
+    return reinterpret_cast<char *>(this + 1);
+  }
+
+  char *
+  end() {
+    return begin() + size;
+  }
+};
+
+/**
+Process-wide free list of standard sized arena blocks, so that memory
+released by one arena is picked up by the next one that grows. Blocks larger
+than the standard size are never pooled.
+ */
+class CPUArenaBlockPool {
+public:
+  static CPUArenaBlockPool &
+  instance() {
+    // never destroyed: arenas may outlive static destruction
+    static CPUArenaBlockPool *pool = new CPUArenaBlockPool();
+    return *pool;
+  }
+
+  CPUArenaBlock *
+  acquire(size_t min_size) {
+    if (min_size <= kCPUArenaBlockSize) {
+      std::lock_guard<dxmt::mutex> lock(mutex_);
+      if (free_list_) {
+        auto block = free_list_;
+        free_list_ = block->next;
+        num_free_--;
+        block->next = nullptr;
+        return block;
+      }
+    }
+    size_t size = std::max(min_size, kCPUArenaBlockSize);
+    auto block = static_cast<CPUArenaBlock *>(malloc(sizeof(CPUArenaBlock) + size));
+    block->next = nullptr;
+    block->size = size;
+    return block;
+  }
+
+  void
+  release(CPUArenaBlock *block) {
+    while (block) {
+      auto next = block->next;
+      if (block->size == kCPUArenaBlockSize) {
+        std::lock_guard<dxmt::mutex> lock(mutex_);
+        if (num_free_ < kCPUArenaMaxPooledBlocks) {
+          block->next = free_list_;
+          free_list_ = block;
+          num_free_++;
+          block = next;
+          continue;
+        }
+      }
+      free(block);
+      block = next;
+    }
+  }
+
+private:
+  CPUArenaBlockPool() = default;
+
+  CPUArenaBlock *free_list_ = nullptr;
+  size_t num_free_ = 0;
+  dxmt::mutex mutex_;
+};
+
+/**
+Bump allocator over a chain of blocks. Allocations are never moved, and are
+all released at once by `reset()`. The first block is kept across resets, and
+any additional block goes back to the shared pool.
+
+Not thread-safe: `allocate` and `reset` must not race.
+ */
+class CPUArena {
+public:
+  CPUArena(const char *name) : name_(name) {}
+
+  CPUArena(const CPUArena &) = delete;
+  CPUArena &operator=(const CPUArena &) = delete;
+
+  ~CPUArena() {
+    CPUArenaBlockPool::instance().release(head_);
+  }
+
+  void *
+  allocate(size_t size, size_t alignment) {
+    auto aligned = align_ptr(cursor_, alignment);
+    if (aligned + size > limit_) {
+      grow(size + alignment);
+      aligned = align_ptr(cursor_, alignment);
+    }
+    allocated_ += (aligned + size) - cursor_;
+    cursor_ = aligned + size;
+    return aligned;
+  }
+
+  void
+  reset() {
+    if (allocated_ > high_water_mark_) {
+      high_water_mark_ = allocated_;
+      TRACE(name_, ": new high water mark ", high_water_mark_, " bytes in ", num_blocks_, " blocks");
+    }
+    if (head_) {
+      CPUArenaBlockPool::instance().release(head_->next);
+      head_->next = nullptr;
+      tail_ = head_;
+      cursor_ = head_->begin();
+      limit_ = head_->end();
+      num_blocks_ = 1;
+    }
+    allocated_ = 0;
+  }
+
+  bool
+  empty() const {
+    return allocated_ == 0;
+  }
+
+  /**
+  bytes allocated since the last reset, including alignment padding
+   */
+  size_t
+  allocated() const {
+    return allocated_;
+  }
+
+  size_t
+  high_water_mark() const {
+    return std::max(high_water_mark_, allocated_);
+  }
+
+  size_t
+  num_blocks() const {
+    return num_blocks_;
+  }
+
+private:
+  static char *
+  align_ptr(char *ptr, size_t alignment) {
+    return reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(ptr) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+  }
+
+  void
+  grow(size_t min_size) {
+    auto block = CPUArenaBlockPool::instance().acquire(min_size);
+    if (tail_)
+      tail_->next = block;
+    else
+      head_ = block;
+    tail_ = block;
+    cursor_ = block->begin();
+    limit_ = block->end();
+    num_blocks_++;
+  }
+
+  const char *name_;
+  CPUArenaBlock *head_ = nullptr;
+  CPUArenaBlock *tail_ = nullptr;
+  char *cursor_ = nullptr;
+  char *limit_ = nullptr;
+  size_t allocated_ = 0;
+  size_t high_water_mark_ = 0;
+  size_t num_blocks_ = 0;
+};
+
+} // namespace dxmt
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "Metal/MTLBuffer.hpp"
+#include "Metal/MTLComputeCommandEncoder.hpp"
+#include "Metal/MTLRenderCommandEncoder.hpp"
+#include "dxmt_argument_table_cache.hpp"
+#include "dxmt_placement_heap.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace dxmt {
+
+constexpr size_t kRenderEncoderStateMaxViewports = 16;
+
+/**
+Shadow of the dynamic state set on the current render encoder, so that calls
+setting a value identical to the previous one are dropped. It must be reset
+whenever a new render encoder is created, since nothing is inherited.
+ */
+class RenderEncoderState {
+public:
+  void
+  reset() {
+    valid_ = 0;
+  }
+
+  void
+  setDepthStencilState(MTL::RenderCommandEncoder *encoder, MTL::DepthStencilState *state) {
+    if (test(kDepthStencilState) && depth_stencil_state_ == state) {
+      filtered_++;
+      return;
+    }
+    encoder->setDepthStencilState(state);
+    depth_stencil_state_ = state;
+    valid_ |= kDepthStencilState;
+  }
+
+  void
+  setStencilReferenceValue(MTL::RenderCommandEncoder *encoder, uint32_t value) {
+    if (test(kStencilReference) && stencil_ref_ == value) {
+      filtered_++;
+      return;
+    }
+    encoder->setStencilReferenceValue(value);
+    stencil_ref_ = value;
+    valid_ |= kStencilReference;
+  }
+
+  void
+  setBlendColor(MTL::RenderCommandEncoder *encoder, float r, float g, float b, float a) {
+    float color[4] = {r, g, b, a};
+    if (test(kBlendColor) && memcmp(blend_color_, color, sizeof(color)) == 0) {
+      filtered_++;
+      return;
+    }
+    encoder->setBlendColor(r, g, b, a);
+    memcpy(blend_color_, color, sizeof(color));
+    valid_ |= kBlendColor;
+  }
+
+  /**
+  Return false if `state` is the rasterizer state object that has been set
+  last, otherwise record it and return true: the caller sets it up.
+   */
+  bool
+  updateRasterizerState(const void *state) {
+    if (test(kRasterizerState) && rasterizer_state_ == state) {
+      filtered_++;
+      return false;
+    }
+    rasterizer_state_ = state;
+    valid_ |= kRasterizerState;
+    return true;
+  }
+
+  void
+  setViewports(MTL::RenderCommandEncoder *encoder, const MTL::Viewport *viewports, size_t count) {
+    if (count > kRenderEncoderStateMaxViewports) {
+      encoder->setViewports(viewports, count);
+      valid_ &= ~kViewports;
+      return;
+    }
+    if (test(kViewports) && num_viewports_ == count &&
+        memcmp(viewports_, viewports, count * sizeof(MTL::Viewport)) == 0) {
+      filtered_++;
+      return;
+    }
+    encoder->setViewports(viewports, count);
+    memcpy(viewports_, viewports, count * sizeof(MTL::Viewport));
+    num_viewports_ = count;
+    valid_ |= kViewports;
+  }
+
+  void
+  setScissorRects(MTL::RenderCommandEncoder *encoder, const MTL::ScissorRect *rects, size_t count) {
+    if (count > kRenderEncoderStateMaxViewports) {
+      encoder->setScissorRects(rects, count);
+      valid_ &= ~kScissorRects;
+      return;
+    }
+    if (test(kScissorRects) && num_scissor_rects_ == count &&
+        memcmp(scissor_rects_, rects, count * sizeof(MTL::ScissorRect)) == 0) {
+      filtered_++;
+      return;
+    }
+    encoder->setScissorRects(rects, count);
+    memcpy(scissor_rects_, rects, count * sizeof(MTL::ScissorRect));
+    num_scissor_rects_ = count;
+    valid_ |= kScissorRects;
+  }
+
+  /**
+  number of calls dropped so far, not affected by `reset()`
+   */
+  uint64_t
+  filtered() const {
+    return filtered_;
+  }
+
+private:
+  enum : uint32_t {
+    kDepthStencilState = 1 << 0,
+    kStencilReference = 1 << 1,
+    kBlendColor = 1 << 2,
+    kRasterizerState = 1 << 3,
+    kViewports = 1 << 4,
+    kScissorRects = 1 << 5,
+  };
+
+  bool
+  test(uint32_t bit) const {
+    return valid_ & bit;
+  }
+
+  uint32_t valid_ = 0;
+  uint32_t stencil_ref_;
+  MTL::DepthStencilState *depth_stencil_state_;
+  const void *rasterizer_state_;
+  float blend_color_[4];
+  size_t num_viewports_;
+  size_t num_scissor_rects_;
+  MTL::Viewport viewports_[kRenderEncoderStateMaxViewports];
+  MTL::ScissorRect scissor_rects_[kRenderEncoderStateMaxViewports];
+  uint64_t filtered_ = 0;
+};
+
+/**
+Residency requests of the current encoder, grouped by usage and stages, so
+they can be made with a single `useResources` call per group right before a
+draw or dispatch. A resource requested twice with the same usage and stages
+is only passed once. Placement heaps are requested as a whole, for read-only
+access.
+ */
+class ResourceUsageBatch {
+public:
+  void
+  add(MTL::Resource *resource, MTL::ResourceUsage usage, MTL::RenderStages stages = 0) {
+    num_requests_++;
+    auto group = std::find_if(groups_.begin(), groups_.begin() + num_groups_, [=](const Group &group) {
+      return group.usage == usage && group.stages == stages;
+    });
+    if (group == groups_.begin() + num_groups_) {
+      if (num_groups_ == groups_.size())
+        groups_.emplace_back();
+      group = groups_.begin() + num_groups_++;
+      group->usage = usage;
+      group->stages = stages;
+    } else if (std::find(group->resources.begin(), group->resources.end(), resource) != group->resources.end()) {
+      return;
+    }
+    group->resources.push_back(resource);
+  }
+
+  void
+  add_heaps(PlacementHeapPool *pool, MTL::RenderStages stages = 0) {
+    num_requests_++;
+    heap_pool_ = pool;
+    heap_stages_ |= stages;
+  }
+
+  void
+  flush(MTL::RenderCommandEncoder *encoder) {
+    for (unsigned i = 0; i < num_groups_; i++) {
+      auto &group = groups_[i];
+      encoder->useResources(group.resources.data(), group.resources.size(), group.usage, group.stages);
+      group.resources.clear();
+    }
+    if (heap_pool_) {
+      heap_pool_->useHeaps(encoder, heap_stages_);
+      num_calls_++;
+      heap_pool_ = nullptr;
+      heap_stages_ = 0;
+    }
+    num_calls_ += num_groups_;
+    num_groups_ = 0;
+  }
+
+  void
+  flush(MTL::ComputeCommandEncoder *encoder) {
+    for (unsigned i = 0; i < num_groups_; i++) {
+      auto &group = groups_[i];
+      encoder->useResources(group.resources.data(), group.resources.size(), group.usage);
+      group.resources.clear();
+    }
+    if (heap_pool_) {
+      heap_pool_->useHeaps(encoder);
+      num_calls_++;
+      heap_pool_ = nullptr;
+      heap_stages_ = 0;
+    }
+    num_calls_ += num_groups_;
+    num_groups_ = 0;
+  }
+
+  /**
+  number of resources requested, and of `useResources`/`useHeaps` calls made
+  for them
+   */
+  std::pair<uint64_t, uint64_t>
+  statistics() const {
+    return {num_requests_, num_calls_};
+  }
+
+private:
+  struct Group {
+    MTL::ResourceUsage usage;
+    MTL::RenderStages stages;
+    std::vector<const MTL::Resource *> resources;
+  };
+
+  // groups are kept with their storage, only the first num_groups_ are in use
+  std::vector<Group> groups_;
+  size_t num_groups_ = 0;
+  PlacementHeapPool *heap_pool_ = nullptr;
+  MTL::RenderStages heap_stages_ = 0;
+  uint64_t num_requests_ = 0;
+  uint64_t num_calls_ = 0;
+};
+
+} // namespace dxmt
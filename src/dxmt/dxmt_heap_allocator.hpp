@@ -0,0 +1,285 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <unordered_map>
+#include <vector>
+
+namespace dxmt {
+
+constexpr uint64_t kHeapRangeInvalid = ~0ull;
+
+/**
+Placement of ranges within a heap of fixed size, independent of the device.
+
+Free ranges are kept in segregated lists: sizes are binned by power of 2, each
+split into 8 linear size classes, and a two-level bitmap tells which bins are
+non-empty (TLSF). A lookup takes the first range of the first non-empty bin
+whose sizes all fit, so it's O(1) regardless of fragmentation, at the cost of
+picking a range up to 12.5% larger than the best fit. Ranges also link to their
+neighbors by offset, to coalesce them on free.
+ */
+class HeapRangeAllocator {
+public:
+  HeapRangeAllocator(uint64_t size) : size_(size) {
+    std::fill(std::begin(free_heads_), std::end(free_heads_), kNone);
+    insertFree(newRange(0, size, kNone, kNone));
+  }
+
+  /**
+  Return the offset of a range of `size` bytes aligned to `alignment` (a power
+  of 2), or kHeapRangeInvalid if there isn't any.
+   */
+  uint64_t
+  allocate(uint64_t size, uint64_t alignment) {
+    if (!size || size > size_)
+      return kHeapRangeInvalid;
+    uint32_t index = findFree(size, alignment);
+    if (index == kNone)
+      return kHeapRangeInvalid;
+    removeFree(index);
+    uint64_t offset = alignUp(ranges_[index].offset, alignment);
+    // alignment padding and the remainder stay free
+    if (offset > ranges_[index].offset) {
+      uint32_t aligned = split(index, offset - ranges_[index].offset);
+      insertFree(index);
+      index = aligned;
+    }
+    if (ranges_[index].size > size)
+      insertFree(split(index, size));
+    allocated_ranges_.emplace(offset, index);
+    allocated_ += size;
+    return offset;
+  }
+
+  void
+  free(uint64_t offset, uint64_t size) {
+    auto it = allocated_ranges_.find(offset);
+    if (it == allocated_ranges_.end())
+      return;
+    uint32_t index = it->second;
+    allocated_ranges_.erase(it);
+    allocated_ -= size;
+    uint32_t next = ranges_[index].next;
+    if (next != kNone && ranges_[next].free) {
+      removeFree(next);
+      merge(index, next);
+    }
+    uint32_t prev = ranges_[index].prev;
+    if (prev != kNone && ranges_[prev].free) {
+      removeFree(prev);
+      merge(prev, index);
+      index = prev;
+    }
+    insertFree(index);
+  }
+
+  bool
+  empty() const {
+    return allocated_ == 0;
+  }
+
+  uint64_t
+  size() const {
+    return size_;
+  }
+
+  uint64_t
+  allocated() const {
+    return allocated_;
+  }
+
+  /**
+  size of the largest free range, regardless of alignment
+   */
+  uint64_t
+  largest_free_range() const {
+    if (!bin_bitmap_)
+      return 0;
+    unsigned bin = 63 - __builtin_clzll(bin_bitmap_);
+    unsigned size_class = (bin << kSizeClassBits) | (31 - __builtin_clz(class_bitmap_[bin]));
+    uint64_t largest = 0;
+    for (uint32_t index = free_heads_[size_class]; index != kNone; index = ranges_[index].next_free)
+      largest = std::max(largest, ranges_[index].size);
+    return largest;
+  }
+
+private:
+  static constexpr uint32_t kNone = ~0u;
+  static constexpr unsigned kSizeClassBits = 3;
+  static constexpr unsigned kSizeClassCount = 64 << kSizeClassBits;
+  // how many ranges of the exact size class are tried before looking up a larger one
+  static constexpr unsigned kMaxExactScan = 8;
+
+  struct Range {
+    uint64_t offset;
+    uint64_t size;
+    // neighbors by offset
+    uint32_t prev;
+    uint32_t next;
+    // within the list of its size class, if free
+    uint32_t prev_free;
+    uint32_t next_free;
+    bool free;
+  };
+
+  static uint64_t
+  alignUp(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+  }
+
+  /**
+  size class that `size` belongs to
+   */
+  static unsigned
+  sizeClass(uint64_t size) {
+    unsigned msb = 63 - __builtin_clzll(size);
+    if (msb < kSizeClassBits)
+      return size;
+    return ((msb - kSizeClassBits + 1) << kSizeClassBits) |
+           ((size >> (msb - kSizeClassBits)) & ((1u << kSizeClassBits) - 1));
+  }
+
+  /**
+  first size class whose ranges are all at least `size` bytes
+   */
+  static unsigned
+  sizeClassRoundUp(uint64_t size) {
+    unsigned msb = 63 - __builtin_clzll(size);
+    if (msb < kSizeClassBits)
+      return size;
+    return sizeClass(size + (1ull << (msb - kSizeClassBits)) - 1);
+  }
+
+  /**
+  first non-empty size class from `size_class`, or kNone
+   */
+  unsigned
+  findSizeClass(unsigned size_class) const {
+    unsigned bin = size_class >> kSizeClassBits;
+    uint32_t classes = class_bitmap_[bin] & (~0u << (size_class & ((1u << kSizeClassBits) - 1)));
+    if (!classes) {
+      uint64_t bins = bin + 1 < 64 ? bin_bitmap_ & (~0ull << (bin + 1)) : 0;
+      if (!bins)
+        return kNone;
+      bin = __builtin_ctzll(bins);
+      classes = class_bitmap_[bin];
+    }
+    return (bin << kSizeClassBits) | __builtin_ctz(classes);
+  }
+
+  bool
+  fits(uint32_t index, uint64_t size, uint64_t alignment) const {
+    auto &range = ranges_[index];
+    return alignUp(range.offset, alignment) + size <= range.offset + range.size;
+  }
+
+  uint32_t
+  findFree(uint64_t size, uint64_t alignment) const {
+    // a range of the exact size class may fit, but not all of them do
+    unsigned exact = sizeClass(size);
+    unsigned scanned = 0;
+    for (uint32_t index = free_heads_[exact]; index != kNone && scanned < kMaxExactScan;
+         index = ranges_[index].next_free, scanned++) {
+      if (fits(index, size, alignment))
+        return index;
+    }
+    // any range of these size classes fits once aligned
+    unsigned size_class = findSizeClass(sizeClassRoundUp(size + alignment - 1));
+    if (size_class != kNone)
+      return free_heads_[size_class];
+    // nearly exhausted: try every range that may still fit
+    for (size_class = findSizeClass(exact + 1); size_class != kNone; size_class = findSizeClass(size_class + 1)) {
+      for (uint32_t index = free_heads_[size_class]; index != kNone; index = ranges_[index].next_free) {
+        if (fits(index, size, alignment))
+          return index;
+      }
+    }
+    return kNone;
+  }
+
+  uint32_t
+  newRange(uint64_t offset, uint64_t size, uint32_t prev, uint32_t next) {
+    uint32_t index;
+    if (unused_.empty()) {
+      index = ranges_.size();
+      ranges_.emplace_back();
+    } else {
+      index = unused_.back();
+      unused_.pop_back();
+    }
+    ranges_[index] = {offset, size, prev, next, kNone, kNone, false};
+    return index;
+  }
+
+  /**
+  Keep the first `size` bytes in `index`, and return the rest as a new range
+   */
+  uint32_t
+  split(uint32_t index, uint64_t size) {
+    uint32_t rest =
+        newRange(ranges_[index].offset + size, ranges_[index].size - size, index, ranges_[index].next);
+    if (ranges_[rest].next != kNone)
+      ranges_[ranges_[rest].next].prev = rest;
+    ranges_[index].next = rest;
+    ranges_[index].size = size;
+    return rest;
+  }
+
+  /**
+  Absorb `next` into `index`, they must be neighbors
+   */
+  void
+  merge(uint32_t index, uint32_t next) {
+    ranges_[index].size += ranges_[next].size;
+    ranges_[index].next = ranges_[next].next;
+    if (ranges_[index].next != kNone)
+      ranges_[ranges_[index].next].prev = index;
+    unused_.push_back(next);
+  }
+
+  void
+  insertFree(uint32_t index) {
+    unsigned size_class = sizeClass(ranges_[index].size);
+    auto &range = ranges_[index];
+    range.free = true;
+    range.prev_free = kNone;
+    range.next_free = free_heads_[size_class];
+    if (range.next_free != kNone)
+      ranges_[range.next_free].prev_free = index;
+    free_heads_[size_class] = index;
+    class_bitmap_[size_class >> kSizeClassBits] |= 1u << (size_class & ((1u << kSizeClassBits) - 1));
+    bin_bitmap_ |= 1ull << (size_class >> kSizeClassBits);
+  }
+
+  void
+  removeFree(uint32_t index) {
+    unsigned size_class = sizeClass(ranges_[index].size);
+    auto &range = ranges_[index];
+    range.free = false;
+    if (range.prev_free != kNone)
+      ranges_[range.prev_free].next_free = range.next_free;
+    else
+      free_heads_[size_class] = range.next_free;
+    if (range.next_free != kNone)
+      ranges_[range.next_free].prev_free = range.prev_free;
+    if (free_heads_[size_class] == kNone) {
+      auto &classes = class_bitmap_[size_class >> kSizeClassBits];
+      classes &= ~(1u << (size_class & ((1u << kSizeClassBits) - 1)));
+      if (!classes)
+        bin_bitmap_ &= ~(1ull << (size_class >> kSizeClassBits));
+    }
+  }
+
+  uint64_t size_;
+  uint64_t allocated_ = 0;
+  std::vector<Range> ranges_;
+  std::vector<uint32_t> unused_;
+  std::unordered_map<uint64_t, uint32_t> allocated_ranges_;
+  uint64_t bin_bitmap_ = 0;
+  uint8_t class_bitmap_[64] = {};
+  uint32_t free_heads_[kSizeClassCount];
+};
+
+} // namespace dxmt
@@ -0,0 +1,148 @@
+#include "dxmt_placement_heap.hpp"
+#include "log/log.hpp"
+#include <algorithm>
+#include <mutex>
+
+namespace dxmt {
+
+namespace {
+
+constexpr MTL::ResourceOptions kStorageModeMask = 0xf0;
+constexpr MTL::ResourceOptions kHazardTrackingModeMask = 0x300;
+
+MTL::ResourceOptions
+normalize_options(MTL::ResourceOptions options) {
+  // standalone resources are tracked by default, but resources of a heap inherit its mode
+  if (!(options & kHazardTrackingModeMask))
+    options |= MTL::ResourceHazardTrackingModeTracked;
+  return options;
+}
+
+} // namespace
+
+MTL::Buffer *
+PlacementHeapPool::newBuffer(size_t length, MTL::ResourceOptions options, PlacementHeapAllocation *pAllocation) {
+  if (!enabled || (options & kStorageModeMask) != MTL::ResourceStorageModePrivate)
+    return nullptr;
+  options = normalize_options(options);
+  if (!allocate(options, device->heapBufferSizeAndAlign(length, options), pAllocation))
+    return nullptr;
+  return pAllocation->heap->heap->newBuffer(length, options, pAllocation->offset);
+}
+
+MTL::Texture *
+PlacementHeapPool::newTexture(MTL::TextureDescriptor *desc, PlacementHeapAllocation *pAllocation) {
+  if (!enabled || (desc->resourceOptions() & kStorageModeMask) != MTL::ResourceStorageModePrivate)
+    return nullptr;
+  desc->setResourceOptions(normalize_options(desc->resourceOptions()));
+  if (!allocate(desc->resourceOptions(), device->heapTextureSizeAndAlign(desc), pAllocation))
+    return nullptr;
+  return pAllocation->heap->heap->newTexture(desc, pAllocation->offset);
+}
+
+bool
+PlacementHeapPool::allocate(
+    MTL::ResourceOptions options, MTL::SizeAndAlign size_align, PlacementHeapAllocation *pAllocation
+) {
+  if (size_align.size > kPlacementHeapMaxResourceSize)
+    return false;
+  std::lock_guard<dxmt::mutex> lock(mutex);
+  for (auto &heap : heaps) {
+    if (heap->options != options || heap->ranges.largest_free_range() < size_align.size)
+      continue;
+    auto offset = heap->ranges.allocate(size_align.size, size_align.align);
+    if (offset == kHeapRangeInvalid)
+      continue;
+    *pAllocation = {heap.get(), offset, size_align.size};
+    return true;
+  }
+  auto desc = transfer(MTL::HeapDescriptor::alloc()->init());
+  desc->setType(MTL::HeapTypePlacement);
+  desc->setSize(kPlacementHeapSize);
+  desc->setResourceOptions(options);
+  auto heap = transfer(device->newHeap(desc));
+  if (!heap) {
+    WARN("placement heap: failed to allocate a heap");
+    return false;
+  }
+  auto &entry = heaps.emplace_back(new PlacementHeap{std::move(heap), options, HeapRangeAllocator(kPlacementHeapSize)});
+  TRACE("placement heap: ", heaps.size(), " heaps");
+  auto offset = entry->ranges.allocate(size_align.size, size_align.align);
+  if (offset == kHeapRangeInvalid)
+    return false;
+  *pAllocation = {entry.get(), offset, size_align.size};
+  return true;
+}
+
+void
+PlacementHeapPool::release(PlacementHeapAllocation *pAllocation) {
+  if (!pAllocation->heap)
+    return;
+  std::lock_guard<dxmt::mutex> lock(mutex);
+  releaseLocked(*pAllocation);
+  pAllocation->heap = nullptr;
+}
+
+void
+PlacementHeapPool::releaseAfter(PlacementHeapAllocation *pAllocation, uint64_t seq_id) {
+  if (!pAllocation->heap)
+    return;
+  std::lock_guard<dxmt::mutex> lock(mutex);
+  deferred.emplace_back(seq_id, *pAllocation);
+  pAllocation->heap = nullptr;
+}
+
+void
+PlacementHeapPool::free_blocks(uint64_t coherent_id) {
+  std::lock_guard<dxmt::mutex> lock(mutex);
+  // pushed from any thread, not necessarily in order
+  auto completed = std::partition(deferred.begin(), deferred.end(), [=](auto &entry) {
+    return entry.first > coherent_id;
+  });
+  for (auto it = completed; it != deferred.end(); it++)
+    releaseLocked(it->second);
+  deferred.erase(completed, deferred.end());
+}
+
+void
+PlacementHeapPool::releaseLocked(PlacementHeapAllocation &allocation) {
+  auto released = allocation.heap;
+  released->ranges.free(allocation.offset, allocation.size);
+  if (!released->ranges.empty())
+    return;
+  // keep one empty heap per group, for the next resources to come
+  bool spare = std::any_of(heaps.begin(), heaps.end(), [=](auto &heap) {
+    return heap.get() != released && heap->options == released->options && heap->ranges.empty();
+  });
+  if (spare) {
+    heaps.erase(std::find_if(heaps.begin(), heaps.end(), [=](auto &heap) { return heap.get() == released; }));
+    TRACE("placement heap: ", heaps.size(), " heaps");
+  }
+}
+
+void
+PlacementHeapPool::useHeaps(MTL::RenderCommandEncoder *encoder, MTL::RenderStages stages) {
+  std::lock_guard<dxmt::mutex> lock(mutex);
+  collectHeaps();
+  if (!heaps_to_use.empty())
+    encoder->useHeaps(heaps_to_use.data(), heaps_to_use.size(), stages);
+}
+
+void
+PlacementHeapPool::useHeaps(MTL::ComputeCommandEncoder *encoder) {
+  std::lock_guard<dxmt::mutex> lock(mutex);
+  collectHeaps();
+  if (!heaps_to_use.empty())
+    encoder->useHeaps(heaps_to_use.data(), heaps_to_use.size());
+}
+
+void
+PlacementHeapPool::collectHeaps() {
+  heaps_to_use.clear();
+  for (auto &heap : heaps) {
+    if (!heap->ranges.empty())
+      heaps_to_use.push_back(heap->heap.ptr());
+  }
+}
+
+} // namespace dxmt
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "Metal/MTLBuffer.hpp"
+#include "Metal/MTLComputeCommandEncoder.hpp"
+#include "Metal/MTLDevice.hpp"
+#include "Metal/MTLHeap.hpp"
+#include "Metal/MTLRenderCommandEncoder.hpp"
+#include "Metal/MTLTexture.hpp"
+#include "dxmt_heap_allocator.hpp"
+#include "objc_pointer.hpp"
+#include "thread.hpp"
+#include <memory>
+#include <vector>
+
+namespace dxmt {
+
+constexpr size_t kPlacementHeapSize = 0x4000000;              // 64MB
+constexpr size_t kPlacementHeapMaxResourceSize = 0x1000000;   // 16MB
+
+struct PlacementHeap {
+  Obj<MTL::Heap> heap;
+  // storage, cache and hazard tracking modes shared by resources of the heap
+  MTL::ResourceOptions options;
+  HeapRangeAllocator ranges;
+};
+
+struct PlacementHeapAllocation {
+  PlacementHeap *heap = nullptr;
+  uint64_t offset;
+  uint64_t size;
+};
+
+/**
+Placement heaps that GPU-only resources are created from, instead of being
+allocated one by one. Heaps are grouped by resource options, and only private
+storage is supported. A heap is released once it's empty, except the last one
+of its group.
+
+A resource must not be used by GPU anymore when its allocation is released,
+since its memory is then reused by the next one.
+ */
+class PlacementHeapPool {
+public:
+  PlacementHeapPool(MTL::Device *device) : device(device) {}
+
+  /**
+  Return null if the buffer can't be placed in a heap, in which case it's up
+  to the caller to allocate it on its own.
+   */
+  MTL::Buffer *newBuffer(size_t length, MTL::ResourceOptions options, PlacementHeapAllocation *pAllocation);
+
+  /**
+  Same as above, the options of the descriptor are used
+   */
+  MTL::Texture *newTexture(MTL::TextureDescriptor *desc, PlacementHeapAllocation *pAllocation);
+
+  void release(PlacementHeapAllocation *pAllocation);
+
+  /**
+  Release once the chunk `seq_id` is completed, for a resource that is used by
+  GPU without holding a reference (e.g. by its initial upload)
+   */
+  void releaseAfter(PlacementHeapAllocation *pAllocation, uint64_t seq_id);
+
+  /**
+  Called once chunks up to `coherent_id` are completed
+   */
+  void free_blocks(uint64_t coherent_id);
+
+  /**
+  Make every heap resident for the encoder, for read-only access. Empty heaps
+  are skipped: no resource in use can be placed in them.
+   */
+  void useHeaps(MTL::RenderCommandEncoder *encoder, MTL::RenderStages stages);
+  void useHeaps(MTL::ComputeCommandEncoder *encoder);
+
+  /**
+  Whether read-only residency of the resource is covered by useHeaps()
+   */
+  bool
+  isHeapResident(const PlacementHeapAllocation &allocation) const {
+    return heap_residency && allocation.heap;
+  }
+
+  bool enabled = true;
+  bool heap_residency = true;
+
+private:
+  bool allocate(MTL::ResourceOptions options, MTL::SizeAndAlign size_align, PlacementHeapAllocation *pAllocation);
+  void collectHeaps();
+  void releaseLocked(PlacementHeapAllocation &allocation);
+
+  MTL::Device *device;
+  dxmt::mutex mutex;
+  std::vector<std::unique_ptr<PlacementHeap>> heaps;
+  std::vector<std::pair<uint64_t, PlacementHeapAllocation>> deferred;
+  // only accessed by the encode thread, with the mutex held
+  std::vector<const MTL::Heap *> heaps_to_use;
+};
+
+} // namespace dxmt
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "thread.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace dxmt {
+
+/**
+Insert-only hash map with lock-free lookup.
+
+Entries are never removed or moved once published, so a pointer returned by
+`find` stays valid for the lifetime of the map. Writers are serialized by a
+mutex and publish new chain heads with release semantics; readers only load
+atomics with acquire semantics and never block.
+
+When the load factor exceeds 1, the bucket array is rebuilt and swapped in.
+Retired bucket arrays are kept alive until the map is destroyed, because a
+concurrent reader may still be walking one of them.
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>>
+class ConcurrentHashMap {
+  struct Entry {
+    Key key;
+    Value value;
+    size_t hash;
+    Entry *next_entry; // insertion list, owned by the map
+  };
+
+  struct Link {
+    Entry *entry;
+    Link *next;
+  };
+
+  struct Table {
+    size_t mask;
+    std::unique_ptr<std::atomic<Link *>[]> buckets;
+    Table *retired;
+
+    Table(size_t size, Table *retired) : mask(size - 1), buckets(new std::atomic<Link *>[size]), retired(retired) {
+      for (size_t i = 0; i < size; i++)
+        buckets[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~Table() {
+      for (size_t i = 0; i <= mask; i++) {
+        Link *link = buckets[i].load(std::memory_order_relaxed);
+        while (link) {
+          Link *next = link->next;
+          delete link;
+          link = next;
+        }
+      }
+    }
+  };
+
+public:
+  ConcurrentHashMap(size_t initial_size = 256) {
+    size_t size = 1;
+    while (size < initial_size)
+      size <<= 1;
+    table_.store(new Table(size, nullptr), std::memory_order_relaxed);
+  }
+
+  ~ConcurrentHashMap() {
+    Table *table = table_.load(std::memory_order_relaxed);
+    while (table) {
+      Table *retired = table->retired;
+      delete table;
+      table = retired;
+    }
+    Entry *entry = entries_;
+    while (entry) {
+      Entry *next = entry->next_entry;
+      delete entry;
+      entry = next;
+    }
+  }
+
+  ConcurrentHashMap(const ConcurrentHashMap &) = delete;
+  ConcurrentHashMap &operator=(const ConcurrentHashMap &) = delete;
+
+  /**
+  Lock-free. Returns nullptr if the key is not present.
+   */
+  Value *
+  find(const Key &key) const {
+    return find_with_hash(key, Hash{}(key));
+  }
+
+  /**
+  Returns the value associated with `key`. If absent, `create()` is invoked
+  exactly once (under the writer lock) to construct it. The boolean is true if
+  this call inserted the value.
+   */
+  template <typename CreateFn>
+  std::pair<Value &, bool>
+  get_or_insert(const Key &key, CreateFn &&create) {
+    size_t hash = Hash{}(key);
+    if (auto value = find_with_hash(key, hash))
+      return {*value, false};
+
+    std::lock_guard<dxmt::mutex> lock(mutex_);
+    if (auto value = find_with_hash(key, hash))
+      return {*value, false};
+
+    Entry *entry = new Entry{key, create(), hash, entries_};
+    entries_ = entry;
+
+    Table *table = table_.load(std::memory_order_relaxed);
+    if (++size_ > table->mask + 1) {
+      table = rehash(table);
+    }
+    insert_link(table, entry);
+    return {entry->value, true};
+  }
+
+  size_t
+  size() const {
+    std::lock_guard<dxmt::mutex> lock(mutex_);
+    return size_;
+  }
+
+private:
+  Value *
+  find_with_hash(const Key &key, size_t hash) const {
+    Table *table = table_.load(std::memory_order_acquire);
+    Link *link = table->buckets[hash & table->mask].load(std::memory_order_acquire);
+    while (link) {
+      Entry *entry = link->entry;
+      if (entry->hash == hash && Equal{}(entry->key, key))
+        return &entry->value;
+      link = link->next;
+    }
+    return nullptr;
+  }
+
+  static void
+  insert_link(Table *table, Entry *entry) {
+    auto &bucket = table->buckets[entry->hash & table->mask];
+    bucket.store(new Link{entry, bucket.load(std::memory_order_relaxed)}, std::memory_order_release);
+  }
+
+  Table *
+  rehash(Table *old_table) {
+    Table *table = new Table((old_table->mask + 1) << 1, old_table);
+    // the entry being inserted is linked by the caller
+    for (Entry *entry = entries_->next_entry; entry; entry = entry->next_entry)
+      insert_link(table, entry);
+    table_.store(table, std::memory_order_release);
+    return table;
+  }
+
+  std::atomic<Table *> table_;
+  Entry *entries_ = nullptr;
+  size_t size_ = 0;
+  mutable dxmt::mutex mutex_;
+};
+
+} // namespace dxmt
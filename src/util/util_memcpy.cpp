@@ -0,0 +1,254 @@
+#include "util_memcpy.hpp"
+#include "thread.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace dxmt {
+
+namespace {
+
+// below that, the fence and alignment prologue are not worth it
+constexpr size_t kStreamingMinSize = 0x1000;
+
+void
+copy_streaming_unfenced(char *dst, const char *src, size_t size) {
+#if defined(__SSE2__)
+  size_t head = std::min(size, (size_t)(-(uintptr_t)dst & 15));
+  memcpy(dst, src, head);
+  dst += head;
+  src += head;
+  size -= head;
+  if (((uintptr_t)src & 15) == 0) {
+    for (; size >= 64; size -= 64, dst += 64, src += 64) {
+      __m128i a = _mm_load_si128((const __m128i *)src);
+      __m128i b = _mm_load_si128((const __m128i *)(src + 16));
+      __m128i c = _mm_load_si128((const __m128i *)(src + 32));
+      __m128i d = _mm_load_si128((const __m128i *)(src + 48));
+      _mm_stream_si128((__m128i *)dst, a);
+      _mm_stream_si128((__m128i *)(dst + 16), b);
+      _mm_stream_si128((__m128i *)(dst + 32), c);
+      _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+  } else {
+    for (; size >= 64; size -= 64, dst += 64, src += 64) {
+      __m128i a = _mm_loadu_si128((const __m128i *)src);
+      __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+      __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+      __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+      _mm_stream_si128((__m128i *)dst, a);
+      _mm_stream_si128((__m128i *)(dst + 16), b);
+      _mm_stream_si128((__m128i *)(dst + 32), c);
+      _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+  }
+  for (; size >= 16; size -= 16, dst += 16, src += 16) {
+    _mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+  }
+  memcpy(dst, src, size);
+#else
+  memcpy(dst, src, size);
+#endif
+}
+
+void
+copy_regular(char *dst, const char *src, size_t size) {
+  memcpy(dst, src, size);
+}
+
+void
+fence_streaming() {
+#if defined(__SSE2__)
+  _mm_sfence();
+#endif
+}
+
+struct RowCopy {
+  char *dst;
+  size_t dst_bytes_per_row;
+  size_t dst_bytes_per_image;
+  const char *src;
+  size_t src_bytes_per_row;
+  size_t src_bytes_per_image;
+  size_t bytes_per_row;
+  size_t rows;
+  bool streaming;
+
+  /**
+  Copy rows [first, last) counted across images. Not fenced.
+   */
+  void
+  operator()(size_t first, size_t last) const {
+    auto copy = streaming ? copy_streaming_unfenced : copy_regular;
+    if (dst_bytes_per_row == bytes_per_row && src_bytes_per_row == bytes_per_row) {
+      // rows of an image are contiguous on both sides
+      while (first < last) {
+        size_t image = first / rows, row = first % rows;
+        size_t count = std::min(last - first, rows - row);
+        copy(
+            dst + image * dst_bytes_per_image + row * bytes_per_row,
+            src + image * src_bytes_per_image + row * bytes_per_row, count * bytes_per_row
+        );
+        first += count;
+      }
+      return;
+    }
+    for (; first < last; first++) {
+      size_t image = first / rows, row = first % rows;
+      copy(
+          dst + image * dst_bytes_per_image + row * dst_bytes_per_row,
+          src + image * src_bytes_per_image + row * src_bytes_per_row, bytes_per_row
+      );
+    }
+  }
+};
+
+/**
+Workers copy_rows() splits large copies across. They are started on first
+use and live until the process exits, so a copy doesn't pay for creating and
+joining threads.
+ */
+class CopyWorkerPool {
+public:
+  static CopyWorkerPool &
+  instance() {
+    // never destroyed: workers may still be waiting when the module unloads
+    static CopyWorkerPool *pool = new CopyWorkerPool();
+    return *pool;
+  }
+
+  /**
+  Copy rows [first, last) on a worker. Once `wait()` returns, stores of every
+  range submitted with `pending` are visible.
+   */
+  void
+  submit(const RowCopy *copy, size_t first, size_t last, size_t *pending) {
+    std::lock_guard<dxmt::mutex> lock(mutex);
+    jobs.push_back({copy, first, last, pending});
+    job_ready.notify_one();
+  }
+
+  void
+  wait(size_t *pending) {
+    std::unique_lock<dxmt::mutex> lock(mutex);
+    job_done.wait(lock, [=]() { return *pending == 0; });
+  }
+
+private:
+  struct Job {
+    const RowCopy *copy;
+    size_t first;
+    size_t last;
+    size_t *pending;
+  };
+
+  CopyWorkerPool() {
+    for (size_t i = 1; i < kCopyRowsMaxThreads; i++) {
+      dxmt::thread worker([this]() { run(); });
+      worker.detach();
+    }
+  }
+
+  void
+  run() {
+    std::unique_lock<dxmt::mutex> lock(mutex);
+    for (;;) {
+      job_ready.wait(lock, [this]() { return !jobs.empty(); });
+      Job job = jobs.front();
+      jobs.pop_front();
+      lock.unlock();
+      (*job.copy)(job.first, job.last);
+      if (job.copy->streaming)
+        fence_streaming();
+      lock.lock();
+      if (--*job.pending == 0)
+        job_done.notify_all();
+    }
+  }
+
+  dxmt::mutex mutex;
+  dxmt::condition_variable job_ready;
+  dxmt::condition_variable job_done;
+  std::deque<Job> jobs;
+};
+
+} // namespace
+
+void
+memcpy_streaming(void *dst, const void *src, size_t size) {
+  if (size < kStreamingMinSize) {
+    memcpy(dst, src, size);
+    return;
+  }
+  copy_streaming_unfenced((char *)dst, (const char *)src, size);
+  fence_streaming();
+}
+
+void
+copy_rows(
+    const LinearLayout &dst, const ConstLinearLayout &src, size_t bytes_per_row, size_t rows, size_t images,
+    bool streaming
+) {
+  if (!bytes_per_row || !rows || !images)
+    return;
+  size_t total = bytes_per_row * rows * images;
+  streaming = streaming && total >= kStreamingMinSize;
+  size_t dst_bytes_per_image = images > 1 ? dst.bytes_per_image : 0;
+  size_t src_bytes_per_image = images > 1 ? src.bytes_per_image : 0;
+
+  if (dst.bytes_per_row == bytes_per_row && src.bytes_per_row == bytes_per_row &&
+      (images == 1 || (dst_bytes_per_image == bytes_per_row * rows && src_bytes_per_image == bytes_per_row * rows)) &&
+      total < kCopyRowsParallelThreshold) {
+    // fully contiguous
+    if (streaming)
+      memcpy_streaming(dst.data, src.data, total);
+    else
+      memcpy(dst.data, src.data, total);
+    return;
+  }
+
+  RowCopy copy{
+      (char *)dst.data,
+      dst.bytes_per_row,
+      dst_bytes_per_image,
+      (const char *)src.data,
+      src.bytes_per_row,
+      src_bytes_per_image,
+      bytes_per_row,
+      rows,
+      streaming
+  };
+  size_t total_rows = rows * images;
+  size_t num_threads = 1;
+  if (total >= kCopyRowsParallelThreshold) {
+    num_threads = std::min<size_t>(
+        {kCopyRowsMaxThreads, (size_t)dxmt::thread::hardware_concurrency(), total_rows,
+         total / (kCopyRowsParallelThreshold / kCopyRowsMaxThreads)}
+    );
+    num_threads = std::max<size_t>(num_threads, 1);
+  }
+  if (num_threads == 1) {
+    copy(0, total_rows);
+  } else {
+    // the calling thread takes the first range
+    auto &pool = CopyWorkerPool::instance();
+    size_t rows_per_thread = (total_rows + num_threads - 1) / num_threads;
+    size_t num_jobs = std::min(num_threads, (total_rows + rows_per_thread - 1) / rows_per_thread) - 1;
+    // only accessed by workers once submitted
+    size_t pending = num_jobs;
+    for (size_t i = 1; i <= num_jobs; i++) {
+      size_t first = i * rows_per_thread, last = std::min(total_rows, first + rows_per_thread);
+      pool.submit(&copy, first, last, &pending);
+    }
+    copy(0, std::min(total_rows, rows_per_thread));
+    pool.wait(&pending);
+  }
+  if (streaming)
+    fence_streaming();
+}
+
+} // namespace dxmt
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+
+namespace dxmt {
+
+/**
+Copies from this size on are split across worker threads
+ */
+constexpr size_t kCopyRowsParallelThreshold = 0x1000000; // 16MB
+constexpr size_t kCopyRowsMaxThreads = 4;
+
+/**
+Copy `size` bytes with non-temporal stores, for a destination in
+write-combined memory that is not going to be read by CPU. Small copies fall
+back to memcpy.
+ */
+void memcpy_streaming(void *dst, const void *src, size_t size);
+
+/**
+Layout of linear texture data: `bytes_per_image` is ignored if there is only
+one image.
+ */
+struct LinearLayout {
+  void *data;
+  size_t bytes_per_row;
+  size_t bytes_per_image;
+};
+
+struct ConstLinearLayout {
+  const void *data;
+  size_t bytes_per_row;
+  size_t bytes_per_image;
+};
+
+/**
+Copy `images` images of `rows` rows of `bytes_per_row` bytes between linear
+layouts with different pitches. Block-compressed data is copied by rows of
+blocks. Pass `streaming` if the destination is write-combined memory.
+ */
+void copy_rows(
+    const LinearLayout &dst, const ConstLinearLayout &src, size_t bytes_per_row, size_t rows, size_t images,
+    bool streaming
+);
+
+} // namespace dxmt
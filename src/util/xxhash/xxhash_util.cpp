@@ -0,0 +1,31 @@
+#define XXH_STATIC_LINKING_ONLY
+#define XXH_IMPLEMENTATION
+#include "xxhash.h"
+#include "xxhash_util.hpp"
+
+namespace dxmt {
+
+std::string Xxh3Hash::toString() const {
+  static const char nibbles[] = {'0', '1', '2', '3', '4', '5', '6', '7',
+                                 '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
+
+  XXH128_canonical_t canonical;
+  XXH128_canonicalFromHash(&canonical, {m_low64, m_high64});
+
+  std::string result;
+  result.resize(2 * sizeof(canonical.digest));
+
+  for (uint32_t i = 0; i < sizeof(canonical.digest); i++) {
+    result.at(2 * i + 0) = nibbles[(canonical.digest[i] >> 4) & 0xF];
+    result.at(2 * i + 1) = nibbles[(canonical.digest[i] >> 0) & 0xF];
+  }
+
+  return result;
+}
+
+Xxh3Hash Xxh3Hash::compute(const void *data, size_t size) {
+  auto hash = XXH3_128bits(data, size);
+  return Xxh3Hash(hash.low64, hash.high64);
+}
+
+} // namespace dxmt
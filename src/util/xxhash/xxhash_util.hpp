@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace dxmt {
+
+/**
+128-bit XXH3 digest. Not cryptographic, but collision resistant enough for
+content de-duplication of shaders and compiled artifacts.
+ */
+class Xxh3Hash {
+
+public:
+  Xxh3Hash() {}
+  Xxh3Hash(uint64_t low64, uint64_t high64) : m_low64(low64), m_high64(high64) {}
+
+  std::string toString() const;
+
+  uint64_t low64() const { return m_low64; }
+
+  uint64_t high64() const { return m_high64; }
+
+  bool operator==(const Xxh3Hash &other) const {
+    return m_low64 == other.m_low64 && m_high64 == other.m_high64;
+  }
+
+  bool operator!=(const Xxh3Hash &other) const {
+    return !this->operator==(other);
+  }
+
+  static Xxh3Hash compute(const void *data, size_t size);
+
+  template <typename T> static Xxh3Hash compute(const T &data) {
+    return compute(&data, sizeof(T));
+  }
+
+private:
+  uint64_t m_low64 = 0;
+  uint64_t m_high64 = 0;
+};
+
+} // namespace dxmt
+
+namespace std {
+template <> struct hash<dxmt::Xxh3Hash> {
+  size_t operator()(const dxmt::Xxh3Hash &v) const noexcept {
+    return v.low64();
+  };
+};
+} // namespace std
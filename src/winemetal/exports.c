@@ -52,4 +52,6 @@ ASM_FORWARD(SM50CompileTessellationPipelineVertex, 44)
 ASM_FORWARD(SM50CompileTessellationPipelineHull, 45)
 ASM_FORWARD(SM50CompileTessellationPipelineDomain, 46)
 ASM_FORWARD(__pthread_set_qos_class_self_np, 47)
+ASM_FORWARD(winemetal_create_bitcode_data, 48)
+ASM_FORWARD(winemetal_create_unowned_data, 49)
 extern void *__wine_unixlib_handle;
\ No newline at end of file
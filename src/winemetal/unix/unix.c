@@ -31,6 +31,8 @@ struct macdrv_functions_t
 };
 
 static int winemetal_unix_init();
+static dispatch_data_t winemetal_create_bitcode_data(SM50CompiledBitcode *pBitcode);
+static dispatch_data_t winemetal_create_unowned_data(const void *buffer, size_t size);
 
 const void *__wine_unix_call_funcs[] = {
     &objc_lookUpClass,
@@ -90,6 +92,8 @@ const void *__wine_unix_call_funcs[] = {
     &SM50CompileTessellationPipelineHull,
     &SM50CompileTessellationPipelineDomain,
     &pthread_set_qos_class_self_np,
+    &winemetal_create_bitcode_data,
+    &winemetal_create_unowned_data,
 };
 // wow64: things become funny
 
@@ -129,4 +133,18 @@ static int winemetal_unix_init() {
 
 fail:
     return 1;
-};
\ No newline at end of file
+};
+
+static dispatch_data_t winemetal_create_bitcode_data(SM50CompiledBitcode *pBitcode) {
+    struct MTL_SHADER_BITCODE bitcode;
+    SM50GetCompiledBitcode(pBitcode, &bitcode);
+    // no copy: the bitcode is freed when the last reference to the data goes away
+    return dispatch_data_create(bitcode.Data, bitcode.Size, NULL, ^{
+        SM50DestroyBitcode(pBitcode);
+    });
+}
+
+static dispatch_data_t winemetal_create_unowned_data(const void *buffer, size_t size) {
+    // a non-default destructor keeps dispatch_data_create from copying the buffer
+    return dispatch_data_create(buffer, size, NULL, ^{});
+}
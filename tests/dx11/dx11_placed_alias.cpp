@@ -0,0 +1,192 @@
+#include <cstdio>
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define UNICODE
+#include <windows.h>
+#include <d3d11_1.h>
+#include <d3dcompiler.h>
+
+#include <assert.h>
+#include <vector>
+
+// GPU-only buffers are placed in heaps: the memory of a released buffer must
+// not be reused while commands using it are still in flight.
+
+static const char shaderSource[] = R"(
+StructuredBuffer<uint> src : register(t0);
+RWStructuredBuffer<uint> dst : register(u0);
+
+[numthreads(64, 1, 1)]
+void cs_main(uint id : SV_DispatchThreadID)
+{
+    // keep the GPU busy, so that the source is released before it's read.
+    // every element has the same value
+    uint value = 0;
+    for (uint i = 0; i < 4096; i++)
+        value = max(value, src[(id + i) & 65535]);
+    dst[id] = value;
+}
+)";
+
+static const UINT NumElements = 65536;
+
+static ID3D11Buffer *CreateSource(ID3D11Device *device, UINT pattern)
+{
+    std::vector<UINT> data(NumElements, pattern);
+    D3D11_BUFFER_DESC desc = {};
+    desc.ByteWidth = NumElements * sizeof(UINT);
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+    desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+    desc.StructureByteStride = sizeof(UINT);
+    D3D11_SUBRESOURCE_DATA init = { data.data() };
+    ID3D11Buffer *buffer;
+    HRESULT hResult = device->CreateBuffer(&desc, &init, &buffer);
+    assert(SUCCEEDED(hResult));
+    return buffer;
+}
+
+static ID3D11ShaderResourceView *CreateSRV(ID3D11Device *device, ID3D11Buffer *buffer)
+{
+    D3D11_SHADER_RESOURCE_VIEW_DESC desc = {};
+    desc.Format = DXGI_FORMAT_UNKNOWN;
+    desc.ViewDimension = D3D11_SRV_DIMENSION_BUFFER;
+    desc.Buffer.NumElements = NumElements;
+    ID3D11ShaderResourceView *srv;
+    HRESULT hResult = device->CreateShaderResourceView(buffer, &desc, &srv);
+    assert(SUCCEEDED(hResult));
+    return srv;
+}
+
+static UINT CountMismatches(ID3D11Device *device, ID3D11DeviceContext *context, ID3D11Buffer *result, UINT expected)
+{
+    D3D11_BUFFER_DESC desc = {};
+    result->GetDesc(&desc);
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.BindFlags = 0;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    ID3D11Buffer *staging;
+    HRESULT hResult = device->CreateBuffer(&desc, nullptr, &staging);
+    assert(SUCCEEDED(hResult));
+    context->CopyResource(staging, result);
+
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    hResult = context->Map(staging, 0, D3D11_MAP_READ, 0, &mapped);
+    assert(SUCCEEDED(hResult));
+    UINT mismatches = 0;
+    for (UINT i = 0; i < NumElements; i++)
+        mismatches += ((UINT *)mapped.pData)[i] != expected;
+    context->Unmap(staging, 0);
+    staging->Release();
+    return mismatches;
+}
+
+int main()
+{
+    ID3D11Device *device;
+    ID3D11DeviceContext *context;
+    {
+        D3D_FEATURE_LEVEL featureLevels[] = { D3D_FEATURE_LEVEL_11_0 };
+        HRESULT hResult = D3D11CreateDevice(0, D3D_DRIVER_TYPE_HARDWARE,
+                                            0, 0,
+                                            featureLevels, ARRAYSIZE(featureLevels),
+                                            D3D11_SDK_VERSION, &device,
+                                            0, &context);
+        if(FAILED(hResult)){
+            printf("D3D11CreateDevice() failed\n");
+            return 1;
+        }
+    }
+
+    ID3D11ComputeShader *computeShader;
+    {
+        ID3DBlob *csBlob;
+        ID3DBlob *shaderCompileErrorsBlob;
+        HRESULT hResult = D3DCompile(shaderSource, sizeof(shaderSource), nullptr, nullptr, nullptr,
+                                     "cs_main", "cs_5_0", 0, 0, &csBlob, &shaderCompileErrorsBlob);
+        if(FAILED(hResult)) {
+            if(shaderCompileErrorsBlob) {
+                printf("%s\n", (const char*)shaderCompileErrorsBlob->GetBufferPointer());
+                shaderCompileErrorsBlob->Release();
+            }
+            return 1;
+        }
+        hResult = device->CreateComputeShader(csBlob->GetBufferPointer(), csBlob->GetBufferSize(), nullptr, &computeShader);
+        assert(SUCCEEDED(hResult));
+        csBlob->Release();
+    }
+
+    ID3D11Buffer *result;
+    ID3D11UnorderedAccessView *resultUAV;
+    {
+        D3D11_BUFFER_DESC desc = {};
+        desc.ByteWidth = NumElements * sizeof(UINT);
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_UNORDERED_ACCESS;
+        desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+        desc.StructureByteStride = sizeof(UINT);
+        HRESULT hResult = device->CreateBuffer(&desc, nullptr, &result);
+        assert(SUCCEEDED(hResult));
+        D3D11_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+        uavDesc.Format = DXGI_FORMAT_UNKNOWN;
+        uavDesc.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
+        uavDesc.Buffer.NumElements = NumElements;
+        hResult = device->CreateUnorderedAccessView(result, &uavDesc, &resultUAV);
+        assert(SUCCEEDED(hResult));
+    }
+
+    context->CSSetShader(computeShader, nullptr, 0);
+    context->CSSetUnorderedAccessViews(0, 1, &resultUAV, nullptr);
+
+    int failures = 0;
+    for (UINT iteration = 0; iteration < 16; iteration++) {
+        // release a source that is bound to an in-flight dispatch
+        ID3D11Buffer *source = CreateSource(device, 0xA0000000 | iteration);
+        ID3D11ShaderResourceView *sourceSRV = CreateSRV(device, source);
+        context->CSSetShaderResources(0, 1, &sourceSRV);
+        context->Dispatch(NumElements / 64, 1, 1);
+        ID3D11ShaderResourceView *nullSRV = nullptr;
+        context->CSSetShaderResources(0, 1, &nullSRV);
+        sourceSRV->Release();
+        source->Release();
+
+        // then allocate and write a new one, likely in the same range
+        ID3D11Buffer *next = CreateSource(device, 0xB0000000 | iteration);
+        std::vector<UINT> data(NumElements, 0xC0000000 | iteration);
+        context->UpdateSubresource(next, 0, nullptr, data.data(), 0, 0);
+
+        UINT mismatches = CountMismatches(device, context, result, 0xA0000000 | iteration);
+        if (mismatches) {
+            printf("iteration %u: %u elements read from a reused range\n", iteration, mismatches);
+            failures++;
+        }
+        next->Release();
+
+        // release a buffer right after creation, while its initial upload is
+        // still queued, then create another one likely in the same range
+        ID3D11Buffer *transient = CreateSource(device, 0xD0000000 | iteration);
+        transient->Release();
+        ID3D11Buffer *replacement = CreateSource(device, 0xE0000000 | iteration);
+        ID3D11ShaderResourceView *replacementSRV = CreateSRV(device, replacement);
+        context->CSSetShaderResources(0, 1, &replacementSRV);
+        context->Dispatch(NumElements / 64, 1, 1);
+        context->CSSetShaderResources(0, 1, &nullSRV);
+        replacementSRV->Release();
+        replacement->Release();
+
+        mismatches = CountMismatches(device, context, result, 0xE0000000 | iteration);
+        if (mismatches) {
+            printf("iteration %u: %u elements overwritten by a released initial upload\n", iteration, mismatches);
+            failures++;
+        }
+    }
+
+    resultUAV->Release();
+    result->Release();
+    computeShader->Release();
+    context->Release();
+    device->Release();
+
+    printf(failures ? "FAILED\n" : "PASSED\n");
+    return failures ? 1 : 0;
+}
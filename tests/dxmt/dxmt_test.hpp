@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+
+// Shared by the tests of tests/dxmt: each one is an executable that runs its
+// tests, or its benchmark when given `--benchmark`.
+
+namespace dxmt::test {
+
+inline int failures = 0;
+
+/**
+Elapsed time since construction, for benchmarks
+ */
+class Timer {
+public:
+  Timer() : begin_(std::chrono::steady_clock::now()) {}
+
+  double
+  ns() const {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin_).count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point begin_;
+};
+
+/**
+Entry point of a test executable
+ */
+inline int
+run(int argc, char **argv, std::initializer_list<void (*)()> tests, void (*benchmark)() = nullptr) {
+  if (argc > 1 && !strcmp(argv[1], "--benchmark")) {
+    if (benchmark)
+      benchmark();
+    return 0;
+  }
+  for (auto test : tests)
+    test();
+  printf(failures ? "FAILED\n" : "PASSED\n");
+  return failures ? 1 : 0;
+}
+
+} // namespace dxmt::test
+
+#define CHECK(expr)                                                                                                    \
+  do {                                                                                                                 \
+    if (!(expr)) {                                                                                                     \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr);                                                  \
+      ::dxmt::test::failures++;                                                                                        \
+    }                                                                                                                  \
+  } while (0)
@@ -0,0 +1,210 @@
+#include <cstdio>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "dxmt_argument_heap_blocks.hpp"
+#include "dxmt_test.hpp"
+
+// Sizing and recycling of argument heap blocks, independent of the device.
+
+using namespace dxmt;
+
+static void
+TestGrow() {
+  GPUArgumentHeapBlockSize size;
+  CHECK(size.value() == kGPUArgumentHeapMinBlockSize);
+  size.update(false);
+  CHECK(size.value() == kGPUArgumentHeapMinBlockSize);
+  size.update(true);
+  CHECK(size.value() == kGPUArgumentHeapMinBlockSize * 2);
+  for (unsigned i = 0; i < 64; i++)
+    size.update(true);
+  CHECK(size.value() == kGPUArgumentHeapMaxBlockSize);
+}
+
+static void
+TestShrink() {
+  GPUArgumentHeapBlockSize size;
+  size.update(true);
+  size.update(true);
+  CHECK(size.value() == kGPUArgumentHeapMinBlockSize * 4);
+  for (unsigned i = 0; i < kGPUArgumentHeapShrinkInterval - 1; i++)
+    size.update(false);
+  CHECK(size.value() == kGPUArgumentHeapMinBlockSize * 4);
+  size.update(false);
+  CHECK(size.value() == kGPUArgumentHeapMinBlockSize * 2);
+  // pressure restarts the interval
+  for (unsigned i = 0; i < kGPUArgumentHeapShrinkInterval - 1; i++)
+    size.update(false);
+  size.update(true);
+  CHECK(size.value() == kGPUArgumentHeapMinBlockSize * 4);
+  for (unsigned i = 0; i < kGPUArgumentHeapShrinkInterval - 1; i++)
+    size.update(false);
+  CHECK(size.value() == kGPUArgumentHeapMinBlockSize * 4);
+  for (unsigned i = 0; i < kGPUArgumentHeapShrinkInterval * 8; i++)
+    size.update(false);
+  CHECK(size.value() == kGPUArgumentHeapMinBlockSize);
+}
+
+static void
+TestReusable() {
+  GPUArgumentHeapBlockSize size;
+  size.update(true);
+  auto preferred = size.value();
+  CHECK(size.reusable(preferred));
+  CHECK(size.reusable(preferred * 2));
+  // outgrown
+  CHECK(!size.reusable(preferred / 2));
+  // too large once shrunk
+  CHECK(!size.reusable(preferred * 4));
+  for (unsigned i = 0; i < kGPUArgumentHeapShrinkInterval; i++)
+    size.update(false);
+  CHECK(size.reusable(preferred));
+  CHECK(!size.reusable(preferred * 2));
+}
+
+/**
+Same as GPUArgumentHeapAllocator, with blocks that aren't backed by a buffer
+ */
+struct BlockPool {
+  GPUArgumentHeapBlockQueue queue;
+  std::vector<GPUArgumentHeapBlock *> dropped;
+  unsigned created = 0;
+  unsigned destroyed = 0;
+
+  ~BlockPool() {
+    queue.clear(dropped);
+    destroy_dropped();
+  }
+
+  GPUArgumentHeapBlock *
+  acquire(uint64_t coherent_id, size_t min_size, bool under_pressure) {
+    auto block = queue.pop(coherent_id, min_size, under_pressure, dropped);
+    destroy_dropped();
+    if (block)
+      return block;
+    created++;
+    return new GPUArgumentHeapBlock{nullptr, nullptr, queue.new_block_size(min_size), 0, nullptr};
+  }
+
+  void
+  free_blocks(uint64_t coherent_id) {
+    queue.expire(coherent_id, dropped);
+    destroy_dropped();
+  }
+
+  void
+  destroy_dropped() {
+    destroyed += dropped.size();
+    for (auto block : dropped)
+      delete block;
+    dropped.clear();
+  }
+};
+
+static void
+TestReuse() {
+  BlockPool pool;
+  auto a = pool.acquire(1, 0, false);
+  CHECK(a->size == kGPUArgumentHeapMinBlockSize);
+  pool.queue.push(a, 1);
+  // chunk 1 is still in flight
+  auto b = pool.acquire(1, 0, false);
+  CHECK(b != a);
+  pool.queue.push(b, 2);
+  // reused in the order they were retired, once completed
+  CHECK(pool.acquire(3, 0, false) == a);
+  CHECK(pool.acquire(3, 0, false) == b);
+  CHECK(pool.created == 2);
+  // a chunk retires all the blocks it held
+  a->next = b;
+  pool.queue.push(a, 3);
+  CHECK(pool.queue.size() == 2);
+  CHECK(a->next == nullptr);
+  CHECK(a->last_used_seq_id == 3 && b->last_used_seq_id == 3);
+  CHECK(pool.acquire(4, 0, false) == a);
+  CHECK(pool.acquire(4, 0, false) == b);
+  pool.queue.push(a, 4);
+  pool.queue.push(b, 4);
+}
+
+static void
+TestLargeAllocation() {
+  BlockPool pool;
+  auto a = pool.acquire(1, 0, false);
+  pool.queue.push(a, 1);
+  // too small for the allocation: a new block fits it, rounded up
+  auto large = pool.acquire(2, kGPUArgumentHeapMinBlockSize + 1, false);
+  CHECK(large != a);
+  CHECK(large->size == kGPUArgumentHeapMinBlockSize * 2);
+  CHECK(pool.queue.size() == 1);
+  CHECK(pool.acquire(2, 0, false) == a);
+  pool.queue.push(a, 2);
+  pool.queue.push(large, 2);
+}
+
+static void
+TestDropAndExpire() {
+  BlockPool pool;
+  auto a = pool.acquire(1, 0, false);
+  pool.queue.push(a, 1);
+  // running out of a block doubles the block size, so `a` is outgrown
+  auto b = pool.acquire(2, 0, true);
+  // `a` is destroyed first, so `b` may be allocated at the same address
+  CHECK(pool.created == 2);
+  CHECK(b->size == kGPUArgumentHeapMinBlockSize * 2);
+  CHECK(pool.destroyed == 1);
+  pool.queue.push(b, 2);
+  pool.free_blocks(2 + kGPUArgumentHeapBlockLifetime);
+  CHECK(pool.queue.size() == 1);
+  pool.free_blocks(3 + kGPUArgumentHeapBlockLifetime);
+  CHECK(pool.queue.size() == 0);
+  CHECK(pool.destroyed == 2);
+}
+
+static void
+TestChunksInFlight() {
+  BlockPool pool;
+  const uint64_t in_flight = 3;
+  std::deque<std::pair<uint64_t, GPUArgumentHeapBlock *>> chunks;
+  std::unordered_map<GPUArgumentHeapBlock *, uint64_t> retired_by;
+  auto acquire = [&](uint64_t coherent_id) {
+    auto block = pool.acquire(coherent_id, 0, false);
+    // never handed out while the chunk that used it last may be in flight
+    auto it = retired_by.find(block);
+    CHECK(it == retired_by.end() || it->second < coherent_id);
+    retired_by.erase(block);
+    return block;
+  };
+  for (uint64_t seq_id = 1; seq_id < 2000; seq_id++) {
+    uint64_t coherent_id = seq_id > in_flight ? seq_id - in_flight : 0;
+    auto block = acquire(coherent_id);
+    // some chunks hold two blocks
+    if (seq_id % 7 == 0) {
+      auto second = acquire(coherent_id);
+      second->next = block;
+      block = second;
+    }
+    chunks.emplace_back(seq_id, block);
+    while (chunks.size() > in_flight) {
+      auto [chunk_seq_id, chain] = chunks.front();
+      for (auto cur = chain; cur; cur = cur->next)
+        retired_by[cur] = chunk_seq_id;
+      pool.queue.push(chain, chunk_seq_id);
+      chunks.pop_front();
+    }
+    pool.free_blocks(coherent_id);
+    if (test::failures)
+      return;
+  }
+  // blocks are recycled instead of being created for every chunk
+  CHECK(pool.created <= 2 * (in_flight + 2));
+  for (auto &[seq_id, block] : chunks)
+    pool.queue.push(block, seq_id);
+}
+
+int
+main(int argc, char **argv) {
+  return test::run(argc, argv, {TestGrow, TestShrink, TestReusable, TestReuse, TestLargeAllocation, TestDropAndExpire, TestChunksInFlight});
+}
@@ -0,0 +1,185 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "dxmt_argument_table_cache.hpp"
+#include "dxmt_test.hpp"
+
+// Reuse and patching of argument tables, independent of the device.
+
+using namespace dxmt;
+
+// only compared, never dereferenced
+static MTL::Buffer *const kHeap = (MTL::Buffer *)0x1000;
+static MTL::Buffer *const kOtherHeap = (MTL::Buffer *)0x2000;
+static const int kLayout = 0, kOtherLayout = 1;
+
+static void
+TestReuse() {
+  ArgumentTableCache cache;
+  bool patch;
+  uint64_t offset = ~0ull;
+
+  uint64_t *table = cache.begin(1, 1, &kLayout, 4, patch);
+  CHECK(!patch);
+  CHECK(table[0] == 0 && table[3] == 0);
+  table[0] = 10;
+  CHECK(!cache.end(kHeap, true, offset));
+  cache.insert(kHeap, 0);
+
+  // same encoder and layout: only dirty slots are written
+  table = cache.begin(1, 1, &kLayout, 4, patch);
+  CHECK(patch);
+  CHECK(table[0] == 10);
+  CHECK(cache.end(kHeap, true, offset) && offset == 0);
+
+  table = cache.begin(1, 1, &kLayout, 4, patch);
+  table[1] = 20;
+  CHECK(!cache.end(kHeap, true, offset));
+  cache.insert(kHeap, 256);
+
+  // back to the first table, still cached
+  table = cache.begin(1, 1, &kLayout, 4, patch);
+  CHECK(patch);
+  table[1] = 0;
+  CHECK(cache.end(kHeap, true, offset) && offset == 0);
+  // but not in another heap block
+  table = cache.begin(1, 1, &kLayout, 4, patch);
+  CHECK(!cache.end(kOtherHeap, true, offset));
+
+  // another encoder or layout starts from a zeroed table
+  table = cache.begin(1, 2, &kLayout, 4, patch);
+  CHECK(!patch && table[0] == 0);
+  table[0] = 10;
+  CHECK(cache.end(kHeap, true, offset) && offset == 0);
+  table = cache.begin(1, 2, &kOtherLayout, 4, patch);
+  CHECK(!patch && table[0] == 0);
+  cache.end(kHeap, true, offset);
+
+  // heap blocks may be recycled by another chunk
+  table = cache.begin(2, 2, &kOtherLayout, 4, patch);
+  CHECK(!patch);
+  table[0] = 10;
+  CHECK(!cache.end(kHeap, true, offset));
+}
+
+static void
+TestIncompleteBuilds() {
+  ArgumentTableCache cache;
+  bool patch;
+  uint64_t offset;
+
+  uint64_t *table = cache.begin(1, 1, &kLayout, 4, patch);
+  table[0] = 10;
+  cache.end(kHeap, true, offset);
+  cache.insert(kHeap, 0);
+
+  // a failed build leaves the scratch table incomplete
+  table = cache.begin(1, 1, &kLayout, 4, patch);
+  CHECK(patch);
+  table[2] = 30;
+  table = cache.begin(1, 1, &kLayout, 4, patch);
+  CHECK(!patch && table[2] == 0);
+  table[0] = 10;
+  CHECK(cache.end(kHeap, true, offset) && offset == 0);
+
+  // a table completed later is neither looked up nor patched
+  table = cache.begin(1, 1, &kLayout, 4, patch);
+  CHECK(patch);
+  CHECK(!cache.end(kHeap, false, offset));
+  table = cache.begin(1, 1, &kLayout, 4, patch);
+  CHECK(!patch);
+}
+
+static void
+TestEviction() {
+  ArgumentTableCache cache;
+  bool patch;
+  uint64_t offset;
+  for (uint64_t i = 0; i <= kArgumentTableCacheEntries; i++) {
+    uint64_t *table = cache.begin(1, 1, &kLayout, 2, patch);
+    table[0] = i + 1;
+    CHECK(!cache.end(kHeap, true, offset));
+    cache.insert(kHeap, i * 256);
+  }
+  // the oldest table has been evicted
+  uint64_t *table = cache.begin(1, 1, &kLayout, 2, patch);
+  table[0] = 1;
+  CHECK(!cache.end(kHeap, true, offset));
+  table = cache.begin(1, 1, &kLayout, 2, patch);
+  table[0] = 2;
+  CHECK(cache.end(kHeap, true, offset) && offset == 256);
+}
+
+static void
+TestBind() {
+  ArgumentTableCache cache;
+  CHECK(cache.bind(kHeap, 0, 1, 0));
+  CHECK(!cache.bind(kHeap, 0, 1, 0));
+  CHECK(cache.bind(kHeap, 256, 1, 0));
+  CHECK(cache.bind(kHeap, 256, 2, 0));
+  CHECK(cache.bind(kHeap, 256, 2, 1));
+  CHECK(cache.bind(kOtherHeap, 256, 2, 1));
+  cache.unbind();
+  CHECK(cache.bind(kOtherHeap, 256, 2, 1));
+}
+
+/**
+Draws of a stage with 32 slots, cycling between 3 materials that only differ
+in their first slot, compared to writing every table in full.
+ */
+static void
+Benchmark() {
+  const size_t qwords = 32;
+  const unsigned draws = 1000000, draws_per_encoder = 200;
+  std::vector<uint64_t> heap(qwords * draws);
+  uint64_t bindings[3][qwords];
+  for (unsigned set = 0; set < 3; set++) {
+    for (size_t i = 0; i < qwords; i++)
+      bindings[set][i] = 0x100000000ull + i;
+    bindings[set][0] = set;
+  }
+
+  ArgumentTableCache cache;
+  size_t heap_offset = 0;
+  unsigned reused = 0;
+  test::Timer timer;
+  for (unsigned draw = 0; draw < draws; draw++) {
+    auto &set = bindings[draw % 3];
+    bool patch;
+    uint64_t *table = cache.begin(1, draw / draws_per_encoder, &kLayout, qwords, patch);
+    if (patch) {
+      table[0] = set[0];
+    } else {
+      memcpy(table, set, sizeof(set));
+    }
+    uint64_t offset;
+    if (cache.end(nullptr, true, offset)) {
+      reused++;
+    } else {
+      memcpy(heap.data() + heap_offset, table, qwords * sizeof(uint64_t));
+      cache.insert(nullptr, heap_offset * sizeof(uint64_t));
+      heap_offset += qwords;
+    }
+  }
+  double cached = timer.ns() / draws;
+
+  heap_offset = 0;
+  timer = {};
+  for (unsigned draw = 0; draw < draws; draw++) {
+    memcpy(heap.data() + heap_offset, bindings[draw % 3], qwords * sizeof(uint64_t));
+    heap_offset += qwords;
+  }
+  double written = timer.ns() / draws;
+
+  printf(
+      "%u draws: cached %.1f ns/table (%u tables written), full write %.1f ns/table\n", draws, cached, draws - reused,
+      written
+  );
+}
+
+int
+main(int argc, char **argv) {
+  return test::run(argc, argv, {TestReuse, TestIncompleteBuilds, TestEviction, TestBind}, Benchmark);
+}
@@ -0,0 +1,237 @@
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "dxmt_command_stream.hpp"
+#include "dxmt_cpu_arena.hpp"
+#include "dxmt_test.hpp"
+
+// Recording and replay of chunk commands, with a stub encoding context.
+
+using namespace dxmt;
+
+struct StubContext {
+  std::vector<uint32_t> order;
+  uint64_t sum = 0;
+};
+
+using Stream = CommandStream<StubContext>;
+
+// same as CommandChunk::emit()
+template <typename F>
+static void
+Emit(CPUArena &arena, Stream &stream, F &&func) {
+  auto storage = arena.allocate(Stream::record_size<F>, Stream::record_alignment<F>);
+  stream.append(storage, std::forward<F>(func));
+}
+
+template <size_t N>
+static void
+EmitSized(CPUArena &arena, Stream &stream, uint32_t index) {
+  std::array<uint32_t, N / 4> payload;
+  payload.fill(index);
+  Emit(arena, stream, [index, payload](StubContext &ctx) {
+    for (auto value : payload) {
+      if (value != index)
+        return;
+    }
+    ctx.order.push_back(index);
+  });
+}
+
+static void
+TestReplayOrder() {
+  CPUArena arena("test");
+  Stream stream;
+  StubContext ctx;
+  const uint32_t count = 20000;
+  for (uint32_t i = 0; i < count; i++) {
+    switch (i % 4) {
+    case 0:
+      EmitSized<4>(arena, stream, i);
+      break;
+    case 1:
+      EmitSized<64>(arena, stream, i);
+      break;
+    case 2:
+      EmitSized<1024>(arena, stream, i);
+      break;
+    default:
+      EmitSized<16384>(arena, stream, i);
+      break;
+    }
+  }
+  // records are spread across many blocks of the arena
+  CHECK(arena.num_blocks() > 100);
+  CHECK(stream.size() == count);
+  stream.execute(ctx);
+  CHECK(ctx.order.size() == count);
+  for (uint32_t i = 0; i < ctx.order.size(); i++) {
+    if (ctx.order[i] != i) {
+      CHECK(ctx.order[i] == i);
+      break;
+    }
+  }
+  // replay doesn't consume the stream
+  ctx.order.clear();
+  stream.execute(ctx);
+  CHECK(ctx.order.size() == count);
+  stream.clear();
+  arena.reset();
+  CHECK(stream.empty());
+  ctx.order.clear();
+  stream.execute(ctx);
+  CHECK(ctx.order.empty());
+}
+
+static void
+TestDestroy() {
+  CPUArena arena("test");
+  Stream stream;
+  StubContext ctx;
+  auto resource = std::make_shared<int>(1);
+  for (uint32_t i = 0; i < 1000; i++) {
+    if (i % 3)
+      Emit(arena, stream, [i](StubContext &ctx) { ctx.order.push_back(i); });
+    else
+      Emit(arena, stream, [i, resource](StubContext &ctx) { ctx.order.push_back(i + *resource - 1); });
+  }
+  CHECK(resource.use_count() == 1 + 334);
+  stream.execute(ctx);
+  CHECK(ctx.order.size() == 1000);
+  CHECK(ctx.order[999] == 999);
+  // destructible commands release what they hold, and only once
+  stream.clear();
+  CHECK(resource.use_count() == 1);
+  stream.clear();
+  CHECK(resource.use_count() == 1);
+  // and so does a stream destroyed without being cleared
+  {
+    Stream other;
+    Emit(arena, other, [resource](StubContext &) {});
+    CHECK(resource.use_count() == 2);
+  }
+  CHECK(resource.use_count() == 1);
+}
+
+/**
+The previous representation: a virtual functor and a separate list node per
+command, both allocated from the arena, and a destructor walk on reset.
+ */
+struct VirtualCommand {
+  virtual void invoke(StubContext &) = 0;
+  virtual ~VirtualCommand() noexcept {};
+};
+
+template <typename F> struct VirtualCommandImpl final : VirtualCommand {
+  VirtualCommandImpl(F &&f) : func(std::forward<F>(f)) {}
+  void
+  invoke(StubContext &ctx) final {
+    func(ctx);
+  }
+  F func;
+};
+
+struct VirtualCommandList {
+  struct Node {
+    VirtualCommand *value;
+    Node *next;
+  };
+  Node head{nullptr, nullptr};
+  Node *tail = &head;
+
+  template <typename F>
+  void
+  emit(CPUArena &arena, F &&func) {
+    auto command = new (arena.allocate(sizeof(VirtualCommandImpl<F>), alignof(VirtualCommandImpl<F>)))
+        VirtualCommandImpl<F>(std::forward<F>(func));
+    auto node = new (arena.allocate(sizeof(Node), alignof(Node))) Node{command, nullptr};
+    tail->next = node;
+    tail = node;
+  }
+
+  void
+  execute(StubContext &ctx) {
+    for (auto cur = head.next; cur; cur = cur->next)
+      cur->value->invoke(ctx);
+  }
+
+  void
+  clear() {
+    for (auto cur = head.next; cur; cur = cur->next)
+      cur->value->~VirtualCommand();
+    head.next = nullptr;
+    tail = &head;
+  }
+};
+
+// typical commands capture a few pointers and offsets
+#define BENCHMARK_COMMANDS(EMIT)                                                                                       \
+  for (uint32_t i = 0; i < count; i++) {                                                                               \
+    uint64_t a = i, b = i * 3, c = i * 7;                                                                              \
+    switch (i % 3) {                                                                                                   \
+    case 0:                                                                                                            \
+      EMIT([a](StubContext &ctx) { ctx.sum += a; });                                                                   \
+      break;                                                                                                           \
+    case 1:                                                                                                            \
+      EMIT([a, b](StubContext &ctx) { ctx.sum += a ^ b; });                                                            \
+      break;                                                                                                           \
+    default:                                                                                                           \
+      EMIT([a, b, c](StubContext &ctx) { ctx.sum += a + b + c; });                                                     \
+      break;                                                                                                           \
+    }                                                                                                                  \
+  }
+
+static void
+Benchmark() {
+  const uint32_t count = 1000000;
+  const unsigned rounds = 10;
+  CPUArena arena("benchmark");
+  StubContext ctx;
+  double emit_ns = 0, encode_ns = 0, reset_ns = 0;
+  Stream stream;
+  for (unsigned round = 0; round < rounds; round++) {
+    test::Timer timer;
+    BENCHMARK_COMMANDS([&](auto &&f) { Emit(arena, stream, std::move(f)); });
+    emit_ns += timer.ns();
+    timer = {};
+    stream.execute(ctx);
+    encode_ns += timer.ns();
+    timer = {};
+    stream.clear();
+    arena.reset();
+    reset_ns += timer.ns();
+  }
+  printf(
+      "CommandStream: emit %.2f ns, encode %.2f ns, reset %.2f ns per command\n", emit_ns / count / rounds,
+      encode_ns / count / rounds, reset_ns / count / rounds
+  );
+
+  emit_ns = encode_ns = reset_ns = 0;
+  VirtualCommandList list;
+  for (unsigned round = 0; round < rounds; round++) {
+    test::Timer timer;
+    BENCHMARK_COMMANDS([&](auto &&f) { list.emit(arena, std::move(f)); });
+    emit_ns += timer.ns();
+    timer = {};
+    list.execute(ctx);
+    encode_ns += timer.ns();
+    timer = {};
+    list.clear();
+    arena.reset();
+    reset_ns += timer.ns();
+  }
+  printf(
+      "virtual functor list: emit %.2f ns, encode %.2f ns, reset %.2f ns per command (%llx)\n", emit_ns / count / rounds,
+      encode_ns / count / rounds, reset_ns / count / rounds, (unsigned long long)ctx.sum
+  );
+}
+
+int
+main(int argc, char **argv) {
+  return test::run(argc, argv, {TestReplayOrder, TestDestroy}, Benchmark);
+}
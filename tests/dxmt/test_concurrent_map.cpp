@@ -0,0 +1,176 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "dxmt_test.hpp"
+#include "thread.hpp"
+#include "util_concurrent_map.hpp"
+
+// Lock-free lookup of the pipeline and shader variant caches.
+
+using namespace dxmt;
+
+constexpr unsigned kNumThreads = 4;
+
+static void
+TestSingleThread() {
+  ConcurrentHashMap<uint64_t, uint64_t> map(16);
+  CHECK(map.find(1) == nullptr);
+  auto [first, inserted] = map.get_or_insert(1, []() -> uint64_t { return 2; });
+  CHECK(inserted && first == 2);
+  uint64_t *stable = &first;
+  // grows several times
+  for (uint64_t key = 2; key <= 1000; key++)
+    map.get_or_insert(key, [=]() { return key * 2; });
+  CHECK(map.size() == 1000);
+  CHECK(map.find(1) == stable);
+  for (uint64_t key = 1; key <= 1000; key++) {
+    auto value = map.find(key);
+    CHECK(value && *value == key * 2);
+  }
+  CHECK(map.find(1001) == nullptr);
+  auto [again, inserted_again] = map.get_or_insert(1, []() -> uint64_t { return 0; });
+  CHECK(!inserted_again && &again == stable);
+}
+
+/**
+Readers look up keys while a writer inserts them: a key is found with its
+value as soon as it's published, and stays at the same address through
+rehashes.
+ */
+static void
+TestConcurrentReaders() {
+  const uint64_t num_keys = 100000;
+  ConcurrentHashMap<uint64_t, uint64_t> map;
+  std::vector<std::atomic<uint64_t *>> published(num_keys);
+  std::atomic<uint64_t> num_published = 0;
+  std::atomic<unsigned> errors = 0;
+  std::vector<dxmt::thread> readers;
+  for (unsigned i = 0; i < kNumThreads - 1; i++) {
+    readers.emplace_back([&, i]() {
+      uint64_t seed = i + 1;
+      for (;;) {
+        uint64_t count = num_published.load(std::memory_order_acquire);
+        // probe both published and not yet published keys
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        uint64_t key = (seed >> 33) % num_keys;
+        auto value = map.find(key);
+        if (key < count && (!value || *value != ~key || value != published[key].load(std::memory_order_relaxed)))
+          errors++;
+        if (value && *value != ~key)
+          errors++;
+        if (count == num_keys)
+          break;
+      }
+    });
+  }
+  for (uint64_t key = 0; key < num_keys; key++) {
+    auto [value, inserted] = map.get_or_insert(key, [=]() { return ~key; });
+    published[key].store(&value, std::memory_order_relaxed);
+    num_published.store(key + 1, std::memory_order_release);
+  }
+  for (auto &reader : readers)
+    reader.join();
+  CHECK(errors == 0);
+  CHECK(map.size() == num_keys);
+}
+
+/**
+Threads request the same keys at the same time: every value is created
+exactly once, and all threads get the same one.
+ */
+static void
+TestCreateOnce() {
+  const uint64_t num_keys = 20000;
+  ConcurrentHashMap<uint64_t, uint64_t *> map;
+  std::vector<std::atomic<unsigned>> created(num_keys);
+  std::vector<std::atomic<unsigned>> inserted(num_keys);
+  std::vector<std::atomic<uint64_t *>> seen(num_keys);
+  std::atomic<unsigned> errors = 0;
+  std::vector<dxmt::thread> threads;
+  for (unsigned i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([&, i]() {
+      for (uint64_t n = 0; n < num_keys; n++) {
+        // half of the threads walk the keys backwards
+        uint64_t key = i & 1 ? num_keys - 1 - n : n;
+        auto [value, was_inserted] = map.get_or_insert(key, [&, key]() {
+          created[key]++;
+          return new uint64_t(key);
+        });
+        inserted[key] += was_inserted;
+        uint64_t *expected = nullptr;
+        if (!seen[key].compare_exchange_strong(expected, value) && expected != value)
+          errors++;
+        if (*value != key)
+          errors++;
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  CHECK(errors == 0);
+  CHECK(map.size() == num_keys);
+  unsigned wrong_counts = 0;
+  for (uint64_t key = 0; key < num_keys; key++) {
+    wrong_counts += created[key] != 1 || inserted[key] != 1;
+    delete *map.find(key);
+  }
+  CHECK(wrong_counts == 0);
+}
+
+template <typename Lookup>
+static double
+MeasureLookups(unsigned num_threads, uint64_t num_keys, Lookup &&lookup) {
+  const uint64_t lookups_per_thread = 2000000;
+  std::atomic<uint64_t> checksum = 0;
+  std::vector<dxmt::thread> threads;
+  test::Timer timer;
+  for (unsigned i = 0; i < num_threads; i++) {
+    threads.emplace_back([&, i]() {
+      uint64_t sum = 0, seed = i + 1;
+      for (uint64_t n = 0; n < lookups_per_thread; n++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        sum += lookup((seed >> 33) % num_keys);
+      }
+      checksum += sum;
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  return timer.ns() / lookups_per_thread;
+}
+
+/**
+Lookups of a warm cache, against the mutex-protected std::unordered_map the
+pipeline caches used before.
+ */
+static void
+Benchmark() {
+  const uint64_t num_keys = 4096;
+  ConcurrentHashMap<uint64_t, uint64_t> map;
+  std::unordered_map<uint64_t, uint64_t> locked_map;
+  dxmt::mutex mutex;
+  for (uint64_t key = 0; key < num_keys; key++) {
+    map.get_or_insert(key, [=]() { return key; });
+    locked_map.emplace(key, key);
+  }
+  for (unsigned num_threads : {1u, kNumThreads}) {
+    double lock_free = MeasureLookups(num_threads, num_keys, [&](uint64_t key) { return *map.find(key); });
+    double locked = MeasureLookups(num_threads, num_keys, [&](uint64_t key) {
+      std::lock_guard<dxmt::mutex> lock(mutex);
+      return locked_map.find(key)->second;
+    });
+    printf(
+        "%u thread(s): ConcurrentHashMap %.1f ns/lookup, locked unordered_map %.1f ns/lookup\n", num_threads, lock_free,
+        locked
+    );
+  }
+}
+
+int
+main(int argc, char **argv) {
+  return test::run(argc, argv, {TestSingleThread, TestConcurrentReaders, TestCreateOnce}, Benchmark);
+}
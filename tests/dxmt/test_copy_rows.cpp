@@ -0,0 +1,98 @@
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "dxmt_test.hpp"
+#include "util_memcpy.hpp"
+
+// Row repacking of texture uploads.
+
+using namespace dxmt;
+
+struct Layout {
+  size_t bytes_per_row;
+  size_t bytes_per_image;
+};
+
+static uint8_t
+Pattern(size_t image, size_t row, size_t byte) {
+  return (uint8_t)(image * 131 + row * 31 + byte * 7 + 1);
+}
+
+static void
+TestCopy(size_t bytes_per_row, size_t rows, size_t images, Layout dst_layout, Layout src_layout, bool streaming) {
+  std::vector<uint8_t> src(src_layout.bytes_per_image * images, 0);
+  std::vector<uint8_t> dst(dst_layout.bytes_per_image * images, 0);
+  for (size_t image = 0; image < images; image++)
+    for (size_t row = 0; row < rows; row++)
+      for (size_t byte = 0; byte < bytes_per_row; byte++)
+        src[image * src_layout.bytes_per_image + row * src_layout.bytes_per_row + byte] = Pattern(image, row, byte);
+
+  copy_rows(
+      {dst.data(), dst_layout.bytes_per_row, dst_layout.bytes_per_image},
+      {src.data(), src_layout.bytes_per_row, src_layout.bytes_per_image}, bytes_per_row, rows, images, streaming
+  );
+
+  size_t mismatches = 0, overwritten = 0;
+  for (size_t image = 0; image < images; image++) {
+    for (size_t row = 0; row < rows; row++) {
+      auto dst_row = dst.data() + image * dst_layout.bytes_per_image + row * dst_layout.bytes_per_row;
+      for (size_t byte = 0; byte < bytes_per_row; byte++)
+        mismatches += dst_row[byte] != Pattern(image, row, byte);
+      // padding of the destination is left untouched
+      if (row + 1 < rows || image + 1 < images)
+        for (size_t byte = bytes_per_row; byte < dst_layout.bytes_per_row; byte++)
+          overwritten += dst_row[byte] != 0;
+    }
+  }
+  CHECK(mismatches == 0);
+  CHECK(overwritten == 0);
+}
+
+static void
+TestLayouts() {
+  for (bool streaming : {false, true}) {
+    // contiguous
+    TestCopy(256, 64, 1, {256, 256 * 64}, {256, 256 * 64}, streaming);
+    TestCopy(256, 64, 4, {256, 256 * 64}, {256, 256 * 64}, streaming);
+    // padded rows on either side
+    TestCopy(200, 64, 1, {256, 256 * 64}, {200, 200 * 64}, streaming);
+    TestCopy(200, 64, 1, {200, 200 * 64}, {256, 256 * 64}, streaming);
+    // unaligned widths, padded images
+    TestCopy(37, 13, 3, {64, 64 * 16}, {40, 40 * 14}, streaming);
+    // contiguous rows within padded images
+    TestCopy(128, 32, 3, {128, 128 * 40}, {128, 128 * 32}, streaming);
+    // split across workers: 16MB or more
+    TestCopy(4096, 4096, 1, {4096 + 256, (4096 + 256) * 4096}, {4096, 4096 * 4096}, streaming);
+    TestCopy(4096, 512, 9, {4096, 4096 * 512}, {4096, 4096 * 520}, streaming);
+  }
+  // nothing to copy
+  copy_rows({nullptr, 0, 0}, {nullptr, 0, 0}, 0, 0, 0, false);
+}
+
+static void
+Benchmark() {
+  const size_t bytes_per_row = 4096 * 4, rows = 4096;
+  const size_t src_pitch = bytes_per_row, dst_pitch = bytes_per_row + 256;
+  std::vector<uint8_t> src(src_pitch * rows, 1);
+  std::vector<uint8_t> dst(dst_pitch * rows, 0);
+  for (bool streaming : {false, true}) {
+    const unsigned iterations = 20;
+    test::Timer timer;
+    for (unsigned i = 0; i < iterations; i++)
+      copy_rows(
+          {dst.data(), dst_pitch, dst_pitch * rows}, {src.data(), src_pitch, src_pitch * rows}, bytes_per_row, rows, 1,
+          streaming
+      );
+    double seconds = timer.ns() * 1e-9;
+    printf(
+        "copy_rows %zux%zu%s: %.2f GB/s\n", bytes_per_row, rows, streaming ? " streaming" : "",
+        (double)bytes_per_row * rows * iterations / seconds / 1e9
+    );
+  }
+}
+
+int
+main(int argc, char **argv) {
+  return test::run(argc, argv, {TestLayouts}, Benchmark);
+}
@@ -0,0 +1,65 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "dxmt_test.hpp"
+#include "xxhash/xxhash_util.hpp"
+
+// Content hashing of shaders and pipeline descriptions.
+
+using namespace dxmt;
+
+static void
+TestKnownValues() {
+  CHECK(Xxh3Hash::compute(nullptr, 0).toString() == "99aa06d3014798d86001c324468d497f");
+  CHECK(Xxh3Hash::compute(nullptr, 0) == Xxh3Hash(0x6001c324468d497full, 0x99aa06d3014798d8ull));
+}
+
+static void
+TestContent() {
+  std::vector<uint8_t> data(100000);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = i * 2654435761u >> 24;
+  auto hash = Xxh3Hash::compute(data.data(), data.size());
+  // only the content matters, not where it is
+  std::vector<uint8_t> unaligned(data.size() + 1);
+  memcpy(unaligned.data() + 1, data.data(), data.size());
+  CHECK(Xxh3Hash::compute(unaligned.data() + 1, data.size()) == hash);
+  // every byte and the length matter
+  for (size_t i : {size_t(0), size_t(1), size_t(4095), size_t(65536), data.size() - 1}) {
+    data[i] ^= 1;
+    CHECK(Xxh3Hash::compute(data.data(), data.size()) != hash);
+    data[i] ^= 1;
+  }
+  CHECK(Xxh3Hash::compute(data.data(), data.size() - 1) != hash);
+  struct {
+    uint32_t a, b;
+  } desc = {1, 2};
+  CHECK(Xxh3Hash::compute(desc) == Xxh3Hash::compute(&desc, sizeof(desc)));
+}
+
+static void
+Benchmark() {
+  // pipeline descriptions, small and large DXBC shaders
+  for (size_t size : {64, 4096, 65536, 1 << 20}) {
+    std::vector<uint8_t> data(size, 1);
+    const size_t iterations = (size_t(256) << 20) / size;
+    uint64_t checksum = 0;
+    test::Timer timer;
+    for (size_t i = 0; i < iterations; i++) {
+      data[0] = i;
+      checksum += Xxh3Hash::compute(data.data(), size).low64();
+    }
+    double ns = timer.ns();
+    printf(
+        "XXH3-128 of %zu bytes: %.1f ns, %.2f GB/s (%llx)\n", size, ns / iterations, size * iterations / ns,
+        (unsigned long long)checksum
+    );
+  }
+}
+
+int
+main(int argc, char **argv) {
+  return test::run(argc, argv, {TestKnownValues, TestContent}, Benchmark);
+}
@@ -0,0 +1,178 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "dxmt_heap_allocator.hpp"
+#include "dxmt_test.hpp"
+
+// Placement of ranges in a heap, independent of the device.
+
+using namespace dxmt;
+
+static void
+TestSplit() {
+  HeapRangeAllocator heap(1024);
+  uint64_t a = heap.allocate(256, 1);
+  uint64_t b = heap.allocate(256, 1);
+  CHECK(a == 0);
+  CHECK(b == 256);
+  CHECK(heap.allocated() == 512);
+  // the remainder stays a single free range
+  CHECK(heap.largest_free_range() == 512);
+  heap.free(a, 256);
+  // the hole left by `a` is in a smaller size class than the tail
+  CHECK(heap.allocate(128, 1) == 0);
+  CHECK(heap.largest_free_range() == 512);
+}
+
+static void
+TestCoalesce() {
+  HeapRangeAllocator heap(1024);
+  uint64_t a = heap.allocate(256, 1);
+  uint64_t b = heap.allocate(256, 1);
+  uint64_t c = heap.allocate(256, 1);
+  uint64_t d = heap.allocate(256, 1);
+  CHECK(heap.largest_free_range() == 0);
+  heap.free(a, 256);
+  heap.free(c, 256);
+  CHECK(heap.largest_free_range() == 256);
+  // merged with both neighbors
+  heap.free(b, 256);
+  CHECK(heap.largest_free_range() == 768);
+  heap.free(d, 256);
+  CHECK(heap.empty());
+  CHECK(heap.largest_free_range() == 1024);
+  CHECK(heap.allocate(1024, 1) == 0);
+}
+
+static void
+TestSizeClasses() {
+  HeapRangeAllocator heap(4096);
+  uint64_t a = heap.allocate(100, 1);
+  heap.allocate(16, 1);
+  uint64_t b = heap.allocate(300, 1);
+  heap.allocate(16, 1);
+  heap.free(a, 100);
+  heap.free(b, 300);
+  // the smallest size class that fits is picked, not the first free range
+  CHECK(heap.allocate(90, 1) == a);
+  CHECK(heap.allocate(200, 1) == b);
+  // a range of the exact size class is used if it fits
+  uint64_t c = heap.allocate(1000, 1);
+  heap.allocate(16, 1);
+  heap.free(c, 1000);
+  CHECK(heap.allocate(1000, 1) == c);
+}
+
+static void
+TestAlignment() {
+  HeapRangeAllocator heap(4096);
+  CHECK(heap.allocate(10, 1) == 0);
+  uint64_t aligned = heap.allocate(256, 256);
+  CHECK(aligned == 256);
+  // the padding before an aligned range remains usable
+  CHECK(heap.allocate(200, 8) == 16);
+  CHECK(heap.allocate(1024, 1024) == 1024);
+  CHECK(heap.allocated() == 10 + 256 + 200 + 1024);
+  // a range large enough, but not once aligned, is skipped
+  HeapRangeAllocator small(768);
+  CHECK(small.allocate(64, 1) == 0);
+  CHECK(small.allocate(512, 512) == kHeapRangeInvalid);
+  CHECK(small.allocate(512, 64) == 64);
+}
+
+static void
+TestExhaustion() {
+  HeapRangeAllocator heap(1024);
+  CHECK(heap.allocate(0, 1) == kHeapRangeInvalid);
+  CHECK(heap.allocate(2048, 1) == kHeapRangeInvalid);
+  std::vector<uint64_t> offsets;
+  for (unsigned i = 0; i < 8; i++)
+    offsets.push_back(heap.allocate(128, 128));
+  CHECK(heap.allocated() == 1024);
+  CHECK(heap.allocate(1, 1) == kHeapRangeInvalid);
+  // fragmented: enough free bytes, but no range of the size
+  for (unsigned i = 0; i < 8; i += 2)
+    heap.free(offsets[i], 128);
+  CHECK(heap.allocated() == 512);
+  CHECK(heap.allocate(256, 1) == kHeapRangeInvalid);
+  CHECK(heap.allocate(128, 1) != kHeapRangeInvalid);
+}
+
+static void
+TestRandom() {
+  struct Range {
+    uint64_t offset;
+    uint64_t size;
+  };
+  const uint64_t size = 1 << 20;
+  HeapRangeAllocator heap(size);
+  std::vector<uint8_t> owner(size, 0);
+  std::vector<Range> live;
+  std::mt19937 rng(1);
+  for (unsigned i = 0; i < 20000; i++) {
+    if (live.empty() || rng() % 3) {
+      uint64_t range_size = 1 + rng() % 8192;
+      uint64_t alignment = 1ull << (rng() % 9);
+      uint64_t offset = heap.allocate(range_size, alignment);
+      if (offset == kHeapRangeInvalid)
+        continue;
+      CHECK((offset & (alignment - 1)) == 0);
+      CHECK(offset + range_size <= size);
+      for (uint64_t j = offset; j < offset + range_size; j++)
+        CHECK(owner[j]++ == 0);
+      live.push_back({offset, range_size});
+    } else {
+      size_t index = rng() % live.size();
+      Range range = live[index];
+      live[index] = live.back();
+      live.pop_back();
+      memset(owner.data() + range.offset, 0, range.size);
+      heap.free(range.offset, range.size);
+    }
+    if (test::failures)
+      return;
+  }
+  for (auto &range : live)
+    heap.free(range.offset, range.size);
+  CHECK(heap.empty());
+  CHECK(heap.largest_free_range() == size);
+}
+
+static void
+Benchmark() {
+  const uint64_t size = 64 << 20;
+  HeapRangeAllocator heap(size);
+  std::vector<std::pair<uint64_t, uint64_t>> live;
+  std::mt19937 rng(1);
+  const unsigned count = 1000000;
+  unsigned failed = 0;
+  test::Timer timer;
+  for (unsigned i = 0; i < count; i++) {
+    if (live.size() < 512 && (live.empty() || rng() % 2)) {
+      uint64_t range_size = 256 + rng() % (256 << 10);
+      uint64_t offset = heap.allocate(range_size, 256);
+      if (offset == kHeapRangeInvalid) {
+        failed++;
+        continue;
+      }
+      live.push_back({offset, range_size});
+    } else {
+      size_t index = rng() % live.size();
+      heap.free(live[index].first, live[index].second);
+      live[index] = live.back();
+      live.pop_back();
+    }
+  }
+  double ns = timer.ns();
+  printf("%u operations, %.1f ns/op, %u failed allocations\n", count, ns / count, failed);
+}
+
+int
+main(int argc, char **argv) {
+  return test::run(
+      argc, argv, {TestSplit, TestCoalesce, TestSizeClasses, TestAlignment, TestExhaustion, TestRandom}, Benchmark
+  );
+}
@@ -0,0 +1,102 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "d3d11_shader_variants.hpp"
+#include "dxmt_test.hpp"
+#include "thread.hpp"
+
+// Creation and compile submission of shader variants, with a stub compiled
+// shader in place of the device.
+
+using namespace dxmt;
+
+constexpr unsigned kNumThreads = 8;
+
+struct StubCompiledShader {
+  uint32_t variant;
+  std::atomic<unsigned> submitted = 0;
+
+  StubCompiledShader(uint32_t variant) : variant(variant) {}
+};
+
+using Table = ShaderVariantTable<uint32_t, StubCompiledShader>;
+
+/**
+Contexts encode draws with a shared shader at the same time: each variant is
+created and submitted for compilation exactly once, and every context gets
+the variant that has been submitted.
+ */
+static void
+TestCreateAndSubmitOnce() {
+  // far more variants than the initial capacity, so the table grows under load
+  const uint32_t num_variants = 64;
+  const unsigned rounds = 200;
+  for (unsigned round = 0; round < rounds; round++) {
+    Table table;
+    std::vector<std::atomic<unsigned>> created(num_variants);
+    std::vector<std::atomic<StubCompiledShader *>> seen(num_variants);
+    std::atomic<unsigned> errors = 0;
+    std::atomic<unsigned> ready = 0;
+    std::vector<dxmt::thread> threads;
+    for (unsigned i = 0; i < kNumThreads; i++) {
+      threads.emplace_back([&, i]() {
+        ready++;
+        while (ready < kNumThreads) {
+        }
+        for (uint32_t n = 0; n < num_variants; n++) {
+          // half of the threads walk the variants backwards
+          uint32_t variant = i & 1 ? num_variants - 1 - n : n;
+          auto compiled = table.get(
+              variant,
+              [&, variant]() {
+                created[variant]++;
+                return std::make_unique<StubCompiledShader>(variant);
+              },
+              [&](StubCompiledShader *compiled) { compiled->submitted++; }
+          );
+          StubCompiledShader *expected = nullptr;
+          if (!seen[variant].compare_exchange_strong(expected, compiled) && expected != compiled)
+            errors++;
+          if (compiled->variant != variant)
+            errors++;
+        }
+      });
+    }
+    for (auto &thread : threads)
+      thread.join();
+    CHECK(errors == 0);
+    CHECK(table.size() == num_variants);
+    unsigned wrong_counts = 0;
+    for (uint32_t variant = 0; variant < num_variants; variant++)
+      wrong_counts += created[variant] != 1 || seen[variant].load()->submitted != 1;
+    CHECK(wrong_counts == 0);
+    if (test::failures)
+      return;
+  }
+}
+
+static void
+TestLookupDoesNotSubmit() {
+  Table table;
+  unsigned created = 0, submitted = 0;
+  auto create = [&]() {
+    created++;
+    return std::make_unique<StubCompiledShader>(7);
+  };
+  auto submit = [&](StubCompiledShader *) { submitted++; };
+  auto first = table.get(7, create, submit);
+  CHECK(created == 1 && submitted == 1);
+  for (unsigned i = 0; i < 10; i++)
+    CHECK(table.get(7, create, submit) == first);
+  CHECK(created == 1 && submitted == 1);
+  CHECK(table.get(8, create, submit) != first);
+  CHECK(created == 2 && submitted == 2);
+}
+
+int
+main(int argc, char **argv) {
+  return test::run(argc, argv, {TestCreateAndSubmitOnce, TestLookupDoesNotSubmit});
+}